@@ -0,0 +1,52 @@
+/* Times a lexer over a file, to pick the backend for a grammar:
+ *   make bench-backend GRAMMAR=../examples/csyntax.nlex INPUT=some-file
+ * builds GRAMMAR with `--backend code' and `--backend table', and runs both
+ * over INPUT. It is compiled with the lexer's --header included first */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <input> [rounds]\n", argv[0]);
+    return 1;
+  }
+  int rounds = argc > 2 ? atoi(argv[2]) : 10;
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *input = malloc(size + 1);
+  size = fread(input, 1, size, f);
+  input[size] = 0;
+  fclose(f);
+
+  struct sresult res;
+  long tokens = 0, failures = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; ++r) {
+    __nlex_feed(input);
+    while (__nlex_distance() < size) {
+      __nlex_root(&res);
+      if (res.errc == 0 && res.length > 0) {
+        ++tokens;
+      } else {
+        /* step over what doesn't match, like skip_on_error */
+        ++failures;
+        __nlex_skip();
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%ld tokens, %ld failures, %.3f ms per round, %.1f MB/s\n",
+         tokens / rounds, failures / rounds, seconds * 1000 / rounds,
+         size * rounds / seconds / 1e6);
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Microbenchmark of the Viterbi max-plus kernel against its scalar version,
+// and of the beam-pruned trigram decoder against the exact bigram one
+//   make bench && ./bench_viterbi
+#include "hmm.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+#include "hmm.cc"
+
+using namespace nlex::POSTag;
+
+template <class Kernel>
+static double run(Kernel kernel, const std::vector<float> &trans, int n,
+                  int rounds, std::vector<float> &best, std::vector<int> &arg) {
+  std::vector<float> prev(n);
+  for (auto i = 0; i < n; ++i)
+    prev[i] = -i * 0.5f;
+  auto start = std::chrono::steady_clock::now();
+  for (auto r = 0; r < rounds; ++r) {
+    kernel(prev.data(), trans.data(), n, best.data(), arg.data());
+    // feed the result back in, like consecutive words do
+    for (auto i = 0; i < n; ++i)
+      prev[i] = best[i] * 0.5f;
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / rounds;
+}
+
+// A random trigram model with `n' tags
+static std::string random_model(std::mt19937 &rng, int n, int words) {
+  std::uniform_real_distribution<float> logp{-12, 0};
+  Model m;
+  for (auto i = 0; i < n; ++i)
+    m.tags.push_back("T" + std::to_string(i));
+  for (auto i = 0; i < words; ++i)
+    m.words["w" + std::to_string(i)] = i;
+  m.order = 3;
+  m.transitions.resize(n * n);
+  m.trigrams.resize(n * n * n);
+  m.emissions.resize((words + 1) * n);
+  for (auto *v : {&m.transitions, &m.trigrams, &m.emissions})
+    for (auto &p : *v)
+      p = logp(rng);
+  return write_model(m);
+}
+
+static void decoders(std::mt19937 &rng, int n) {
+  auto blob = random_model(rng, n, 1000);
+  ModelView m;
+  m.open(blob.data(), blob.size());
+  std::vector<std::vector<int>> sentences(200);
+  for (auto &s : sentences) {
+    s.resize(5 + rng() % 40);
+    for (auto &w : s)
+      w = rng() % 1000;
+  }
+  std::vector<int> tags(64), exact(64);
+  auto time = [&](auto decode) {
+    auto start = std::chrono::steady_clock::now();
+    size_t words = 0;
+    for (auto &s : sentences) {
+      decode(s, tags.data());
+      words += s.size();
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / words;
+  };
+
+  Lattice lattice;
+  auto bigram = time([&](std::vector<int> &s, int *tags) {
+    viterbi(m, s.data(), s.size(), tags, lattice);
+  });
+  std::printf("%4d tags: bigram %9.1f ns/word\n", n, bigram);
+  TrigramViterbi decoder;
+  auto full = (n + 1) * n;
+  for (auto beam : {4, 16, 64, 256, full}) {
+    if (beam > full)
+      continue;
+    auto trigram = time([&](std::vector<int> &s, int *tags) {
+      viterbi(m, s.data(), s.size(), tags, decoder, beam);
+    });
+    // agreement with the exact (unpruned) trigram tags
+    size_t same = 0, words = 0;
+    for (auto &s : sentences) {
+      viterbi(m, s.data(), s.size(), tags.data(), decoder, beam);
+      viterbi(m, s.data(), s.size(), exact.data(), decoder, full);
+      for (auto i = 0u; i < s.size(); ++i)
+        same += tags[i] == exact[i];
+      words += s.size();
+    }
+    std::printf("           trigram, beam %5d %9.1f ns/word (%.2fx bigram), "
+                "%.1f%% of tags exact\n",
+                beam, trigram, trigram / bigram, 100.0 * same / words);
+  }
+}
+
+int main() {
+  std::mt19937 rng{42};
+  std::uniform_real_distribution<float> logp{-12, 0};
+  // Universal Dependencies, Penn Treebank, and a larger tagset
+  for (auto n : {17, 45, 128}) {
+    std::vector<float> trans(n * n);
+    for (auto &t : trans)
+      t = logp(rng);
+    std::vector<float> sbest(n), vbest(n);
+    std::vector<int> sarg(n), varg(n);
+    auto rounds = 20000000 / (n * n);
+    auto scalar = run(max_plus_scalar, trans, n, rounds, sbest, sarg);
+    auto vector = run(max_plus, trans, n, rounds, vbest, varg);
+    std::printf("%4d tags: scalar %9.1f ns/word, vector %9.1f ns/word "
+                "(%.2fx)%s\n",
+                n, scalar, vector, scalar / vector,
+                sbest == vbest && sarg == varg ? "" : " MISMATCH");
+  }
+  for (auto n : {17, 45})
+    decoders(rng, n);
+}
@@ -83,5 +83,9 @@ public:
       DFANode<std::set<NFANode<T> *>> *node,
       std::set<DFANode<std::set<NFANode<T> *>> *> visited,
       std::map<DFANode<std::set<NFANode<T> *>> *, llvm::BasicBlock *> &blocks);
+  void generate_capture_replay(DFANode<std::set<NFANode<T> *>> *root);
+  bool has_inline_code(DFANode<std::set<NFANode<T> *>> *root);
+  bool build_table(DFANode<std::set<NFANode<T> *>> *root,
+                   nlvm::DFATable &table);
   virtual std::string output(const GenLexer &&lexer_stuff = {});
 };
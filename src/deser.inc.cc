@@ -1,91 +1,197 @@
 #include "hmm.hpp"
-#include "serialise.hpp"
-#include <list>
-#include <queue>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #define ONLY_VITERBI_INCLUDE
 #include "hmm.cc"
 #undef ONLY_VITERBI_INCLUDE
 
-static std::array<nlex::POSTag::TType, 2> _m_value;
-static bool _m_initd = false;
+static nlex::POSTag::ModelView _m_model;
+static nlex::POSTag::StreamingViterbi _m_decoder;
+static nlex::POSTag::TrigramViterbi _m_trigram_decoder;
+static bool _m_decoder_ready = false;
+static void *_m_mapped = nullptr;
+static size_t _m_mapped_size = 0;
 extern "C" char const __nlex_postag_data;
 extern "C" int const __nlex_postag_data_length;
-extern "C" char const __nlex_ptag;
-extern "C" void __nlex_root(void *);
-
-struct _sresult {
-  char const *start;
-  int length;
-  char const *tag;
-  char errc;
-  unsigned char metadata;
-  char *POS;
-};
-
-static std::queue<std::pair<bool, std::list<_sresult>>> data_store{};
-static bool last_entry_complete = false;
-
-extern "C" nlex::POSTag::TType *__nlex_get_deser_postag_TS() noexcept {
-  if (_m_initd)
-    return _m_value.data();
-  std::istringstream iss{
-      std::string(&__nlex_postag_data, __nlex_postag_data_length)};
-  iss >> bits(_m_value);
-  _m_initd = true;
-  return _m_value.data();
+extern "C" int const __nlex_postag_beam;
+extern "C" void __nlex_feed(char const *);
+
+#include "postag_ring.h"
+
+extern "C" nlex::POSTag::ModelView *__nlex_get_postag_model() noexcept {
+  // the compiled model is used in place
+  if (!_m_model.valid())
+    _m_model.open(&__nlex_postag_data, __nlex_postag_data_length);
+  return &_m_model;
 }
-static bool _m_toplevel = true;
-
-extern "C" void __nlex_apply_postag(_sresult *val) {
-  bool vv = data_store.size() == 0;
-  bool topl = _m_toplevel;
-  if (val->errc == 0 && val->length > 0) {
-    if (last_entry_complete) {
-      last_entry_complete = false;
-      std::list<_sresult> list{};
-      list.push_back({strndup(val->start, val->length), val->length, val->tag,
-                      val->errc, val->metadata, nullptr});
-      data_store.push({false, list});
-    } else {
-      if (vv)
-        data_store.push({false, {}});
-      data_store.back().second.push_back({strndup(val->start, val->length),
-                                          val->length, val->tag, val->errc,
-                                          val->metadata, nullptr});
-    }
-    if (strcmp(val->tag, &__nlex_ptag) == 0)
-      last_entry_complete = true;
-    else if (!last_entry_complete) {
-      _m_toplevel = false;
-      __nlex_root(val);
-      _m_toplevel = topl;
-    }
+
+// Tag with the compiled model in the file at `path' (mmap'd) instead of the
+// one built into the lexer; this is meant to be called before feeding the
+// input. Returns 0 on success, -1 if it can't be read or isn't a compiled
+// model.
+extern "C" int nlex_postag_load_model(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+  nlex::POSTag::ModelView model;
+  if (!model.open(static_cast<const char *>(data), st.st_size)) {
+    munmap(data, st.st_size);
+    return -1;
   }
-  if (!_m_toplevel)
-    return;
-
-  if (data_store.size() == 0)
-    return;
-
-  // now we have at least one sentence ready
-  // we will simply tag it (if it isn't already) and return the first
-  auto &sentv = data_store.front();
-  auto &sent = sentv.second;
-
-  if (!sentv.first) {
-    auto *TS = __nlex_get_deser_postag_TS();
-    std::vector<std::string> inp;
-    for (auto &s : sent)
-      inp.push_back(std::string(s.start, s.length));
-    auto rvec = nlex::POSTag::viterbi(TS[1], TS[0], inp);
-    auto it = sent.begin();
-    for (auto i{0}; i < rvec.size(); ++i, std::advance(it, 1))
-      it->POS = strdup(rvec[i].c_str());
-    sentv.first = true;
+  if (_m_mapped)
+    munmap(_m_mapped, _m_mapped_size);
+  _m_mapped = data;
+  _m_mapped_size = st.st_size;
+  _m_model = model;
+  _m_decoder_ready = false;
+  return 0;
+}
+// set while nlex_tag_document reads the tokens itself
+static bool _m_collecting = false;
+
+static bool trigram_model() { return __nlex_get_postag_model()->order() == 3; }
+
+// The hooks of postag_ring.h, over the streaming decoders of hmm.cc
+static int tag_word(char const *word, int length) {
+  auto *model = __nlex_get_postag_model();
+  if (!_m_decoder_ready) {
+    if (trigram_model())
+      _m_trigram_decoder.reset(*model, lattice_window(), __nlex_postag_beam);
+    else
+      _m_decoder.reset(*model, lattice_window());
+    _m_decoder_ready = true;
   }
-  *val = sent.front();
-  sent.pop_front();
-  if (sent.size() == 0)
-    data_store.pop();
+  auto id = model->word_id(word, length);
+  return trigram_model() ? _m_trigram_decoder.push(*model, id, m_tags)
+                         : _m_decoder.push(*model, id, m_tags);
+}
+
+static int finish_sentence() {
+  return trigram_model() ? _m_trigram_decoder.finish(m_tags)
+                         : _m_decoder.finish(m_tags);
+}
+
+static int sentence_length() {
+  return trigram_model() ? _m_trigram_decoder.length() : _m_decoder.length();
+}
+
+static char const *tag_name(int tag) {
+  return __nlex_get_postag_model()->tag(tag);
+}
+
+extern "C" void __nlex_apply_postag(sresult *val) {
+  if (!_m_collecting)
+    apply_postag(val);
+}
+
+// Tags sentences of a document (they start at `bounds'), taking the next one
+// from `next' until there are none left
+static void tag_sentences(const nlex::POSTag::ModelView *model,
+                          sresult *tokens, const std::vector<size_t> &bounds,
+                          std::atomic<size_t> &next) {
+  nlex::POSTag::Lattice lattice;
+  nlex::POSTag::TrigramViterbi trigram_decoder;
+  std::vector<int> words, tags;
+  for (size_t i; (i = next++) + 1 < bounds.size();) {
+    auto *sentence = tokens + bounds[i];
+    int n = bounds[i + 1] - bounds[i];
+    if (n == 1 && sentence[0].errc == NLEX_ERRC_SKIPPED)
+      continue;
+    words.resize(n);
+    tags.resize(n);
+    for (auto j = 0; j < n; ++j)
+      words[j] = model->word_id(sentence[j].start, sentence[j].length);
+    if (model->order() == 3)
+      nlex::POSTag::viterbi(*model, words.data(), n, tags.data(),
+                            trigram_decoder, __nlex_postag_beam);
+    else
+      nlex::POSTag::viterbi(*model, words.data(), n, tags.data(), lattice);
+    for (auto j = 0; j < n; ++j)
+      sentence[j].pos = model->tag(tags[j]);
+  }
+}
+
+// Tokenises `text' up to its end or the first error (runs skipped by
+// `skip_on_error' are kept, untagged), and tags its sentences on `threads'
+// threads (0 for one per core) instead of while the tokens are read. Returns
+// the tokens in order, in one malloc'd block that also holds their bytes
+// (free() it), and their number in `count'; null if out of memory.
+// This feeds `text' to the lexer: what is left of the input given to
+// __nlex_feed is dropped. It returns null (with a count of 0) and leaves the
+// lexer alone while __nlex_root still has tokens of that input to hand out.
+extern "C" sresult *nlex_tag_document(const char *text, int threads,
+                                      size_t *count) {
+  *count = 0;
+  if (m_tail != m_head)
+    return nullptr;
+  std::vector<sresult> tokens;
+  std::vector<size_t> bounds{0}; // where each sentence starts
+  std::string bytes;
+  sresult val{};
+  _m_collecting = true;
+  __nlex_feed(text);
+  while (true) {
+    __nlex_root(&val);
+    bool skipped = val.errc == NLEX_ERRC_SKIPPED && val.length > 0;
+    if ((val.errc != 0 && !skipped) || val.length <= 0)
+      break;
+    // a skipped run is a sentence of its own, and is left untagged
+    if (skipped && bounds.back() != tokens.size())
+      bounds.push_back(tokens.size());
+    tokens.push_back(val);
+    // keep the offset of the bytes until they stop moving
+    tokens.back().start = reinterpret_cast<const char *>(bytes.size());
+    bytes.append(val.start, val.length);
+    if (skipped || strcmp(val.tag, &__nlex_ptag) == 0 ||
+        (__nlex_postag_max_sentence > 0 &&
+         tokens.size() - bounds.back() >= (size_t)__nlex_postag_max_sentence))
+      bounds.push_back(tokens.size());
+  }
+  _m_collecting = false;
+  if (bounds.back() != tokens.size())
+    bounds.push_back(tokens.size());
+
+  auto *result = static_cast<sresult *>(
+      malloc(tokens.size() * sizeof(sresult) + bytes.size() + 1));
+  if (!result)
+    return nullptr;
+  auto *result_bytes = reinterpret_cast<char *>(result + tokens.size());
+  memcpy(result_bytes, bytes.data(), bytes.size());
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    result[i] = tokens[i];
+    result[i].start =
+        result_bytes + reinterpret_cast<size_t>(tokens[i].start);
+  }
+
+  // Viterbi over different sentences is independent
+  auto *model = __nlex_get_postag_model();
+  size_t workers = threads > 0 ? threads : std::thread::hardware_concurrency();
+  workers = std::max<size_t>(std::min(workers, bounds.size() - 1), 1);
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < workers; ++i)
+    try {
+      pool.emplace_back(tag_sentences, model, result, std::cref(bounds),
+                        std::ref(next));
+    } catch (const std::system_error &) {
+      break; // make do with fewer
+    }
+  tag_sentences(model, result, bounds, next);
+  for (auto &thread : pool)
+    thread.join();
+
+  *count = tokens.size();
+  return result;
 }
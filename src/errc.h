@@ -0,0 +1,18 @@
+/* The error codes a lexer leaves in sresult.errc. Shared by the compiler
+ * (vm.hpp, which also writes them into --header as enum nlex_errc) and the
+ * runtimes (deser.inc.cc, postag.inc.c, rts.c), so keep this plain C */
+#pragma once
+
+/* X(name, value, what it means) */
+#define NLEX_ERRCS(X)                                                          \
+  X(NONE, 0, "a token")                                                        \
+  X(NO_MATCH, 1, "nothing matched")                                            \
+  X(TABLE_DFA, 42, "the table DFA found no token")                             \
+  X(DEPTH_LIMIT, 43, "subexpression calls nested deeper than subexpr_depth_limit") \
+  X(SKIPPED, 44, "a run skipped by skip_on_error, there is more after it")
+
+enum nlex_errc {
+#define NLEX_ERRC_ENUMERATOR(name, value, what) NLEX_ERRC_##name = value,
+  NLEX_ERRCS(NLEX_ERRC_ENUMERATOR)
+#undef NLEX_ERRC_ENUMERATOR
+};
@@ -36,4 +36,10 @@ struct GenLexer {
   std::vector<std::string> kdefines;
   std::optional<TagPosSpecifier> tagpos;
   int total_capturing_groups;
+  std::map<std::string, int> option_values; // `option name <number>'
+  bool has_backreferences; // needs the capture indices
+  std::vector<std::string>
+      tag_order; // the `::' rules and literal tags, as they are declared
+  std::map<std::string, std::set<std::string>>
+      option_lists; // `option name [a b c]'
 };
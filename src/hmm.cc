@@ -1,157 +1,834 @@
 // #include <jansson.h>
 #include "hmm.hpp"
 #include "cassert"
-#include "serialise.hpp"
+#include <fstream>
 #include <math.h>
+#include <sstream>
+#ifndef ONLY_VITERBI_INCLUDE
+#include "termdisplay.hpp"
+#include <fcntl.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <thread>
+#include <unistd.h>
+
+extern Display::SingleLineTermStatus slts;
+#endif
 
 namespace nlex {
 namespace POSTag {
 
-class Node {
-public:
-  std::string prev;
-  double value;
+constexpr auto DEFAULT_SCORE{-100};
 
-  Node(std::string prev, double value) : prev(std::move(prev)), value(value) {}
+Model make_model(TType &S, TType &T) {
+  Model m;
+  std::map<std::string, int> tag_ids;
+  for (auto &s : S) {
+    tag_ids[s.first] = m.tags.size();
+    m.tags.push_back(s.first);
+  }
+  // words are numbered in order, so the ids don't depend on the hash
+  std::map<std::string, int> word_ids;
+  for (auto &s : S)
+    for (auto &w : s.second)
+      word_ids.insert({w.first, 0});
+  for (auto &w : word_ids) {
+    w.second = m.words.size();
+    m.words[w.first] = w.second;
+  }
 
-  Node(const Node &) = default;
-  Node() : prev({}), value(-1000000) {}
-};
+  auto N = m.tag_count();
+  m.transitions.assign(N * N, DEFAULT_SCORE);
+  for (auto &p : T) {
+    auto prev = tag_ids.find(p.first);
+    if (prev == tag_ids.end())
+      continue;
+    for (auto &c : p.second) {
+      auto cur = tag_ids.find(c.first);
+      if (cur != tag_ids.end())
+        m.transitions[prev->second * N + cur->second] = c.second;
+    }
+  }
+  m.emissions.assign((word_ids.size() + 1) * N, DEFAULT_SCORE);
+  for (auto &s : S)
+    for (auto &w : s.second)
+      m.emissions[word_ids[w.first] * N + tag_ids[s.first]] = w.second;
+  return m;
+}
 
-struct vnode {
-  std::string first;
-  Node second;
-  vnode(const std::pair<std::string, Node> &&f)
-      : first(f.first), second(f.second) {}
-  vnode(const std::pair<std::string, Node> &f)
-      : first(f.first), second(f.second) {}
-  vnode(const std::string &first, const Node &second)
-      : first(first), second(second) {}
-
-  explicit operator std::pair<std::string, Node>() { return {first, second}; }
-};
+bool ModelView::open(const char *data, size_t size) {
+  base = nullptr;
+  if (size < sizeof header || (uintptr_t)data % alignof(uint32_t))
+    return false;
+  memcpy(&header, data, sizeof header);
+  if (memcmp(header.magic, MODEL_MAGIC, sizeof MODEL_MAGIC) != 0 ||
+      header.version != MODEL_VERSION || header.size > size)
+    return false;
+  size_t N = header.tag_count, V = header.word_count;
+  auto fits = [&](uint32_t offset, size_t length) {
+    return offset <= header.size && length <= header.size - offset;
+  };
+  if (!fits(header.tags, N * 4) || !fits(header.words, V * 4) ||
+      !fits(header.buckets, header.bucket_count * 4) ||
+      !fits(header.transitions, N * N * 4) ||
+      !fits(header.emissions, (V + 1) * N * 4) || header.order < 1 ||
+      header.order > 3 ||
+      (header.order == 3 && !fits(header.trigrams, N * N * N * 4)) ||
+      header.bucket_count <= V ||
+      (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+      header.strings >= header.size || data[header.size - 1] != 0)
+    return false;
+  base = data;
+  return true;
+}
 
-constexpr auto DEFAULT_SCORE{-100};
+int ModelView::word_id(const char *word, size_t length) const {
+  auto *buckets = reinterpret_cast<const uint32_t *>(base + header.buckets);
+  auto mask = header.bucket_count - 1;
+  // there is always an empty bucket
+  for (auto i = hash_word(word, length) & mask; buckets[i];
+       i = (i + 1) & mask) {
+    auto *candidate = this->word(buckets[i] - 1);
+    if (strncmp(candidate, word, length) == 0 && candidate[length] == 0)
+      return buckets[i] - 1;
+  }
+  return unknown_word();
+}
 
-std::vector<std::string> viterbi(TType &S, TType &T,
-                                 std::vector<std::string> &v) {
-  std::vector<std::map<std::string, Node>> tbl;
+constexpr float NO_SCORE{-1000000};
 
-  for (auto i = 0; i < v.size(); ++i)
-    tbl.push_back({});
+// Scores only ever fall along a path: take the best of each column off the
+// column, or long runs drop under NO_SCORE, where every back-pointer is 0
+static void renormalise(float *scores, int n) {
+  if (n <= 0)
+    return;
+  auto best = *std::max_element(scores, scores + n);
+  for (auto i = 0; i < n; ++i)
+    scores[i] -= best;
+}
 
-  for (auto &s : S) {
-    auto val = s.second.find(v[0]);
-    double value;
-    if (val == s.second.end())
-      value = DEFAULT_SCORE;
-    else
-      value = val->second;
-
-    tbl[0][s.first] = Node{"", value};
-  }
-  for (int i = 1; i < v.size(); ++i) {
-    for (auto &s : S) {
-      auto &cur = s.first;
-      Node node;
-
-      for (auto &p : S) {
-        auto &mp = T[p.first];
-        auto entry = mp.find(cur);
-        auto score = tbl[i - 1][p.first].value +
-                     (entry == mp.end() ? DEFAULT_SCORE : entry->second);
-        if (node.value < score) {
-          node.prev = p.first;
-          node.value = score;
-        }
+void max_plus_scalar(const float *prev, const float *trans, int n, float *best,
+                     int *arg) {
+  for (auto c = 0; c < n; ++c) {
+    best[c] = NO_SCORE;
+    arg[c] = 0;
+  }
+  // strictly greater, so ties go to the first tag
+  for (auto p = 0; p < n; ++p)
+    for (auto c = 0; c < n; ++c) {
+      auto score = prev[p] + trans[p * n + c];
+      if (best[c] < score) {
+        best[c] = score;
+        arg[c] = p;
       }
-      auto &mp = S[cur];
-      auto it = mp.find(v[i]);
-      node.value += (it == mp.end() ? DEFAULT_SCORE : it->second);
-      tbl[i][cur] = node;
-    }
-  }
-  auto t = v.size() - 1;
-  std::vector<std::string> L;
-  L.resize(v.size());
-  const auto &tblt = tbl[t];
-  L[t] = std::accumulate(tblt.begin(), tblt.end(), vnode{"", Node()},
-                         [&](auto &acc, auto &x) {
-                           return acc.second.value > x.second.value ? acc
-                                                                    : vnode{x};
-                         })
-             .first;
-  while (0 < t) {
-    L[t - 1] = tbl[t][L[t]].prev;
-    --t;
-  }
-  return L;
+    }
 }
-#ifndef ONLY_VITERBI_INCLUDE
-static TType T{};
-static TType S{};
-static std::string prev = "";
 
-void logprob(typename decltype(T)::mapped_type &q) {
+#if defined(__GNUC__) && !defined(NLEX_SCALAR_VITERBI)
+// generic vectors, as wide as one register: AVX, or SSE and NEON
+#if defined(__AVX__)
+#define NLEX_VECTOR_BYTES 32
+#else
+#define NLEX_VECTOR_BYTES 16
+#endif
+typedef float vfloat __attribute__((vector_size(NLEX_VECTOR_BYTES)));
+typedef int vint __attribute__((vector_size(NLEX_VECTOR_BYTES)));
+constexpr int VWIDTH = sizeof(vfloat) / sizeof(float);
+
+static inline vfloat vload(const float *p) {
+  vfloat v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+void max_plus(const float *prev, const float *trans, int n, float *best,
+              int *arg) {
+  auto c = 0;
+  for (; c + VWIDTH <= n; c += VWIDTH) {
+    vfloat vbest = vfloat{} + NO_SCORE;
+    vint varg = vint{};
+    for (auto p = 0; p < n; ++p) {
+      vfloat score = prev[p] + vload(&trans[p * n + c]);
+      vint gt = score > vbest;
+      vbest = (vfloat)(((vint)score & gt) | ((vint)vbest & ~gt));
+      varg = (p & gt) | (varg & ~gt);
+    }
+    memcpy(&best[c], &vbest, sizeof vbest);
+    memcpy(&arg[c], &varg, sizeof varg);
+  }
+  // the leftover tags
+  for (; c < n; ++c) {
+    best[c] = NO_SCORE;
+    arg[c] = 0;
+    for (auto p = 0; p < n; ++p) {
+      auto score = prev[p] + trans[p * n + c];
+      if (best[c] < score) {
+        best[c] = score;
+        arg[c] = p;
+      }
+    }
+  }
+}
+#else
+void max_plus(const float *prev, const float *trans, int n, float *best,
+              int *arg) {
+  max_plus_scalar(prev, trans, n, best, arg);
+}
+#endif
+
+void viterbi(const ModelView &m, const int *words, int n, int *tags,
+             Lattice &lattice) {
+  if (n <= 0)
+    return;
+  auto N = m.tag_count();
+  lattice.scores.resize(n * N);
+  lattice.back.resize(n * N);
+  auto *scores = lattice.scores.data();
+  auto *back = lattice.back.data();
+
+  auto *emit = m.emissions() + words[0] * N;
+  for (auto s = 0; s < N; ++s) {
+    scores[s] = emit[s];
+    back[s] = 0;
+  }
+  for (auto i = 1; i < n; ++i) {
+    max_plus(scores + (i - 1) * N, m.transitions(), N, scores + i * N,
+             back + i * N);
+    emit = m.emissions() + words[i] * N;
+    for (auto cur = 0; cur < N; ++cur)
+      scores[i * N + cur] += emit[cur];
+    renormalise(scores + i * N, N);
+  }
+
+  auto t = n - 1;
+  float best = NO_SCORE;
+  int best_tag = 0;
+  // ties go to the last tag
+  for (auto s = 0; s < N; ++s)
+    if (!(best > scores[t * N + s])) {
+      best = scores[t * N + s];
+      best_tag = s;
+    }
+  tags[t] = best_tag;
+  for (; t > 0; --t)
+    tags[t - 1] = back[t * N + tags[t]];
+}
+void StreamingViterbi::reset(const ModelView &m, int window) {
+  this->window = window;
+  tag_count = m.tag_count();
+  scores.resize(tag_count);
+  next.resize(tag_count);
+  trace.resize(tag_count);
+  back.resize(window * tag_count);
+  first = count = 0;
+}
+
+int StreamingViterbi::best_tag() const {
+  float best = NO_SCORE;
+  int best_tag = 0;
+  // ties go to the last tag, like viterbi()
+  for (auto s = 0; s < tag_count; ++s)
+    if (!(best > scores[s])) {
+      best = scores[s];
+      best_tag = s;
+    }
+  return best_tag;
+}
+
+int StreamingViterbi::decide(int last, int tag, int *tags) {
+  auto n = last - first + 1;
+  tags[n - 1] = tag;
+  for (auto column = last; column > first; --column)
+    tags[column - first - 1] = tag = back_column(column)[tag];
+  first = last + 1;
+  return n;
+}
+
+int StreamingViterbi::push(const ModelView &m, int word, int *tags) {
+  auto N = tag_count;
+  auto *emit = m.emissions() + word * N;
+  if (count == 0) {
+    std::copy(emit, emit + N, scores.begin());
+  } else {
+    max_plus(scores.data(), m.transitions(), N, next.data(),
+             &back[(count % window) * N]);
+    for (auto c = 0; c < N; ++c)
+      next[c] += emit[c];
+    scores.swap(next);
+  }
+  renormalise(scores.data(), N);
+  ++count;
+
+  // follow the best paths to every current tag back, until they meet
+  for (auto s = 0; s < N; ++s)
+    trace[s] = s;
+  for (auto column = count - 1; column > first; --column) {
+    auto *column_back = back_column(column);
+    auto same = true;
+    for (auto s = 0; s < N; ++s) {
+      trace[s] = column_back[trace[s]];
+      same &= trace[s] == trace[0];
+    }
+    if (same)
+      return decide(column - 1, trace[0], tags);
+  }
+
+  // out of room for the next column, settle for the current best path
+  if (count - first == window) {
+    auto tag = best_tag();
+    for (auto column = count - 1; column > first; --column)
+      tag = back_column(column)[tag];
+    return decide(first, tag, tags);
+  }
+  return 0;
+}
+
+int StreamingViterbi::finish(int *tags) {
+  auto n = first == count ? 0 : decide(count - 1, best_tag(), tags);
+  first = count = 0;
+  return n;
+}
+
+void TrigramViterbi::reset(const ModelView &m, int window, int beam) {
+  this->window = window;
+  this->beam = beam = std::max(beam, 1);
+  tag_count = m.tag_count();
+  auto N = tag_count, pairs = (N + 1) * N;
+  prevs.resize(beam);
+  curs.resize(beam);
+  scores.resize(beam);
+  trace.resize(beam);
+  candidate_prevs.resize(pairs);
+  candidate_curs.resize(pairs);
+  candidate_back.resize(pairs);
+  candidate_scores.resize(pairs);
+  selection.resize(pairs);
+  slot.resize(pairs);
+  stamp.assign(pairs, 0);
+  generation = 0;
+  back.resize(window * beam);
+  tags_of.resize(window * beam);
+  first = count = size = 0;
+}
+
+void TrigramViterbi::candidate(int prev, int cur, float score, int from) {
+  auto key = (prev + 1) * tag_count + cur;
+  if (stamp[key] != generation) {
+    stamp[key] = generation;
+    auto i = slot[key] = candidates++;
+    candidate_prevs[i] = prev;
+    candidate_curs[i] = cur;
+    candidate_scores[i] = score;
+    candidate_back[i] = from;
+  } else if (candidate_scores[slot[key]] < score) {
+    // strictly greater, so ties go to the first state
+    candidate_scores[slot[key]] = score;
+    candidate_back[slot[key]] = from;
+  }
+}
+
+int TrigramViterbi::best_state() const {
+  float best = NO_SCORE;
+  int best_state = 0;
+  for (auto s = 0; s < size; ++s)
+    if (!(best > scores[s])) {
+      best = scores[s];
+      best_state = s;
+    }
+  return best_state;
+}
+
+int TrigramViterbi::decide(int last, int state, int *tags) {
+  auto n = last - first + 1;
+  for (auto column = last;; --column) {
+    tags[column - first] = tag_column(column)[state];
+    if (column == first)
+      break;
+    state = back_column(column)[state];
+  }
+  first = last + 1;
+  return n;
+}
+
+void TrigramViterbi::step(const ModelView &m, int word) {
+  auto N = tag_count;
+  auto *emit = m.emissions() + word * N;
+  if (++generation == 0) {
+    std::fill(stamp.begin(), stamp.end(), 0);
+    generation = 1;
+  }
+  candidates = 0;
+  if (count == 0) {
+    for (auto c = 0; c < N; ++c)
+      candidate(-1, c, emit[c], 0);
+  } else {
+    for (auto s = 0; s < size; ++s) {
+      auto *trans = prevs[s] < 0
+                        ? m.transitions() + curs[s] * N
+                        : m.trigrams() + (prevs[s] * N + curs[s]) * N;
+      for (auto c = 0; c < N; ++c)
+        candidate(curs[s], c, scores[s] + trans[c] + emit[c], s);
+    }
+  }
+
+  // keep the best `beam' candidates (the first ones found of those tied
+  // for the last place), in the order they were found
+  auto threshold = NO_SCORE * 2;
+  auto ties = candidates;
+  if (candidates > beam) {
+    std::copy(candidate_scores.begin(),
+              candidate_scores.begin() + candidates, selection.begin());
+    std::nth_element(selection.begin(), selection.begin() + beam - 1,
+                     selection.begin() + candidates, std::greater<float>());
+    threshold = selection[beam - 1];
+    ties = beam;
+    for (auto i = 0; i < candidates; ++i)
+      ties -= candidate_scores[i] > threshold;
+  }
+  auto *column_back = &back[(count % window) * beam];
+  auto *column_tags = &tags_of[(count % window) * beam];
+  size = 0;
+  for (auto i = 0; i < candidates; ++i) {
+    if (!(candidate_scores[i] > threshold) &&
+        !(candidate_scores[i] == threshold && ties-- > 0))
+      continue;
+    prevs[size] = candidate_prevs[i];
+    column_tags[size] = curs[size] = candidate_curs[i];
+    scores[size] = candidate_scores[i];
+    column_back[size] = candidate_back[i];
+    ++size;
+  }
+  renormalise(scores.data(), size);
+  ++count;
+}
+
+int TrigramViterbi::push(const ModelView &m, int word, int *tags) {
+  step(m, word);
+  // as in StreamingViterbi::push
+  for (auto s = 0; s < size; ++s)
+    trace[s] = s;
+  for (auto column = count - 1; column > first; --column) {
+    auto *column_back = back_column(column);
+    auto same = true;
+    for (auto s = 0; s < size; ++s) {
+      trace[s] = column_back[trace[s]];
+      same &= trace[s] == trace[0];
+    }
+    if (same)
+      return decide(column - 1, trace[0], tags);
+  }
+  if (count - first == window) {
+    auto state = best_state();
+    for (auto column = count - 1; column > first; --column)
+      state = back_column(column)[state];
+    return decide(first, state, tags);
+  }
+  return 0;
+}
+
+int TrigramViterbi::finish(int *tags) {
+  auto n = first == count ? 0 : decide(count - 1, best_state(), tags);
+  first = count = size = 0;
+  return n;
+}
+
+void viterbi(const ModelView &m, const int *words, int n, int *tags,
+             TrigramViterbi &decoder, int beam) {
+  if (n <= 0)
+    return;
+  decoder.reset(m, n, beam);
+  for (auto i = 0; i < n; ++i)
+    decoder.step(m, words[i]);
+  decoder.finish(tags);
+}
+
+#ifndef ONLY_VITERBI_INCLUDE
+void logprob(typename TType::mapped_type &q) {
   auto n{0};
   std::for_each(q.begin(), q.end(), [&](auto &x) -> void { n += x.second; });
   std::for_each(q.begin(), q.end(),
                 [&](auto &x) -> void { x.second = log(x.second / n); });
 }
 
-void logprob1(typename decltype(T)::value_type &q) { logprob(q.second); }
+void logprob1(typename TType::value_type &q) { logprob(q.second); }
 
 namespace detail {
-class Line : public std::string {
-  friend std::istream &operator>>(std::istream &is, Line &line) {
-    return std::getline(is, line);
-  }
+using Counter = std::unordered_map<std::string, double>;
+
+/// The counts of one thread
+struct Counts {
+  std::unordered_map<std::string, Counter> S, T;
+  /// by "prev2\nprev" (tags are lines, so they don't contain newlines)
+  std::unordered_map<std::string, Counter> T3;
+};
+
+/// A piece of the corpus, and the tags at its ends: the n-grams that cross
+/// into the next piece are only counted when the pieces are merged
+struct Chunk {
+  const char *begin, *end;
+  std::string first[2];    // its first two tags
+  std::string prev2, prev; // the tags before the next piece
+  size_t tags = 0;
+  /// lines with a tag but no word (which are skipped), and the first of them
+  size_t no_word = 0;
+  std::string first_no_word;
 };
-} // namespace detail
 
-void train_line(const std::string &sxv) {
-  std::string s{sxv.begin(), sxv.end()};
-  auto pos = s.find('\t');
-  if (pos == s.npos)
+/// Counts the "word\ttag" lines of a chunk, like they were the whole corpus
+void train_chunk(Chunk &chunk, Counts &counts, int gram) {
+  for (auto *line = chunk.begin; line < chunk.end;) {
+    auto *eol = static_cast<const char *>(
+        memchr(line, '\n', chunk.end - line));
+    if (!eol)
+      eol = chunk.end;
+    std::string_view s{line, size_t(eol - line)};
+    line = eol + 1;
+    auto pos = s.find('\t');
+    if (pos == s.npos)
+      continue;
+    if (pos == 0) {
+      // reported once the chunks are merged, they run on worker threads
+      if (chunk.no_word++ == 0)
+        chunk.first_no_word = s;
+      continue;
+    }
+    std::string label{s.substr(pos + 1)};
+    ++counts.S[label][std::string{s.substr(0, pos)}];
+    if (chunk.prev.size() != 0)
+      ++counts.T[chunk.prev][label];
+    if (gram >= 3 && chunk.prev2.size() != 0)
+      ++counts.T3[chunk.prev2 + '\n' + chunk.prev][label];
+    if (chunk.tags < 2)
+      chunk.first[chunk.tags] = label;
+    ++chunk.tags;
+    chunk.prev2 = std::move(chunk.prev);
+    chunk.prev = std::move(label);
+  }
+}
+
+/// Adds the n-grams from `prev2' and `prev' into the chunk, and moves them
+/// past it
+void join_chunk(const Chunk &chunk, std::string &prev2, std::string &prev,
+                TType &T, TType3 &T3, int gram) {
+  if (chunk.tags == 0)
     return;
-  if (pos == 0) {
-    std::cout << "POS = 0 in " << s << '\n';
+  if (prev.size() != 0)
+    ++T[prev][chunk.first[0]];
+  if (gram >= 3 && prev2.size() != 0)
+    ++T3[{prev2, prev}][chunk.first[0]];
+  if (chunk.tags == 1) {
+    prev2 = std::move(prev);
+    prev = chunk.first[0];
     return;
   }
-  auto token = s.substr(0, pos);
-  auto label = s.substr(pos + 1);
-  auto &ss = S[label];
-  auto &sv = ss[token];
-  ++sv;
-  if (prev.size() != 0) {
-    auto &ss = T[prev];
-    auto &sv = ss[label];
-    ++sv;
+  if (gram >= 3 && prev.size() != 0)
+    ++T3[{prev, chunk.first[0]}][chunk.first[1]];
+  prev2 = chunk.prev2;
+  prev = chunk.prev;
+}
+
+/// The corpus, mmap'd if it can be
+class Corpus {
+  int fd = -1;
+  void *mapped = MAP_FAILED;
+  std::string contents;
+
+public:
+  const char *data = nullptr;
+  size_t size = 0;
+
+  explicit Corpus(const std::string &filename) {
+    struct stat st;
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+      mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(mapped);
+      size = st.st_size;
+      return;
+    }
+    // not a regular file
+    std::ifstream fst{filename.c_str(), std::ios::binary};
+    std::ostringstream oss;
+    oss << fst.rdbuf();
+    contents = oss.str();
+    data = contents.data();
+    size = contents.size();
+  }
+  ~Corpus() {
+    if (mapped != MAP_FAILED)
+      munmap(mapped, size);
+    if (fd != -1)
+      close(fd);
+  }
+};
+} // namespace detail
+
+std::vector<float> interpolate_trigrams(TType &S, TType &T, TType3 &T3) {
+  std::map<std::string, int> tag_ids;
+  std::vector<double> unigrams;
+  double total = 0;
+  for (auto &s : S) {
+    tag_ids[s.first] = unigrams.size();
+    double n = 0;
+    for (auto &w : s.second)
+      n += w.second;
+    unigrams.push_back(n);
+    total += n;
+  }
+  auto sum = [](const std::map<std::string, double> &counts) {
+    double n = 0;
+    for (auto &c : counts)
+      n += c.second;
+    return n;
+  };
+  auto count = [](const std::map<std::string, double> &counts,
+                  const std::string &key) {
+    auto it = counts.find(key);
+    return it == counts.end() ? 0.0 : it->second;
+  };
+
+  // deleted interpolation (Brants, TnT): each trigram votes with its count
+  // for the estimate that predicts it best once it is left out
+  double lambda1 = 0, lambda2 = 0, lambda3 = 0;
+  for (auto &ab : T3) {
+    auto ab_count = sum(ab.second);
+    auto &b_next = T[ab.first.second];
+    auto b_count = sum(b_next);
+    for (auto &c : ab.second) {
+      auto tag = tag_ids.find(c.first);
+      if (tag == tag_ids.end())
+        continue;
+      auto f3 = ab_count > 1 ? (c.second - 1) / (ab_count - 1) : 0;
+      auto f2 =
+          b_count > 1 ? (count(b_next, c.first) - 1) / (b_count - 1) : 0;
+      auto f1 = total > 1 ? (unigrams[tag->second] - 1) / (total - 1) : 0;
+      if (f3 >= f2 && f3 >= f1)
+        lambda3 += c.second;
+      else if (f2 >= f1)
+        lambda2 += c.second;
+      else
+        lambda1 += c.second;
+    }
+  }
+  auto lambdas = lambda1 + lambda2 + lambda3;
+  if (lambdas == 0)
+    lambda1 = lambda2 = lambda3 = lambdas = 1;
+
+  int N = unigrams.size();
+  std::vector<std::string> tags(N);
+  for (auto &t : tag_ids)
+    tags[t.second] = t.first;
+  std::vector<float> trigrams(N * N * N);
+  std::vector<double> bigrams(N);
+  for (auto b = 0; b < N; ++b) {
+    auto &b_next = T[tags[b]];
+    auto b_count = sum(b_next);
+    for (auto c = 0; c < N; ++c)
+      bigrams[c] = b_count > 0 ? count(b_next, tags[c]) / b_count : 0;
+    for (auto a = 0; a < N; ++a) {
+      auto it = T3.find({tags[a], tags[b]});
+      auto ab_count = it == T3.end() ? 0 : sum(it->second);
+      for (auto c = 0; c < N; ++c) {
+        auto p = lambda1 / lambdas * unigrams[c] / total +
+                 lambda2 / lambdas * bigrams[c];
+        if (ab_count > 0)
+          p += lambda3 / lambdas * count(it->second, tags[c]) / ab_count;
+        trigrams[(a * N + b) * N + c] = p > 0 ? log(p) : DEFAULT_SCORE;
+      }
+    }
+  }
+  return trigrams;
+}
+
+bool make_perfect_hash(const ModelView &m, PerfectHash &hash) {
+  uint32_t V = m.unknown_word(), buckets = 1, slots = 1;
+  while (buckets < V / 2)
+    buckets <<= 1;
+  while (slots < 2 * V)
+    slots <<= 1;
+  std::vector<uint32_t> hashes(V);
+  std::vector<std::vector<uint32_t>> words(buckets);
+  for (auto id = 0u; id < V; ++id) {
+    hashes[id] = hash_word(m.word(id), strlen(m.word(id)));
+    words[hashes[id] & (buckets - 1)].push_back(id);
+  }
+  hash.displacements.assign(buckets, 0);
+  hash.slots.assign(slots, V);
+
+  // the fullest buckets first, while there's the most room
+  std::vector<uint32_t> order(buckets);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return words[a].size() > words[b].size();
+  });
+  std::vector<uint32_t> taken;
+  for (auto bucket : order) {
+    if (words[bucket].empty())
+      break;
+    uint32_t d = 0;
+    for (;; ++d) {
+      if (d == 1u << 20)
+        return false;
+      taken.clear();
+      auto fits = true;
+      for (auto id : words[bucket]) {
+        auto slot = perfect_hash_slot(hashes[id], d, slots - 1);
+        if (hash.slots[slot] != V ||
+            std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+          fits = false;
+          break;
+        }
+        taken.push_back(slot);
+      }
+      if (fits)
+        break;
+    }
+    hash.displacements[bucket] = d;
+    for (auto i = 0u; i < taken.size(); ++i)
+      hash.slots[taken[i]] = words[bucket][i];
   }
-  prev = label;
+  return true;
 }
 
-template <class Func> void read_lines(std::istream &is, Func dest) {
-  typedef std::istream_iterator<detail::Line> InIt;
-  std::for_each(InIt(is), InIt(), dest);
+std::string write_model(const Model &m) {
+  ModelHeader h{};
+  memcpy(h.magic, MODEL_MAGIC, sizeof MODEL_MAGIC);
+  h.version = MODEL_VERSION;
+  h.order = m.order;
+  h.tag_count = m.tags.size();
+  h.word_count = m.words.size();
+  h.bucket_count = 1;
+  while (h.bucket_count < 2 * h.word_count + 1)
+    h.bucket_count <<= 1;
+
+  std::string strings;
+  std::vector<uint32_t> tags, words(m.words.size());
+  for (auto &tag : m.tags) {
+    tags.push_back(strings.size());
+    strings.append(tag.c_str(), tag.size() + 1);
+  }
+  std::vector<const std::string *> vocabulary(m.words.size());
+  for (auto &w : m.words)
+    vocabulary[w.second] = &w.first;
+  std::vector<uint32_t> buckets(h.bucket_count);
+  for (auto id = 0u; id < vocabulary.size(); ++id) {
+    auto &word = *vocabulary[id];
+    words[id] = strings.size();
+    strings.append(word.c_str(), word.size() + 1);
+    auto i = hash_word(word.data(), word.size()) & (h.bucket_count - 1);
+    while (buckets[i])
+      i = (i + 1) & (h.bucket_count - 1);
+    buckets[i] = id + 1;
+  }
+
+  std::string blob(sizeof h, '\0');
+  auto section = [&](const void *data, size_t size) -> uint32_t {
+    blob.resize((blob.size() + 31) & ~size_t{31}, '\0');
+    auto offset = blob.size();
+    blob.append(reinterpret_cast<const char *>(data), size);
+    return offset;
+  };
+  h.tags = section(tags.data(), tags.size() * 4);
+  h.words = section(words.data(), words.size() * 4);
+  h.buckets = section(buckets.data(), buckets.size() * 4);
+  h.transitions = section(m.transitions.data(), m.transitions.size() * 4);
+  h.emissions = section(m.emissions.data(), m.emissions.size() * 4);
+  if (m.order == 3)
+    h.trigrams = section(m.trigrams.data(), m.trigrams.size() * 4);
+  // last, so that the blob ends with a NUL
+  h.strings = section(strings.data(), strings.size());
+  if (strings.empty())
+    blob.push_back('\0');
+  h.size = blob.size();
+  memcpy(&blob[0], &h, sizeof h);
+  return blob;
 }
 
-static bool trained_once = false;
+std::string train(std::string filename, int gram) {
+  detail::Corpus corpus{filename};
+  // already compiled (see write_model)
+  if (corpus.size >= sizeof MODEL_MAGIC &&
+      memcmp(corpus.data, MODEL_MAGIC, sizeof MODEL_MAGIC) == 0)
+    return {corpus.data, corpus.size};
 
-std::string train(std::string filename) {
-  assert(!trained_once && "POSTag::train called more than once");
+  // cut the corpus into a few pieces per thread, at line starts (the n-grams
+  // across a cut are added back when merging, so this counts the same as
+  // reading it in one go)
+  std::vector<detail::Chunk> chunks;
+  size_t piece = std::max<size_t>(
+      1 << 20, corpus.size / (4 * std::max(1u, std::thread::hardware_concurrency())));
+  for (size_t begin = 0; begin < corpus.size;) {
+    auto end = std::min(begin + piece, corpus.size);
+    if (auto *eol = static_cast<const char *>(
+            memchr(corpus.data + end - 1, '\n', corpus.size - end + 1)))
+      end = eol - corpus.data + 1;
+    else
+      end = corpus.size;
+    chunks.push_back({corpus.data + begin, corpus.data + end});
+    begin = end;
+  }
 
-  trained_once = true;
+  tbb::enumerable_thread_specific<detail::Counts> thread_counts;
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size()),
+                    [&](const tbb::blocked_range<size_t> &range) {
+                      auto &counts = thread_counts.local();
+                      for (auto i = range.begin(); i != range.end(); ++i)
+                        detail::train_chunk(chunks[i], counts, gram);
+                    });
+
+  TType S, T;
+  TType3 T3;
+  for (auto &counts : thread_counts) {
+    for (auto *from : {&counts.S, &counts.T}) {
+      auto &to = from == &counts.S ? S : T;
+      for (auto &row : *from) {
+        auto &to_row = to[row.first];
+        for (auto &c : row.second)
+          to_row[c.first] += c.second;
+      }
+    }
+    for (auto &row : counts.T3) {
+      auto cut = row.first.find('\n');
+      auto &to_row =
+          T3[{row.first.substr(0, cut), row.first.substr(cut + 1)}];
+      for (auto &c : row.second)
+        to_row[c.first] += c.second;
+    }
+  }
+  std::string prev2, prev;
+  size_t no_word = 0;
+  std::string first_no_word;
+  for (auto &chunk : chunks) {
+    detail::join_chunk(chunk, prev2, prev, T, T3, gram);
+    if (chunk.no_word && no_word == 0)
+      first_no_word = chunk.first_no_word;
+    no_word += chunk.no_word;
+  }
+  if (no_word)
+    slts.show(Display::Type::WARNING,
+              "%zu line(s) of '%s' have a tag but no word, ignoring them "
+              "(the first is '%s')\n",
+              no_word, filename.c_str(), first_no_word.c_str());
 
-  std::ifstream fst{filename.c_str()};
-  read_lines(fst, train_line);
+  std::vector<float> trigrams;
+  if (gram >= 3)
+    trigrams = interpolate_trigrams(S, T, T3);
   std::for_each(S.begin(), S.end(), logprob1);
   std::for_each(T.begin(), T.end(), logprob1);
 
-  std::array<TType, 2> arr{T, S};
-  std::ostringstream oss;
-  oss << bits(arr);
-  return oss.str();
+  auto model = make_model(S, T);
+  model.order = std::min(std::max(gram, 1), 3);
+  if (model.order == 1)
+    // tags are independent of each other
+    std::fill(model.transitions.begin(), model.transitions.end(), 0);
+  model.trigrams = std::move(trigrams);
+  return write_model(model);
 }
 #endif // ONLY_VITERBI_INCLUDE
 
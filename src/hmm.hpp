@@ -1,4 +1,7 @@
+#pragma once
+
 #include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <istream>
@@ -6,6 +9,8 @@
 #include <map>
 #include <memory>
 #include <numeric>
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -13,13 +18,228 @@ namespace nlex {
 namespace POSTag {
 
 using TType = std::map<std::string, std::map<std::string, double>>;
+/// Counts of tag trigrams, by the first two tags
+using TType3 = std::map<std::pair<std::string, std::string>,
+                        std::map<std::string, double>>;
+
+/// An HMM with its tags and words interned to dense ids
+struct Model {
+  std::vector<std::string> tags; // tag id -> tag
+  std::unordered_map<std::string, int> words; // word -> word id
+  /// log P(cur | prev) at [prev * tags.size() + cur]
+  std::vector<float> transitions;
+  /// log P(word | tag) at [word * tags.size() + tag], the last row is for
+  /// words not in the vocabulary
+  std::vector<float> emissions;
+  /// 1, 2 or 3 (the `gram' of `tag pos ... every <n> tokens')
+  int order = 2;
+  /// for order 3, the interpolated log P(cur | prev2, prev) at
+  /// [(prev2 * tags.size() + prev) * tags.size() + cur]
+  std::vector<float> trigrams;
+
+  int tag_count() const { return tags.size(); }
+  int unknown_word() const { return words.size(); }
+  int word_id(const std::string &word) const {
+    auto it = words.find(word);
+    return it == words.end() ? unknown_word() : it->second;
+  }
+};
+
+/// Header of a compiled model. The model is one flat blob that is used in
+/// place, from the lexer's read-only data or an mmap'd file: the header, then
+/// each section at a 32-byte aligned offset (from the start of the header)
+///  - strings: NUL-terminated tags and words
+///  - tags: uint32 string offset of each tag
+///  - words: uint32 string offset of each word
+///  - buckets: open-addressed hash of the words (FNV-1a, linear probing),
+///      uint32 word id + 1, 0 for an empty bucket
+///  - transitions, emissions, trigrams: the float matrices of Model (trigrams
+///      is 0 unless the order is 3)
+struct ModelHeader {
+  char magic[4]; // "NLPM"
+  uint32_t version;
+  uint32_t size; // of the whole blob
+  uint32_t tag_count, word_count, bucket_count; // bucket_count is a power of 2
+  uint32_t order;
+  uint32_t strings, tags, words, buckets, transitions, emissions, trigrams;
+};
+
+constexpr char MODEL_MAGIC[4] = {'N', 'L', 'P', 'M'};
+constexpr uint32_t MODEL_VERSION = 2;
+
+inline uint32_t hash_word(const char *word, size_t length) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < length; ++i)
+    h = (h ^ (unsigned char)word[i]) * 16777619u;
+  return h;
+}
+
+/// Lays the model out as a compiled model blob
+std::string write_model(const Model &m);
+
+/// A compiled model, read in place
+class ModelView {
+  const char *base = nullptr;
+  ModelHeader header{};
+
+public:
+  /// Checks the blob and points into it, the data must outlive the view
+  /// and be aligned to 4 bytes
+  bool open(const char *data, size_t size);
+  bool valid() const { return base != nullptr; }
+
+  int tag_count() const { return header.tag_count; }
+  int unknown_word() const { return header.word_count; }
+  int order() const { return header.order; }
+  const char *tag(int id) const {
+    return base + header.strings +
+           reinterpret_cast<const uint32_t *>(base + header.tags)[id];
+  }
+  const char *word(int id) const {
+    return base + header.strings +
+           reinterpret_cast<const uint32_t *>(base + header.words)[id];
+  }
+  int word_id(const char *word, size_t length) const;
+
+  const float *transitions() const {
+    return reinterpret_cast<const float *>(base + header.transitions);
+  }
+  const float *emissions() const {
+    return reinterpret_cast<const float *>(base + header.emissions);
+  }
+  const float *trigrams() const {
+    return reinterpret_cast<const float *>(base + header.trigrams);
+  }
+};
+
+/// A perfect hash of a model's vocabulary (hash and displace): the word with
+/// hash h (hash_word) can only be in slots[perfect_hash_slot(h, d, mask)],
+/// for d = displacements[h & (displacements.size() - 1)] and
+/// mask = slots.size() - 1
+struct PerfectHash {
+  std::vector<uint32_t> displacements; // a power of 2 of them
+  std::vector<uint32_t> slots; // word ids, or unknown_word() if empty
+};
+
+inline uint32_t perfect_hash_slot(uint32_t hash, uint32_t displacement,
+                                  uint32_t mask) {
+  auto x = hash ^ displacement;
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  return x & mask;
+}
+
+/// Finds displacements that give every word of the model its own slot, fails
+/// if two words have the same hash
+bool make_perfect_hash(const ModelView &m, PerfectHash &hash);
+
+/// Reusable scores and backpointers of the Viterbi lattice
+struct Lattice {
+  std::vector<float> scores;
+  std::vector<int> back;
+};
+
+/// Trains an HMM of order `gram' (see Model::order) from tab separated word
+/// and tag lines, or reads a compiled model. The corpus is counted in
+/// parallel, and this can be called any number of times
+std::string train(std::string input_filename, int gram = 2);
+
+/// Builds the dense model from the emission (S) and transition (T) log
+/// probabilities
+Model make_model(TType &S, TType &T);
+/// The trigram matrix of Model from the emission (S), bigram (T) and trigram
+/// (T3) counts, interpolated with the bigram and unigram probabilities by
+/// weights found with deleted interpolation
+std::vector<float> interpolate_trigrams(TType &S, TType &T, TType3 &T3);
+
+/// The Viterbi recurrence over all current tags at once (a max-plus
+/// matrix-vector product): best[c] = max_p prev[p] + trans[p * n + c], and
+/// arg[c] is the first p that reaches it
+void max_plus(const float *prev, const float *trans, int n, float *best,
+              int *arg);
+/// max_plus without the vector kernel
+void max_plus_scalar(const float *prev, const float *trans, int n, float *best,
+                     int *arg);
+
+/// Writes the most likely tag id of each of the `n' words to `tags'
+void viterbi(const ModelView &m, const int *words, int n, int *tags,
+             Lattice &lattice);
+
+/// Viterbi that advances one lattice column per word. The tag of a word is
+/// decided as soon as the best paths to all the current tags agree on it,
+/// which is exact, or forced from the current best path once `window' words
+/// are undecided
+class StreamingViterbi {
+  int window = 0, tag_count = 0;
+  std::vector<float> scores, next; // the current column
+  std::vector<int> back;           // `window' columns of backpointers
+  std::vector<int> trace;
+  int first = 0, count = 0; // the oldest undecided word, and words seen
+
+  const int *back_column(int column) const {
+    return &back[(column % window) * tag_count];
+  }
+  int best_tag() const;
+  /// Writes the tags of words first..last on the path through `tag' at `last'
+  int decide(int last, int tag, int *tags);
+
+public:
+  /// Keeps at most `window' (> 0) undecided words
+  void reset(const ModelView &m, int window);
+  /// Adds a word of the sentence, writes the tags decided by it to `tags'
+  /// (at most `window' of them, in order) and returns how many there were
+  int push(const ModelView &m, int word, int *tags);
+  /// Ends the sentence like push()
+  int finish(int *tags);
+  int length() const { return count; }
+};
+
+/// StreamingViterbi for trigram models: the states are pairs of tags, and
+/// only the `beam' best ones are kept in each column. The first transition
+/// of a sentence is a bigram one
+class TrigramViterbi {
+  int window = 0, beam = 0, tag_count = 0;
+  // the current column: `size' pairs of tags, and their scores
+  std::vector<int> prevs, curs;
+  std::vector<float> scores;
+  int size = 0;
+  // the candidates for the next column, one per pair (found through `slot'
+  // when `stamp' is the current generation)
+  std::vector<int> candidate_prevs, candidate_curs, candidate_back;
+  std::vector<float> candidate_scores, selection;
+  std::vector<int> slot, stamp;
+  int candidates = 0, generation = 0;
+  // `window' columns of `beam' states: the state each one came from, and
+  // its tag
+  std::vector<int> back, tags_of;
+  std::vector<int> trace;
+  int first = 0, count = 0;
 
-std::string train(std::string input_filename);
+  const int *back_column(int column) const {
+    return &back[(column % window) * beam];
+  }
+  const int *tag_column(int column) const {
+    return &tags_of[(column % window) * beam];
+  }
+  void candidate(int prev, int cur, float score, int from);
+  int best_state() const;
+  int decide(int last, int state, int *tags);
 
-template <class Func> void read_lines(std::istream &s, Func dest);
+public:
+  void reset(const ModelView &m, int window, int beam);
+  /// Adds a word without deciding any tags, for when the window holds the
+  /// whole sentence
+  void step(const ModelView &m, int word);
+  int push(const ModelView &m, int word, int *tags);
+  int finish(int *tags);
+  int length() const { return count; }
+};
 
-std::vector<std::string> viterbi(TType &s, TType &T,
-                                 std::vector<std::string> &v);
+/// Writes the most likely tag id of each of the `n' words to `tags', with a
+/// trigram model
+void viterbi(const ModelView &m, const int *words, int n, int *tags,
+             TrigramViterbi &decoder, int beam);
 
 } // namespace POSTag
-} // namespace nlex
\ No newline at end of file
+} // namespace nlex
@@ -1,4 +1,5 @@
 #include "basevm.hpp"
+#include "kaleid.hpp"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
@@ -76,39 +77,61 @@ enum Token {
   tok_variadic = -17,
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
-static std::string StringValue;   // Filled in if tok_string
-static std::string fed_string = "";
+namespace {
+class PrototypeAST;
+} // end anonymous namespace
+
+/// KaleidState - The lexer, parser and code generator state of one
+/// KaleidCompiler.
+struct KaleidState {
+  std::string IdentifierStr; // Filled in if tok_identifier
+  double NumVal;             // Filled in if tok_number
+  bool NumIsInt;             // Filled in if tok_number (no '.')
+  std::string StringValue;   // Filled in if tok_string
+  std::string fed_string = "";
+  int LastChar = ' ';
+
+  /// The current token of the parser, see getNextToken
+  int CurTok;
+  /// The precedence of each defined binary operator
+  std::map<char, int> BinopPrecedence;
+
+  nlvm::BaseModule *mModule;
+  IRBuilder<> *Builder;
+  std::map<std::string, AllocaInst *> NamedValues;
+  std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+};
 
-void KaleidFeed(std::string s) { fed_string += "\n" + s; }
+/// S - The state of the compiler running on this thread.
+static thread_local KaleidState *S;
+
+static void KaleidFeed(std::string s) { S->fed_string += "\n" + s; }
 
 static char next_char() {
-  if (fed_string.size() == 0)
+  if (S->fed_string.size() == 0)
     return 0;
-  char c = fed_string[0];
-  fed_string = fed_string.substr(1);
+  char c = S->fed_string[0];
+  S->fed_string = S->fed_string.substr(1);
   return c;
 }
 
 /// gettok - Return the next token from standard input.
 static int gettok(bool reset = false) {
-  static int LastChar = ' ';
   if (reset)
-    LastChar = ' ';
+    S->LastChar = ' ';
   // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = next_char();
+  while (isspace(S->LastChar))
+    S->LastChar = next_char();
 
-  if (LastChar == '"') {
-    StringValue = "";
+  if (S->LastChar == '"') {
+    S->StringValue = "";
     bool escape = false;
-    while ((LastChar = next_char()) != '"') {
-      char c = LastChar;
+    while ((S->LastChar = next_char()) != '"') {
+      char c = S->LastChar;
       if (c == '\\') {
         if (escape) {
           escape = false;
-          StringValue += c;
+          S->StringValue += c;
         } else
           escape = true;
       } else {
@@ -120,103 +143,104 @@ static int gettok(bool reset = false) {
             buf[0] = next_char();
             buf[1] = next_char();
             buf[2] = 0;
-            StringValue += (char)strtol(buf, NULL, 16);
+            S->StringValue += (char)strtol(buf, NULL, 16);
             break;
           }
           case 'n':
-            StringValue += "\n";
+            S->StringValue += "\n";
             break;
           case 'r':
-            StringValue += "\r";
+            S->StringValue += "\r";
             break;
           case 'f':
-            StringValue += "\f";
+            S->StringValue += "\f";
             break;
           case 't':
-            StringValue += "\t";
+            S->StringValue += "\t";
             break;
           default:
-            StringValue += LastChar;
+            S->StringValue += S->LastChar;
             break;
           }
         } else
-          StringValue += LastChar;
+          S->StringValue += S->LastChar;
       }
     }
 
-    LastChar = next_char(); // eat the ending '"'
+    S->LastChar = next_char(); // eat the ending '"'
     return tok_string;
   }
 
-  if (isalpha(LastChar) ||
-      LastChar == '_') { // identifier: [a-zA-Z_][a-zA-Z_0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = next_char())) || LastChar == '_')
-      IdentifierStr += LastChar;
+  if (isalpha(S->LastChar) ||
+      S->LastChar == '_') { // identifier: [a-zA-Z_][a-zA-Z_0-9]*
+    S->IdentifierStr = S->LastChar;
+    while (isalnum((S->LastChar = next_char())) || S->LastChar == '_')
+      S->IdentifierStr += S->LastChar;
 
-    if (IdentifierStr == "def")
+    if (S->IdentifierStr == "def")
       return tok_def;
-    if (IdentifierStr == "extern")
+    if (S->IdentifierStr == "extern")
       return tok_extern;
-    if (IdentifierStr == "if")
+    if (S->IdentifierStr == "if")
       return tok_if;
-    if (IdentifierStr == "then")
+    if (S->IdentifierStr == "then")
       return tok_then;
-    if (IdentifierStr == "else")
+    if (S->IdentifierStr == "else")
       return tok_else;
-    if (IdentifierStr == "for")
+    if (S->IdentifierStr == "for")
       return tok_for;
-    if (IdentifierStr == "while")
+    if (S->IdentifierStr == "while")
       return tok_while;
-    if (IdentifierStr == "in")
+    if (S->IdentifierStr == "in")
       return tok_in;
-    if (IdentifierStr == "binary")
+    if (S->IdentifierStr == "binary")
       return tok_binary;
-    if (IdentifierStr == "unary")
+    if (S->IdentifierStr == "unary")
       return tok_unary;
-    if (IdentifierStr == "var")
+    if (S->IdentifierStr == "var")
       return tok_var;
-    if (IdentifierStr == "global")
+    if (S->IdentifierStr == "global")
       return tok_global;
-    if (IdentifierStr == "variadic")
+    if (S->IdentifierStr == "variadic")
       return tok_variadic;
     return tok_identifier;
   }
 
-  if (isdigit(LastChar) || LastChar == '.' ||
-      LastChar == '-') { // Number: -?[0-9.]+
+  if (isdigit(S->LastChar) || S->LastChar == '.' ||
+      S->LastChar == '-') { // Number: -?[0-9.]+
     std::string NumStr;
     do {
-      NumStr += LastChar;
-      LastChar = next_char();
-    } while (isdigit(LastChar) || LastChar == '.');
+      NumStr += S->LastChar;
+      S->LastChar = next_char();
+    } while (isdigit(S->LastChar) || S->LastChar == '.');
 
     if (NumStr == "-") {
       // This ain't no number
       return NumStr[0]; // just return it as a normal token
     }
 
-    NumVal = strtod(NumStr.c_str(), nullptr);
+    S->NumVal = strtod(NumStr.c_str(), nullptr);
+    S->NumIsInt = NumStr.find('.') == std::string::npos;
     return tok_number;
   }
 
-  if (LastChar == '#') {
+  if (S->LastChar == '#') {
     // Comment until end of line.
     do
-      LastChar = next_char();
-    while (LastChar != 0 && LastChar != '\n' && LastChar != '\r');
+      S->LastChar = next_char();
+    while (S->LastChar != 0 && S->LastChar != '\n' && S->LastChar != '\r');
 
-    if (LastChar != 0)
+    if (S->LastChar != 0)
       return gettok();
   }
 
-  if (LastChar == 0) {
+  if (S->LastChar == 0) {
     return tok_eof;
   }
 
   // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = next_char();
+  int ThisChar = S->LastChar;
+  S->LastChar = next_char();
   return ThisChar;
 }
 
@@ -232,16 +256,21 @@ public:
   virtual ~ExprAST() = default;
 
   virtual Value *codegen() = 0;
+  virtual bool isIntegerLiteral() const { return false; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
+/// Literals without a '.' are weakly typed: they are doubles unless combined
+/// with an integral value.
 class NumberExprAST : public ExprAST {
   double Val;
+  bool IsInt;
 
 public:
-  NumberExprAST(double Val) : Val(Val) {}
+  NumberExprAST(double Val, bool IsInt = false) : Val(Val), IsInt(IsInt) {}
 
   Value *codegen() override;
+  bool isIntegerLiteral() const override { return IsInt; }
   double getValue() const { return Val; }
 };
 
@@ -317,14 +346,15 @@ public:
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
   std::string VarName;
+  Type *VarType; // nullptr: the type of Start
   std::unique_ptr<ExprAST> Start, End, Step, Body;
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-             std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
+  ForExprAST(const std::string &VarName, Type *VarType,
+             std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+             std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
+      : VarName(VarName), VarType(VarType), Start(std::move(Start)),
+        End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
 
   Value *codegen() override;
 };
@@ -343,13 +373,15 @@ public:
 /// VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<Type *> VarTypes; // nullptr: the type of the initializer
   std::unique_ptr<ExprAST> Body;
 
 public:
   VarExprAST(
       std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+      std::vector<Type *> VarTypes, std::unique_ptr<ExprAST> Body)
+      : VarNames(std::move(VarNames)), VarTypes(std::move(VarTypes)),
+        Body(std::move(Body)) {}
 
   Value *codegen() override;
 };
@@ -368,18 +400,23 @@ public:
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
 /// of arguments the function takes), as well as if it is an operator.
+/// Unannotated arguments and return values are doubles.
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
   bool IsOperator;
   unsigned Precedence; // Precedence if a binary op.
   bool IsVariadic;
+  std::vector<Type *> ArgTypes;
+  Type *RetType;
 
 public:
   PrototypeAST(const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0, bool IsVar = false)
+               bool IsOperator = false, unsigned Prec = 0, bool IsVar = false,
+               std::vector<Type *> ArgTypes = {}, Type *RetType = nullptr)
       : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec), IsVariadic(IsVar) {}
+        Precedence(Prec), IsVariadic(IsVar), ArgTypes(std::move(ArgTypes)),
+        RetType(RetType) {}
 
   Function *codegen();
   const std::string &getName() const { return Name; }
@@ -418,24 +455,15 @@ public:
 /// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
 /// token the parser is looking at.  getNextToken reads another token from the
 /// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken(bool reset = false) { return CurTok = gettok(reset); }
-
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
-
-/// Module
-/// Stolen from Codegen, required here
-static nlvm::BaseModule *mModule;
+static int getNextToken(bool reset = false) { return S->CurTok = gettok(reset); }
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 static int GetTokPrecedence() {
-  if (!isascii(CurTok))
+  if (!isascii(S->CurTok))
     return -1;
 
   // Make sure it's a declared binop.
-  int TokPrec = BinopPrecedence[CurTok];
+  int TokPrec = S->BinopPrecedence[S->CurTok];
   if (TokPrec <= 0)
     return -1;
   return TokPrec;
@@ -461,11 +489,42 @@ static std::unique_ptr<ExprAST> ParseExpression();
 
 /// numberexpr ::= number
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
+  auto Result = std::make_unique<NumberExprAST>(S->NumVal, S->NumIsInt);
   getNextToken(); // consume the number
   return std::move(Result);
 }
 
+/// type ::= 'double' | 'i64' | 'ptr'
+static Type *ParseTypeName() {
+  if (S->CurTok != tok_identifier) {
+    LogError("expected a type name");
+    return nullptr;
+  }
+  Type *T = nullptr;
+  if (S->IdentifierStr == "double")
+    T = Type::getDoubleTy(S->mModule->TheContext);
+  else if (S->IdentifierStr == "i64" || S->IdentifierStr == "int")
+    T = Type::getInt64Ty(S->mModule->TheContext);
+  else if (S->IdentifierStr == "ptr")
+    T = Type::getInt8PtrTy(S->mModule->TheContext);
+  else {
+    LogError("unknown type " + S->IdentifierStr);
+    return nullptr;
+  }
+  getNextToken(); // eat the type name
+  return T;
+}
+
+/// typeannotation ::= (':' type)?
+static bool ParseTypeAnnotation(Type *&T) {
+  T = nullptr;
+  if (S->CurTok != ':')
+    return true;
+  getNextToken(); // eat ':'
+  T = ParseTypeName();
+  return T != nullptr;
+}
+
 /// parenexpr ::= '(' expression ')'
 static std::unique_ptr<ExprAST> ParseParenExpr() {
   getNextToken(); // eat (.
@@ -473,7 +532,7 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   if (!V)
     return nullptr;
 
-  if (CurTok != ')')
+  if (S->CurTok != ')')
     return LogError("expected ')'");
   getNextToken(); // eat ).
   return V;
@@ -483,27 +542,27 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+  std::string IdName = S->IdentifierStr;
 
   getNextToken(); // eat identifier.
 
-  if (CurTok != '(') // Simple variable ref.
+  if (S->CurTok != '(') // Simple variable ref.
     return std::make_unique<VariableExprAST>(IdName);
 
   // Call.
   getNextToken(); // eat (
   std::vector<std::unique_ptr<ExprAST>> Args;
-  if (CurTok != ')') {
+  if (S->CurTok != ')') {
     while (true) {
       if (auto Arg = ParseExpression())
         Args.push_back(std::move(Arg));
       else
         return nullptr;
 
-      if (CurTok == ')')
+      if (S->CurTok == ')')
         break;
 
-      if (CurTok != ',')
+      if (S->CurTok != ',')
         return LogError("Expected ')' or ',' in argument list");
       getNextToken();
     }
@@ -524,7 +583,7 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   if (!Cond)
     return nullptr;
 
-  if (CurTok != tok_then)
+  if (S->CurTok != tok_then)
     return LogError("expected then");
   getNextToken(); // eat the then
 
@@ -532,7 +591,7 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   if (!Then)
     return nullptr;
 
-  if (CurTok != tok_else)
+  if (S->CurTok != tok_else)
     return LogError("expected else");
 
   getNextToken();
@@ -553,7 +612,7 @@ static std::unique_ptr<ExprAST> ParseWhileExpr() {
   if (!Cond)
     return nullptr;
 
-  if (CurTok != tok_in)
+  if (S->CurTok != tok_in)
     return LogError("expected 'in' after while");
   getNextToken(); // eat 'in'.
 
@@ -564,24 +623,29 @@ static std::unique_ptr<ExprAST> ParseWhileExpr() {
   return std::make_unique<WhileExprAST>(std::move(Cond), std::move(Body));
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+/// forexpr ::= 'for' identifier typeannotation '=' expr ',' expr (',' expr)?
+///             'in' expression
 static std::unique_ptr<ExprAST> ParseForExpr() {
   getNextToken(); // eat the for.
 
-  if (CurTok != tok_identifier)
+  if (S->CurTok != tok_identifier)
     return LogError("expected identifier after for");
 
-  std::string IdName = IdentifierStr;
+  std::string IdName = S->IdentifierStr;
   getNextToken(); // eat identifier.
 
-  if (CurTok != '=')
+  Type *VarType;
+  if (!ParseTypeAnnotation(VarType))
+    return nullptr;
+
+  if (S->CurTok != '=')
     return LogError("expected '=' after for");
   getNextToken(); // eat '='.
 
   auto Start = ParseExpression();
   if (!Start)
     return nullptr;
-  if (CurTok != ',')
+  if (S->CurTok != ',')
     return LogError("expected ',' after for start value");
   getNextToken();
 
@@ -591,14 +655,14 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
 
   // The step value is optional.
   std::unique_ptr<ExprAST> Step;
-  if (CurTok == ',') {
+  if (S->CurTok == ',') {
     getNextToken();
     Step = ParseExpression();
     if (!Step)
       return nullptr;
   }
 
-  if (CurTok != tok_in)
+  if (S->CurTok != tok_in)
     return LogError("expected 'in' after for");
   getNextToken(); // eat 'in'.
 
@@ -606,70 +670,90 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
   if (!Body)
     return nullptr;
 
-  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                      std::move(Step), std::move(Body));
+  return std::make_unique<ForExprAST>(IdName, VarType, std::move(Start),
+                                      std::move(End), std::move(Step),
+                                      std::move(Body));
 }
 
-/// globalexpr ::= 'global' identifier ('=' number)? (, identifier ('='
-/// number)?)*
+/// globalexpr ::= 'global' identifier typeannotation ('=' number)?
+///                (, identifier typeannotation ('=' number)?)*
 static std::unique_ptr<ExprAST> ParseGlobalExpr() {
   getNextToken(); // eat the global
 
   std::vector<std::pair<std::string, Constant *>> Names;
 
   // at least one global name is required
-  if (CurTok != tok_identifier)
+  if (S->CurTok != tok_identifier)
     return LogError("expected identifier after global");
 
   while (true) {
-    std::string Name = IdentifierStr;
+    std::string Name = S->IdentifierStr;
     getNextToken(); // eat identifier
 
-    Constant *init = nullptr;
-    if (CurTok == '=') {
-      getNextToken(); // eat the '='
-
-      std::unique_ptr<ExprAST> number = nullptr;
-      number = ParseNumberExpr();
+    Type *T;
+    if (!ParseTypeAnnotation(T))
+      return nullptr;
+    if (!T)
+      T = Type::getDoubleTy(S->mModule->TheContext);
 
-      if (!number)
-        return nullptr;
+    double value = 0;
+    if (S->CurTok == '=') {
+      getNextToken(); // eat the '='
 
-      NumberExprAST *nast = (NumberExprAST *)number.get();
-      double value = nast->getValue();
-      init = ConstantFP::get(mModule->TheContext, APFloat{value});
+      if (S->CurTok != tok_number)
+        return LogError("expected a number to initialise global " + Name);
+      value = S->NumVal;
+      getNextToken(); // eat the number
     }
+
+    Constant *init;
+    if (T->isDoubleTy())
+      init = ConstantFP::get(S->mModule->TheContext, APFloat{value});
+    else if (T->isIntegerTy())
+      init = ConstantInt::get(T, (int64_t)value, true);
+    else
+      init = ConstantExpr::getIntToPtr(
+          ConstantInt::get(Type::getInt64Ty(S->mModule->TheContext),
+                           (int64_t)value, true),
+          T);
     Names.push_back({Name, init});
 
-    if (CurTok != ',')
+    if (S->CurTok != ',')
       break;
     getNextToken();
 
-    if (CurTok != tok_identifier)
+    if (S->CurTok != tok_identifier)
       return LogError("expected identifier list after global");
   }
 
   return std::make_unique<GlobalExprAST>(std::move(Names));
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
+/// varexpr ::= 'var' identifier typeannotation ('=' expression)?
+//                    (',' identifier typeannotation ('=' expression)?)*
+//                    'in' expression
 static std::unique_ptr<ExprAST> ParseVarExpr() {
   getNextToken(); // eat the var.
 
   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  std::vector<Type *> VarTypes;
 
   // At least one variable name is required.
-  if (CurTok != tok_identifier)
+  if (S->CurTok != tok_identifier)
     return LogError("expected identifier after var");
 
   while (true) {
-    std::string Name = IdentifierStr;
+    std::string Name = S->IdentifierStr;
     getNextToken(); // eat identifier.
 
+    Type *T;
+    if (!ParseTypeAnnotation(T))
+      return nullptr;
+    VarTypes.push_back(T);
+
     // Read the optional initializer.
     std::unique_ptr<ExprAST> Init = nullptr;
-    if (CurTok == '=') {
+    if (S->CurTok == '=') {
       getNextToken(); // eat the '='.
 
       Init = ParseExpression();
@@ -680,16 +764,16 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     VarNames.push_back(std::make_pair(Name, std::move(Init)));
 
     // End of var list, exit loop.
-    if (CurTok != ',')
+    if (S->CurTok != ',')
       break;
     getNextToken(); // eat the ','.
 
-    if (CurTok != tok_identifier)
+    if (S->CurTok != tok_identifier)
       return LogError("expected identifier list after var");
   }
 
   // At this point, we have to have 'in'.
-  if (CurTok != tok_in)
+  if (S->CurTok != tok_in)
     return LogError("expected 'in' keyword after 'var'");
   getNextToken(); // eat 'in'.
 
@@ -697,11 +781,12 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (!Body)
     return nullptr;
 
-  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(VarTypes),
+                                      std::move(Body));
 }
 
 static std::unique_ptr<ExprAST> ParseString() {
-  std::string stringvalue = StringValue;
+  std::string stringvalue = S->StringValue;
   getNextToken(); // eat string
   return std::make_unique<StringExprAST>(std::move(stringvalue));
 }
@@ -715,9 +800,9 @@ static std::unique_ptr<ExprAST> ParseString() {
 ///   ::= varexpr
 ///   ::= string
 static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
+  switch (S->CurTok) {
   default:
-    return LogError("unknown token " + std::to_string((char)CurTok) +
+    return LogError("unknown token " + std::to_string((char)S->CurTok) +
                     " when expecting an expression");
   case tok_identifier:
     return ParseIdentifierExpr();
@@ -745,11 +830,11 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 ///   ::= '!' unary
 static std::unique_ptr<ExprAST> ParseUnary() {
   // If the current token is not an operator, it must be a primary expr.
-  if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
+  if (!isascii(S->CurTok) || S->CurTok == '(' || S->CurTok == ',')
     return ParsePrimary();
 
   // If this is a unary operator, read it.
-  int Opc = CurTok;
+  int Opc = S->CurTok;
   getNextToken();
   if (auto Operand = ParseUnary())
     return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
@@ -770,7 +855,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
       return LHS;
 
     // Okay, we know this is a binop.
-    int BinOp = CurTok;
+    int BinOp = S->CurTok;
     getNextToken(); // eat binop
 
     // Parse the unary expression after the binary operator.
@@ -805,69 +890,82 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= id '(' (id typeannotation)* ')' typeannotation
+///   ::= binary LETTER number? (id, id) typeannotation
+///   ::= unary LETTER (id) typeannotation
 static std::unique_ptr<PrototypeAST> ParsePrototype(bool variadic = false) {
   std::string FnName;
 
   unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned BinaryPrecedence = 30;
 
-  switch (CurTok) {
+  switch (S->CurTok) {
   default:
     return LogErrorP("Expected function name in prototype");
   case tok_identifier:
-    FnName = IdentifierStr;
+    FnName = S->IdentifierStr;
     Kind = 0;
     getNextToken();
     break;
   case tok_unary:
     getNextToken();
-    if (!isascii(CurTok))
+    if (!isascii(S->CurTok))
       return LogErrorP("Expected unary operator");
     FnName = "unary";
-    FnName += (char)CurTok;
+    FnName += (char)S->CurTok;
     Kind = 1;
     getNextToken();
     break;
   case tok_binary:
     getNextToken();
-    if (!isascii(CurTok))
+    if (!isascii(S->CurTok))
       return LogErrorP("Expected binary operator");
     FnName = "binary";
-    FnName += (char)CurTok;
+    FnName += (char)S->CurTok;
     Kind = 2;
     getNextToken();
 
     // Read the precedence if present.
-    if (CurTok == tok_number) {
-      if (NumVal < 1 || NumVal > 100)
+    if (S->CurTok == tok_number) {
+      if (S->NumVal < 1 || S->NumVal > 100)
         return LogErrorP("Invalid precedence: must be 1..100");
-      BinaryPrecedence = (unsigned)NumVal;
+      BinaryPrecedence = (unsigned)S->NumVal;
       getNextToken();
     }
     break;
   }
 
-  if (CurTok != '(')
+  if (S->CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
   std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
-  if (CurTok != ')')
+  std::vector<Type *> ArgTypes;
+  getNextToken(); // eat '('.
+  while (S->CurTok == tok_identifier) {
+    ArgNames.push_back(S->IdentifierStr);
+    getNextToken(); // eat identifier.
+    Type *T;
+    if (!ParseTypeAnnotation(T))
+      return nullptr;
+    ArgTypes.push_back(T);
+  }
+  if (S->CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
   // success.
   getNextToken(); // eat ')'.
 
+  Type *RetType;
+  if (!ParseTypeAnnotation(RetType))
+    return nullptr;
+
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
 
   return std::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0,
-                                        BinaryPrecedence, variadic);
+                                        BinaryPrecedence, variadic,
+                                        std::move(ArgTypes), RetType);
 }
 
 /// definition ::= 'def' prototype expression
@@ -894,7 +992,7 @@ static std::unique_ptr<ExprAST> ParseTopLevelExpr() {
 static std::unique_ptr<PrototypeAST> ParseExtern() {
   getNextToken(); // eat extern.
   auto var = false;
-  if (CurTok == tok_variadic) {
+  if (S->CurTok == tok_variadic) {
     var = true;
     getNextToken(); // eat 'variadic
   }
@@ -905,43 +1003,171 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 // Code Generation
 //===----------------------------------------------------------------------===//
 
-static IRBuilder<> *Builder;
-static std::map<std::string, AllocaInst *> NamedValues;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+/// The action language has three value types: double (the default), i64 and
+/// ptr (i8*).  Values of any other LLVM type (e.g. the i32 globals of the
+/// lexer) are normalised to one of these when they are read.
+static Type *getDoubleTy() { return Type::getDoubleTy(S->mModule->TheContext); }
+static Type *getIntTy() { return Type::getInt64Ty(S->mModule->TheContext); }
+static Type *getPtrTy() { return Type::getInt8PtrTy(S->mModule->TheContext); }
 
-static Value *castfromdbl(Value *inst, Type *target) {
+/// coerce - Convert `inst' to `target', going through i64 for pointers.
+static Value *coerce(Value *inst, Type *target) {
   auto instT = inst->getType();
-  if (instT != target) {
-    auto i64T = llvm::Type::getInt64Ty(mModule->TheContext);
-    if (target->isArrayTy()) {
-      inst = (*Builder).CreateFPToSI(inst, i64T);
-      inst = (*Builder).CreateIntToPtr(
-          inst, target->getArrayElementType()->getPointerTo());
-      inst = (*Builder).CreateBitCast(inst, target);
-    } else if (target->isPointerTy()) {
-      inst = (*Builder).CreateFPToSI(inst, i64T);
-      inst = (*Builder).CreateIntToPtr(inst, target);
-    } else
-      inst = llvm::CastInst::Create(Instruction::FPToSI, inst, target, "rcast",
-                                    (*Builder).GetInsertBlock());
+  if (instT == target)
+    return inst;
+  if (instT->isIntegerTy(1)) {
+    // booleans are 0/1, not 0/-1
+    inst = (*S->Builder).CreateZExt(inst, getIntTy());
+    instT = inst->getType();
+    if (instT == target)
+      return inst;
+  }
+  if (target->isFloatingPointTy()) {
+    if (instT->isPointerTy())
+      inst = (*S->Builder).CreatePtrToInt(inst, getIntTy());
+    if (inst->getType()->isFloatingPointTy())
+      return (*S->Builder).CreateFPCast(inst, target, "mcast");
+    return (*S->Builder).CreateSIToFP(inst, target, "mcast");
+  }
+  if (target->isIntegerTy()) {
+    if (instT->isPointerTy())
+      inst = (*S->Builder).CreatePtrToInt(inst, getIntTy());
+    if (inst->getType()->isFloatingPointTy())
+      return (*S->Builder).CreateFPToSI(inst, target, "rcast");
+    return (*S->Builder).CreateSExtOrTrunc(inst, target, "rcast");
+  }
+  if (target->isPointerTy()) {
+    if (instT->isPointerTy())
+      return (*S->Builder).CreateBitCast(inst, target);
+    if (instT->isFloatingPointTy())
+      inst = (*S->Builder).CreateFPToSI(inst, getIntTy());
+    return (*S->Builder).CreateIntToPtr(inst, target);
   }
   return inst;
 }
-static Value *cast2dbl(Value *inst) {
+
+/// normalise - Bring a value read from the module into a value type.
+static Value *normalise(Value *inst) {
   auto instT = inst->getType();
-  auto dblT = llvm::Type::getDoubleTy(mModule->TheContext);
-  if (instT != dblT) {
-    auto i64T = llvm::Type::getInt64Ty(mModule->TheContext);
-    if (instT->isArrayTy()) {
-      inst = (*Builder).CreateBitCast(inst, i64T);
-      instT = inst->getType();
+  if (instT->isIntegerTy() && instT != getIntTy())
+    return instT->isIntegerTy(1) ? (*S->Builder).CreateZExt(inst, getIntTy())
+                                 : (*S->Builder).CreateSExt(inst, getIntTy());
+  if (instT->isPointerTy() && instT != getPtrTy())
+    return (*S->Builder).CreateBitCast(inst, getPtrTy());
+  if (instT->isFloatingPointTy() && !instT->isDoubleTy())
+    return (*S->Builder).CreateFPExt(inst, getDoubleTy());
+  return inst;
+}
+
+/// weakenLiteral - Integer literals take the type of an integral operand, so
+/// `x + 1' stays integral when `x' is.
+static Value *weakenLiteral(ExprAST &E, Value *V, Value *Other) {
+  if (!E.isIntegerLiteral() || Other->getType()->isDoubleTy())
+    return V;
+  return ConstantInt::get(
+      getIntTy(), (int64_t) static_cast<NumberExprAST &>(E).getValue(), true);
+}
+
+/// unifyTypes - The type two values meet at: double wins, then i64.
+static Type *unifyTypes(Type *A, Type *B) {
+  if (A == B)
+    return A;
+  if (A->isDoubleTy() || B->isDoubleTy())
+    return getDoubleTy();
+  return getIntTy();
+}
+
+/// emitCondition - Convert a value to a bool by comparing non-equal to zero.
+static Value *emitCondition(Value *V, const Twine &Name) {
+  if (V->getType()->isFloatingPointTy())
+    return (*S->Builder).CreateFCmpONE(V, ConstantFP::get(V->getType(), 0.0),
+                                    Name);
+  return (*S->Builder).CreateICmpNE(V, Constant::getNullValue(V->getType()),
+                                 Name);
+}
+
+/// emitBuiltinBinary - Emit one of the builtin arithmetic or comparison
+/// operators, returns nullptr if `Op' is not one.
+/// Anything involving a double is computed in doubles; otherwise the
+/// computation is integral, with `ptr +- int' being pointer arithmetic.
+static Value *emitBuiltinBinary(char Op, Value *L, Value *R) {
+  if (std::string{"+-*/<>?!"}.find(Op) == std::string::npos)
+    return nullptr;
+
+  auto LT = L->getType(), RT = R->getType();
+  auto &B = *S->Builder;
+
+  if (LT->isDoubleTy() || RT->isDoubleTy()) {
+    L = coerce(L, getDoubleTy());
+    R = coerce(R, getDoubleTy());
+    switch (Op) {
+    case '+':
+      return B.CreateFAdd(L, R, "addtmp");
+    case '-':
+      return B.CreateFSub(L, R, "subtmp");
+    case '*':
+      return B.CreateFMul(L, R, "multmp");
+    case '/':
+      return B.CreateFDiv(L, R, "divtmp");
+    case '<':
+      L = B.CreateFCmpULT(L, R, "cmptmp");
+      // Convert bool 0/1 to double 0.0 or 1.0
+      return B.CreateUIToFP(L, getDoubleTy(), "booltmp");
+    case '>':
+      L = B.CreateFCmpUGT(L, R, "cmptmp");
+      return B.CreateUIToFP(L, getDoubleTy(), "booltmp");
+    case '?':
+      L = B.CreateFCmpUEQ(L, R, "cmptmp");
+      return B.CreateUIToFP(L, getDoubleTy(), "booltmp");
+    case '!':
+      L = B.CreateFCmpUNE(L, R, "cmptmp");
+      return B.CreateUIToFP(L, getDoubleTy(), "booltmp");
+    default:
+      return nullptr;
     }
-    if (instT->isPointerTy())
-      inst = (*Builder).CreatePtrToInt(inst, i64T);
-    inst = llvm::CastInst::Create(Instruction::SIToFP, inst, dblT, "mcast",
-                                  (*Builder).GetInsertBlock());
   }
-  return inst;
+
+  auto i8T = Type::getInt8Ty(S->mModule->TheContext);
+  if (LT->isPointerTy() && !RT->isPointerTy() && (Op == '+' || Op == '-')) {
+    R = coerce(R, getIntTy());
+    if (Op == '-')
+      R = B.CreateNeg(R);
+    return B.CreateInBoundsGEP(i8T, coerce(L, getPtrTy()), R, "ptradd");
+  }
+  if (RT->isPointerTy() && !LT->isPointerTy() && Op == '+')
+    return B.CreateInBoundsGEP(i8T, coerce(R, getPtrTy()), coerce(L, getIntTy()),
+                               "ptradd");
+
+  // pointers compare as unsigned addresses
+  bool Unsigned = LT->isPointerTy() || RT->isPointerTy();
+  L = coerce(L, getIntTy());
+  R = coerce(R, getIntTy());
+  switch (Op) {
+  case '+':
+    return B.CreateAdd(L, R, "addtmp");
+  case '-':
+    return B.CreateSub(L, R, "subtmp");
+  case '*':
+    return B.CreateMul(L, R, "multmp");
+  case '/':
+    return B.CreateSDiv(L, R, "divtmp");
+  case '<':
+    L = Unsigned ? B.CreateICmpULT(L, R, "cmptmp")
+                 : B.CreateICmpSLT(L, R, "cmptmp");
+    return B.CreateZExt(L, getIntTy(), "booltmp");
+  case '>':
+    L = Unsigned ? B.CreateICmpUGT(L, R, "cmptmp")
+                 : B.CreateICmpSGT(L, R, "cmptmp");
+    return B.CreateZExt(L, getIntTy(), "booltmp");
+  case '?':
+    L = B.CreateICmpEQ(L, R, "cmptmp");
+    return B.CreateZExt(L, getIntTy(), "booltmp");
+  case '!':
+    L = B.CreateICmpNE(L, R, "cmptmp");
+    return B.CreateZExt(L, getIntTy(), "booltmp");
+  default:
+    return nullptr;
+  }
 }
 
 Value *LogErrorV(const char *Str) {
@@ -951,13 +1177,13 @@ Value *LogErrorV(const char *Str) {
 
 Function *getFunction(std::string Name) {
   // First, see if the function has already been added to the current module.
-  if (auto *F = (mModule->TheModule)->getFunction(Name))
+  if (auto *F = (S->mModule->TheModule)->getFunction(Name))
     return F;
 
   // If not, check whether we can codegen the declaration from some existing
   // prototype.
-  auto FI = FunctionProtos.find(Name);
-  if (FI != FunctionProtos.end())
+  auto FI = S->FunctionProtos.find(Name);
+  if (FI != S->FunctionProtos.end())
     return FI->second->codegen();
 
   // If no existing prototype exists, return null.
@@ -967,49 +1193,49 @@ Function *getFunction(std::string Name) {
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
 static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          const std::string &VarName) {
+                                          const std::string &VarName,
+                                          Type *VarType) {
   IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                    TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy((mModule->TheContext)), nullptr,
-                           VarName);
+  return TmpB.CreateAlloca(VarType, nullptr, VarName);
 }
 
 Value *NumberExprAST::codegen() {
-  return ConstantFP::get((mModule->TheContext), APFloat(Val));
+  return ConstantFP::get((S->mModule->TheContext), APFloat(Val));
 }
 
 Value *StringExprAST::codegen() {
   std::vector<Constant *> ref;
   for (int i = 0; i < Val.size(); i++)
     ref.push_back(
-        ConstantInt::get(Type::getInt8Ty(mModule->TheContext), Val[i]));
-  ref.push_back(ConstantInt::get(Type::getInt8Ty(mModule->TheContext), 0));
+        ConstantInt::get(Type::getInt8Ty(S->mModule->TheContext), Val[i]));
+  ref.push_back(ConstantInt::get(Type::getInt8Ty(S->mModule->TheContext), 0));
   GlobalVariable *stringVal = new GlobalVariable{
-      *mModule->TheModule,
-      ArrayType::get(Type::getInt8Ty(mModule->TheContext), Val.size() + 1),
+      *S->mModule->TheModule,
+      ArrayType::get(Type::getInt8Ty(S->mModule->TheContext), Val.size() + 1),
       true,
       GlobalValue::LinkageTypes::InternalLinkage,
       ConstantArray::get(
-          ArrayType::get(Type::getInt8Ty(mModule->TheContext), Val.size() + 1),
+          ArrayType::get(Type::getInt8Ty(S->mModule->TheContext), Val.size() + 1),
           ref),
       "@userstring"};
   llvm::Value *idxs[] = {
       reinterpret_cast<llvm::Value *>(llvm::ConstantInt::get(
-          llvm::Type::getInt64Ty(mModule->TheContext), 0, false)),
+          llvm::Type::getInt64Ty(S->mModule->TheContext), 0, false)),
       reinterpret_cast<llvm::Value *>(llvm::ConstantInt::get(
-          llvm::Type::getInt64Ty(mModule->TheContext), 0, false)),
+          llvm::Type::getInt64Ty(S->mModule->TheContext), 0, false)),
   };
-  return cast2dbl(ConstantExpr::getInBoundsGetElementPtr(
-      ArrayType::get(Type::getInt8Ty(mModule->TheContext), Val.size() + 1),
-      stringVal, idxs));
+  return ConstantExpr::getInBoundsGetElementPtr(
+      ArrayType::get(Type::getInt8Ty(S->mModule->TheContext), Val.size() + 1),
+      stringVal, idxs);
 }
 
 Value *VariableExprAST::codegen() {
   // Look this variable up in the function.
-  Value *V = NamedValues[Name];
+  Value *V = S->NamedValues[Name];
 
   if (!V) {
-    if ((V = mModule->TheModule->getGlobalVariable(Name, true)) == nullptr)
+    if ((V = S->mModule->TheModule->getGlobalVariable(Name, true)) == nullptr)
       return LogErrorV(("Unknown variable name " + Name).c_str());
   }
 
@@ -1018,15 +1244,16 @@ Value *VariableExprAST::codegen() {
       V->getType()->getPointerElementType()->isArrayTy()) {
     llvm::Value *idxs[] = {
         reinterpret_cast<llvm::Value *>(llvm::ConstantInt::get(
-            llvm::Type::getInt64Ty(mModule->TheContext), 0, false)),
+            llvm::Type::getInt64Ty(S->mModule->TheContext), 0, false)),
         reinterpret_cast<llvm::Value *>(llvm::ConstantInt::get(
-            llvm::Type::getInt64Ty(mModule->TheContext), 0, false)),
+            llvm::Type::getInt64Ty(S->mModule->TheContext), 0, false)),
     };
-    return cast2dbl(
-        (*Builder).CreateInBoundsGEP(V->getType()->getPointerElementType(), V,
+    return normalise(
+        (*S->Builder).CreateInBoundsGEP(V->getType()->getPointerElementType(), V,
                                      idxs)); // load arrays by pointer
   }
-  return cast2dbl((*Builder).CreateLoad(V, Name.c_str()));
+  return normalise((*S->Builder).CreateLoad(V->getType()->getPointerElementType(),
+                                         V, Name.c_str()));
 }
 
 Value *UnaryExprAST::codegen() {
@@ -1034,12 +1261,21 @@ Value *UnaryExprAST::codegen() {
   if (!OperandV)
     return nullptr;
 
+  // dereferencing an integral value is a plain byte load
+  if (Opcode == '^' && !OperandV->getType()->isDoubleTy()) {
+    auto i8T = Type::getInt8Ty(S->mModule->TheContext);
+    return (*S->Builder).CreateSExt(
+        (*S->Builder).CreateLoad(i8T, coerce(OperandV, getPtrTy()), "deref"),
+        getIntTy());
+  }
+
   Function *F = getFunction(std::string("unary") + Opcode);
   if (!F)
     return LogErrorV(
         std::string{"Unknown unary operator " + std::string{Opcode}}.c_str());
 
-  return (*Builder).CreateCall(F, OperandV, "unop");
+  OperandV = coerce(OperandV, F->arg_begin()->getType());
+  return normalise((*S->Builder).CreateCall(F, OperandV, "unop"));
 }
 
 Value *BinaryExprAST::codegen() {
@@ -1058,19 +1294,18 @@ Value *BinaryExprAST::codegen() {
       return nullptr;
 
     // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
+    Value *Variable = S->NamedValues[LHSE->getName()];
     if (!Variable)
-      if ((Variable = mModule->TheModule->getGlobalVariable(LHSE->getName(),
+      if ((Variable = S->mModule->TheModule->getGlobalVariable(LHSE->getName(),
                                                             true)) == nullptr)
         return LogErrorV(("Unknown variable name " + LHSE->getName()).c_str());
 
-    auto val = Val;
+    auto ElemT = Variable->getType()->getPointerElementType();
+    if (ElemT->isArrayTy())
+      return LogErrorV(
+          ("Cannot assign to array " + LHSE->getName()).c_str());
 
-    if (Variable->getType()->getPointerElementType() != val->getType()) {
-      // cast back
-      val = castfromdbl(val, Variable->getType()->getPointerElementType());
-    }
-    (*Builder).CreateStore(val, Variable);
+    (*S->Builder).CreateStore(coerce(Val, ElemT), Variable);
     return Val;
   }
 
@@ -1079,43 +1314,32 @@ Value *BinaryExprAST::codegen() {
   if (!L || !R)
     return nullptr;
 
-  switch (Op) {
-  case '+':
-    return (*Builder).CreateFAdd(L, R, "addtmp");
-  case '-':
-    return (*Builder).CreateFSub(L, R, "subtmp");
-  case '*':
-    return (*Builder).CreateFMul(L, R, "multmp");
-  case '/':
-    return (*Builder).CreateFDiv(L, R, "divtmp");
-  case '<':
-    L = (*Builder).CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return (*Builder).CreateUIToFP(L, Type::getDoubleTy((mModule->TheContext)),
-                                   "booltmp");
-  case '>':
-    L = (*Builder).CreateFCmpUGT(L, R, "cmptmp");
-    return (*Builder).CreateUIToFP(L, Type::getDoubleTy((mModule->TheContext)),
-                                   "booltmp");
-  case '?':
-    L = (*Builder).CreateFCmpUEQ(L, R, "cmptmp");
-    return (*Builder).CreateUIToFP(L, Type::getDoubleTy((mModule->TheContext)),
-                                   "booltmp");
-  case '!':
-    L = (*Builder).CreateFCmpUNE(L, R, "cmptmp");
-    return (*Builder).CreateUIToFP(L, Type::getDoubleTy((mModule->TheContext)),
-                                   "booltmp");
-  default:
-    break;
+  L = weakenLiteral(*LHS, L, R);
+  R = weakenLiteral(*RHS, R, L);
+
+  // sequencing keeps the type of its right hand side
+  if (Op == ':')
+    return R;
+
+  // storing through an integral pointer is a plain byte store
+  if (Op == '`' && !L->getType()->isDoubleTy()) {
+    (*S->Builder).CreateStore(coerce(R, Type::getInt8Ty(S->mModule->TheContext)),
+                           coerce(L, getPtrTy()));
+    return R;
   }
 
+  if (auto V = emitBuiltinBinary(Op, L, R))
+    return V;
+
   // If it wasn't a builtin binary operator, it must be a user defined one. Emit
   // a call to it.
   Function *F = getFunction(std::string("binary") + Op);
   assert(F && "binary operator not found!");
 
-  Value *Ops[] = {L, R};
-  return (*Builder).CreateCall(F, Ops, "binop");
+  auto FArg = F->arg_begin();
+  Value *Ops[] = {coerce(L, FArg->getType()),
+                  coerce(R, std::next(FArg)->getType())};
+  return normalise((*S->Builder).CreateCall(F, Ops, "binop"));
 }
 
 Value *CallExprAST::codegen() {
@@ -1141,19 +1365,21 @@ Value *CallExprAST::codegen() {
                          .c_str());
 
   std::vector<Value *> ArgsV;
-  // auto farg = CalleeF->arg_begin();
+  auto farg = CalleeF->arg_begin();
   for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    // if (farg == CalleeF->arg_end())
-    ArgsV.push_back(Args[i]->codegen());
-    // else {
-    // ArgsV.push_back(castfromdbl(Args[i]->codegen(), farg->getType()));
-    // farg++;
-    // }
-    if (!ArgsV.back())
+    auto *arg = Args[i]->codegen();
+    if (!arg)
       return nullptr;
+    // convert to the parameter type for typed functions (e.g.
+    // nlex_get_group_length(i32)), variadic arguments are passed as they are
+    if (farg != CalleeF->arg_end()) {
+      arg = coerce(arg, farg->getType());
+      farg++;
+    }
+    ArgsV.push_back(arg);
   }
 
-  return cast2dbl((*Builder).CreateCall(CalleeF, ArgsV, "calltmp"));
+  return normalise((*S->Builder).CreateCall(CalleeF, ArgsV, "calltmp"));
 }
 
 Value *IfExprAST::codegen() {
@@ -1161,49 +1387,60 @@ Value *IfExprAST::codegen() {
   if (!CondV)
     return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = (*Builder).CreateFCmpONE(
-      CondV, ConstantFP::get((mModule->TheContext), APFloat(0.0)), "ifcond");
+  // Convert condition to a bool by comparing non-equal to 0.
+  CondV = emitCondition(CondV, "ifcond");
 
-  Function *TheFunction = (*Builder).GetInsertBlock()->getParent();
+  Function *TheFunction = (*S->Builder).GetInsertBlock()->getParent();
 
   // Create blocks for the then and else cases.  Insert the 'then' block at the
   // end of the function.
   BasicBlock *ThenBB =
-      BasicBlock::Create((mModule->TheContext), "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create((mModule->TheContext), "else");
-  BasicBlock *MergeBB = BasicBlock::Create((mModule->TheContext), "ifcont");
+      BasicBlock::Create((S->mModule->TheContext), "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create((S->mModule->TheContext), "else");
+  BasicBlock *MergeBB = BasicBlock::Create((S->mModule->TheContext), "ifcont");
 
-  (*Builder).CreateCondBr(CondV, ThenBB, ElseBB);
+  (*S->Builder).CreateCondBr(CondV, ThenBB, ElseBB);
 
   // Emit then value.
-  (*Builder).SetInsertPoint(ThenBB);
+  (*S->Builder).SetInsertPoint(ThenBB);
 
   Value *ThenV = Then->codegen();
   if (!ThenV)
     return nullptr;
 
-  (*Builder).CreateBr(MergeBB);
+  (*S->Builder).CreateBr(MergeBB);
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = (*Builder).GetInsertBlock();
+  ThenBB = (*S->Builder).GetInsertBlock();
 
   // Emit else block.
   TheFunction->getBasicBlockList().push_back(ElseBB);
-  (*Builder).SetInsertPoint(ElseBB);
+  (*S->Builder).SetInsertPoint(ElseBB);
 
   Value *ElseV = Else->codegen();
   if (!ElseV)
     return nullptr;
 
-  (*Builder).CreateBr(MergeBB);
+  (*S->Builder).CreateBr(MergeBB);
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  ElseBB = (*Builder).GetInsertBlock();
+  ElseBB = (*S->Builder).GetInsertBlock();
+
+  // Bring both arms to the same type, at the end of their blocks.
+  ThenV = weakenLiteral(*Then, ThenV, ElseV);
+  ElseV = weakenLiteral(*Else, ElseV, ThenV);
+  Type *ResT = unifyTypes(ThenV->getType(), ElseV->getType());
+  if (ThenV->getType() != ResT) {
+    (*S->Builder).SetInsertPoint(ThenBB->getTerminator());
+    ThenV = coerce(ThenV, ResT);
+  }
+  if (ElseV->getType() != ResT) {
+    (*S->Builder).SetInsertPoint(ElseBB->getTerminator());
+    ElseV = coerce(ElseV, ResT);
+  }
 
   // Emit merge block.
   TheFunction->getBasicBlockList().push_back(MergeBB);
-  (*Builder).SetInsertPoint(MergeBB);
-  PHINode *PN = (*Builder).CreatePHI(Type::getDoubleTy((mModule->TheContext)),
-                                     2, "iftmp");
+  (*S->Builder).SetInsertPoint(MergeBB);
+  PHINode *PN = (*S->Builder).CreatePHI(ResT, 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
@@ -1221,20 +1458,20 @@ Value *IfExprAST::codegen() {
 //   br loopcond
 // outloop:
 Value *WhileExprAST::codegen() {
-  Function *TheFunction = (*Builder).GetInsertBlock()->getParent();
+  Function *TheFunction = (*S->Builder).GetInsertBlock()->getParent();
 
   // Make the new basic block for the loop header, inserting after current
   // block.
   BasicBlock *LoopBB =
-      BasicBlock::Create((mModule->TheContext), "wloopcond", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "wloopcond", TheFunction);
   BasicBlock *LoopBBB =
-      BasicBlock::Create((mModule->TheContext), "wloop", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "wloop", TheFunction);
 
   // Insert an explicit fall through from the current block to the LoopBB.
-  (*Builder).CreateBr(LoopBB);
+  (*S->Builder).CreateBr(LoopBB);
 
   // Start insertion in LoopBB.
-  (*Builder).SetInsertPoint(LoopBB);
+  (*S->Builder).SetInsertPoint(LoopBB);
 
   // Emit the condition of the loop
   auto CondVal = Condition->codegen();
@@ -1243,17 +1480,14 @@ Value *WhileExprAST::codegen() {
 
   // Create the "after loop" block and insert it.
   BasicBlock *AfterBB =
-      BasicBlock::Create((mModule->TheContext), "wafterloop", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "wafterloop", TheFunction);
 
   // Jump to the body if condition ok
-  (*Builder).CreateCondBr(
-      (*Builder).CreateFCmpONE(
-          CondVal, ConstantFP::get((mModule->TheContext), APFloat(0.0)),
-          "wloopcond"),
-      LoopBBB, AfterBB);
+  (*S->Builder).CreateCondBr(emitCondition(CondVal, "wloopcond"), LoopBBB,
+                          AfterBB);
 
   // Start insertion in LoopBBB.
-  (*Builder).SetInsertPoint(LoopBBB);
+  (*S->Builder).SetInsertPoint(LoopBBB);
 
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
@@ -1262,16 +1496,16 @@ Value *WhileExprAST::codegen() {
     return nullptr;
 
   // jump back to condition
-  (*Builder).CreateBr(LoopBB);
+  (*S->Builder).CreateBr(LoopBB);
 
   // Switch to insertion inside After
-  (*Builder).SetInsertPoint(AfterBB);
+  (*S->Builder).SetInsertPoint(AfterBB);
 
   // while expr always returns 0.0.
-  return Constant::getNullValue(Type::getDoubleTy((mModule->TheContext)));
+  return Constant::getNullValue(Type::getDoubleTy((S->mModule->TheContext)));
 }
 // Output for-loop as:
-//   var = alloca double
+//   var = alloca <type of var, or of startexpr>
 //   ...
 //   start = startexpr
 //   store start -> var
@@ -1293,40 +1527,41 @@ Value *WhileExprAST::codegen() {
 //   br check
 // outloop:
 Value *ForExprAST::codegen() {
-  Function *TheFunction = (*Builder).GetInsertBlock()->getParent();
-
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  Function *TheFunction = (*S->Builder).GetInsertBlock()->getParent();
 
   // Emit the start code first, without 'variable' in scope.
   Value *StartVal = Start->codegen();
   if (!StartVal)
     return nullptr;
 
+  // Create an alloca for the variable in the entry block.
+  Type *VarT = VarType ? VarType : StartVal->getType();
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarT);
+
   // Store the value into the alloca.
-  (*Builder).CreateStore(StartVal, Alloca);
+  (*S->Builder).CreateStore(coerce(StartVal, VarT), Alloca);
 
   // Make the new basic block for the loop header, inserting after current
   // block.
   BasicBlock *LoopBB =
-      BasicBlock::Create((mModule->TheContext), "loop", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "loop", TheFunction);
   BasicBlock *CondBB =
-      BasicBlock::Create((mModule->TheContext), "loopcond", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "loopcond", TheFunction);
   BasicBlock *LoopNextBB =
-      BasicBlock::Create((mModule->TheContext), "loopnext", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "loopnext", TheFunction);
   BasicBlock *AfterBB =
-      BasicBlock::Create((mModule->TheContext), "afterloop", TheFunction);
+      BasicBlock::Create((S->mModule->TheContext), "afterloop", TheFunction);
 
   // Insert an explicit fall through from the current block to the LoopBB.
-  (*Builder).CreateBr(CondBB);
+  (*S->Builder).CreateBr(CondBB);
 
   // Start insertion in LoopBB.
-  (*Builder).SetInsertPoint(LoopBB);
+  (*S->Builder).SetInsertPoint(LoopBB);
 
   // Within the loop, the variable is defined equal to the PHI node.  If it
   // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  AllocaInst *OldVal = S->NamedValues[VarName];
+  S->NamedValues[VarName] = Alloca;
 
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
@@ -1334,24 +1569,25 @@ Value *ForExprAST::codegen() {
   if (!Body->codegen())
     return nullptr;
 
-  (*Builder).CreateBr(LoopNextBB);
+  (*S->Builder).CreateBr(LoopNextBB);
 
-  (*Builder).SetInsertPoint(CondBB);
+  (*S->Builder).SetInsertPoint(CondBB);
 
   // Compute the end condition.
   Value *EndCond = End->codegen();
   if (!EndCond)
     return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  EndCond = (*Builder).CreateFCmpONE(
-      EndCond, ConstantFP::get((mModule->TheContext), APFloat(0.0)),
-      "loopcondv");
+  // Convert condition to a bool by comparing non-equal to 0.
+  EndCond = emitCondition(EndCond, "loopcondv");
 
   // Insert the conditional branch into the end.
-  (*Builder).CreateCondBr(EndCond, LoopBB, AfterBB);
+  (*S->Builder).CreateCondBr(EndCond, LoopBB, AfterBB);
+
+  (*S->Builder).SetInsertPoint(LoopNextBB);
 
-  (*Builder).SetInsertPoint(LoopNextBB);
+  // Reload the variable, the step may refer to it.
+  Value *CurVar = (*S->Builder).CreateLoad(VarT, Alloca, VarName.c_str());
 
   // Emit the step value.
   Value *StepVal = nullptr;
@@ -1359,53 +1595,55 @@ Value *ForExprAST::codegen() {
     StepVal = Step->codegen();
     if (!StepVal)
       return nullptr;
-  } else {
+    StepVal = weakenLiteral(*Step, StepVal, CurVar);
+  } else if (VarT->isDoubleTy()) {
     // If not specified, use 1.0.
-    StepVal = ConstantFP::get((mModule->TheContext), APFloat(1.0));
+    StepVal = ConstantFP::get((S->mModule->TheContext), APFloat(1.0));
+  } else {
+    StepVal = ConstantInt::get(getIntTy(), 1);
   }
 
-  // Reload, increment, and restore the alloca.  This handles the case where
-  // the body of the loop mutates the variable.
-  Value *CurVar = (*Builder).CreateLoad(Alloca, VarName.c_str());
-  Value *NextVar = (*Builder).CreateFAdd(CurVar, StepVal, "nextvar");
-  (*Builder).CreateStore(NextVar, Alloca);
+  // Increment and restore the alloca.  This handles the case where the body of
+  // the loop mutates the variable.
+  Value *NextVar = emitBuiltinBinary('+', CurVar, StepVal);
+  (*S->Builder).CreateStore(coerce(NextVar, VarT), Alloca);
 
   // jump and test the condition
-  (*Builder).CreateBr(CondBB);
+  (*S->Builder).CreateBr(CondBB);
 
   // Any new code will be inserted in AfterBB.
-  (*Builder).SetInsertPoint(AfterBB);
+  (*S->Builder).SetInsertPoint(AfterBB);
 
   // Restore the unshadowed variable.
   if (OldVal)
-    NamedValues[VarName] = OldVal;
+    S->NamedValues[VarName] = OldVal;
   else
-    NamedValues.erase(VarName);
+    S->NamedValues.erase(VarName);
 
   // for expr always returns 0.0.
-  return Constant::getNullValue(Type::getDoubleTy((mModule->TheContext)));
+  return Constant::getNullValue(Type::getDoubleTy((S->mModule->TheContext)));
 }
 
 Value *GlobalExprAST::codegen() {
   // Register all globals that don't exist
   for (auto [name, initialiser] : Names) {
-    if (mModule->TheModule->getGlobalVariable(name) != nullptr)
+    if (S->mModule->TheModule->getGlobalVariable(name) != nullptr)
       continue;
 
-    new GlobalVariable{*mModule->TheModule,
-                       llvm::Type::getDoubleTy(mModule->TheContext),
+    new GlobalVariable{*S->mModule->TheModule,
+                       initialiser->getType(),
                        false,
                        GlobalValue::LinkageTypes::InternalLinkage,
                        initialiser,
                        name};
   }
-  return Constant::getNullValue(Type::getDoubleTy((mModule->TheContext)));
+  return Constant::getNullValue(Type::getDoubleTy((S->mModule->TheContext)));
 }
 
 Value *VarExprAST::codegen() {
   std::vector<AllocaInst *> OldBindings;
 
-  Function *TheFunction = (*Builder).GetInsertBlock()->getParent();
+  Function *TheFunction = (*S->Builder).GetInsertBlock()->getParent();
 
   // Register all variables and emit their initializer.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
@@ -1417,24 +1655,29 @@ Value *VarExprAST::codegen() {
     // like this:
     //  var a = 1 in
     //    var a = a in ...   # refers to outer 'a'.
+    Type *VarT = VarTypes[i];
     Value *InitVal;
     if (Init) {
       InitVal = Init->codegen();
       if (!InitVal)
         return nullptr;
-    } else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get((mModule->TheContext), APFloat(0.0));
+      if (!VarT)
+        VarT = InitVal->getType();
+    } else { // If not specified, use 0.
+      if (!VarT)
+        VarT = getDoubleTy();
+      InitVal = Constant::getNullValue(VarT);
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    (*Builder).CreateStore(InitVal, Alloca);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarT);
+    (*S->Builder).CreateStore(coerce(InitVal, VarT), Alloca);
 
     // Remember the old variable binding so that we can restore the binding when
     // we unrecurse.
-    OldBindings.push_back(NamedValues[VarName]);
+    OldBindings.push_back(S->NamedValues[VarName]);
 
     // Remember this binding.
-    NamedValues[VarName] = Alloca;
+    S->NamedValues[VarName] = Alloca;
   }
 
   // Codegen the body, now that all vars are in scope.
@@ -1444,7 +1687,7 @@ Value *VarExprAST::codegen() {
 
   // Pop all our variables from scope.
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    NamedValues[VarNames[i].first] = OldBindings[i];
+    S->NamedValues[VarNames[i].first] = OldBindings[i];
 
   // Return the body computation.
   return BodyVal;
@@ -1452,13 +1695,15 @@ Value *VarExprAST::codegen() {
 
 Function *PrototypeAST::codegen() {
   // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(),
-                              Type::getDoubleTy((mModule->TheContext)));
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy((mModule->TheContext)),
-                                       Doubles, isVariadic());
+  std::vector<Type *> Types;
+  for (unsigned i = 0; i < Args.size(); i++)
+    Types.push_back(i < ArgTypes.size() && ArgTypes[i] ? ArgTypes[i]
+                                                       : getDoubleTy());
+  FunctionType *FT = FunctionType::get(RetType ? RetType : getDoubleTy(),
+                                       Types, isVariadic());
 
   Function *F = Function::Create(FT, Function::ExternalLinkage, Name,
-                                 (mModule->TheModule).get());
+                                 (S->mModule->TheModule).get());
 
   // Set names for all arguments.
   unsigned Idx = 0;
@@ -1472,36 +1717,37 @@ Function *FunctionAST::codegen() {
   // Transfer ownership of the prototype to the FunctionProtos map, but keep a
   // reference to it for use below.
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
+  S->FunctionProtos[Proto->getName()] = std::move(Proto);
   Function *TheFunction = getFunction(P.getName());
   if (!TheFunction)
     return nullptr;
 
   // If this is an operator, install it.
   if (P.isBinaryOp())
-    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    S->BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
 
   // Create a new basic block to start insertion into.
   BasicBlock *BB =
-      BasicBlock::Create((mModule->TheContext), "entry", TheFunction);
-  (*Builder).SetInsertPoint(BB);
+      BasicBlock::Create((S->mModule->TheContext), "entry", TheFunction);
+  (*S->Builder).SetInsertPoint(BB);
 
   // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
+  S->NamedValues.clear();
   for (auto &Arg : TheFunction->args()) {
     // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    AllocaInst *Alloca =
+        CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
 
     // Store the initial value into the alloca.
-    (*Builder).CreateStore(&Arg, Alloca);
+    (*S->Builder).CreateStore(&Arg, Alloca);
 
     // Add arguments to variable symbol table.
-    NamedValues[Arg.getName()] = Alloca;
+    S->NamedValues[Arg.getName()] = Alloca;
   }
 
   if (Value *RetVal = Body->codegen()) {
     // Finish off the function.
-    (*Builder).CreateRet(RetVal);
+    (*S->Builder).CreateRet(coerce(RetVal, TheFunction->getReturnType()));
 
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
@@ -1513,7 +1759,7 @@ Function *FunctionAST::codegen() {
   TheFunction->eraseFromParent();
 
   if (P.isBinaryOp())
-    BinopPrecedence.erase(P.getOperatorName());
+    S->BinopPrecedence.erase(P.getOperatorName());
   return nullptr;
 }
 
@@ -1540,7 +1786,7 @@ static void HandleExtern() {
       // fprintf(stderr, "Read extern: ");
       // FnIR->print(errs());
       // fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      S->FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
     }
   } else {
     // Skip token for error recovery.
@@ -1559,14 +1805,34 @@ static void HandleTopLevelExpression(bool allow_bare) {
   }
 }
 
+namespace {
+/// CurrentState - Make a compiler's state the current one of this thread for
+/// the duration of a scope.
+class CurrentState {
+  KaleidState *Saved;
+
+public:
+  CurrentState(KaleidState *State) : Saved(S) { S = State; }
+  ~CurrentState() { S = Saved; }
+};
+} // end anonymous namespace
+
+KaleidCompiler::KaleidCompiler(nlvm::BaseModule *module)
+    : state(std::make_unique<KaleidState>()) {
+  state->mModule = module;
+}
+
+KaleidCompiler::~KaleidCompiler() = default;
+
 /// top ::= definition | external | expression | ';'
-void KaleidCompile(std::string code, llvm::IRBuilder<> &TheBuilder,
-                   bool allow_bare_expressions = false) {
-  Builder = &TheBuilder;
+void KaleidCompiler::compile(std::string code, llvm::IRBuilder<> &TheBuilder,
+                             bool allow_bare_expressions) {
+  CurrentState current{state.get()};
+  S->Builder = &TheBuilder;
   KaleidFeed(code);
   getNextToken(true);
   while (true) {
-    switch (CurTok) {
+    switch (S->CurTok) {
     case tok_eof:
       return;
     case ';': // ignore top-level semicolons.
@@ -1617,27 +1883,23 @@ extern "C" DLLEXPORT double printd(double X) {
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
-static bool initd = false;
-
-void KaleidInitialise(std::string startup_code, nlvm::BaseModule *module) {
-  if (initd)
+void KaleidCompiler::initialise(std::string startup_code) {
+  if (initialised)
     return;
-  initd = true;
+  initialised = true;
+  CurrentState current{state.get()};
   // Install standard binary operators.
   // 1 is lowest precedence.
-  BinopPrecedence['='] = 5;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['>'] = 10;
-  BinopPrecedence['?'] = 10;
-  BinopPrecedence['!'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
-  BinopPrecedence['/'] = 40; // highest.
-
-  mModule = module;
-  llvm::IRBuilder<> TheBuilder(mModule->TheContext);
-  Builder = &TheBuilder;
+  S->BinopPrecedence['='] = 5;
+  S->BinopPrecedence[':'] = 30;
+  S->BinopPrecedence['<'] = 10;
+  S->BinopPrecedence['>'] = 10;
+  S->BinopPrecedence['?'] = 10;
+  S->BinopPrecedence['!'] = 10;
+  S->BinopPrecedence['+'] = 20;
+  S->BinopPrecedence['-'] = 20;
+  S->BinopPrecedence['*'] = 40; // highest.
+  S->BinopPrecedence['/'] = 40; // highest.
 
   // Prime the first token
   KaleidFeed(startup_code);
@@ -1647,7 +1909,7 @@ void KaleidInitialise(std::string startup_code, nlvm::BaseModule *module) {
   InitializeNativeTargetAsmPrinter();
 
   auto TargetTriple = sys::getDefaultTargetTriple();
-  (mModule->TheModule)->setTargetTriple(TargetTriple);
+  (S->mModule->TheModule)->setTargetTriple(TargetTriple);
 
   std::string Error;
   auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
@@ -1668,7 +1930,7 @@ void KaleidInitialise(std::string startup_code, nlvm::BaseModule *module) {
   auto TheTargetMachine =
       Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
 
-  (mModule->TheModule)->setDataLayout(TheTargetMachine->createDataLayout());
+  (S->mModule->TheModule)->setDataLayout(TheTargetMachine->createDataLayout());
 }
 
 #ifdef TEST
@@ -1676,14 +1938,15 @@ auto main() -> int {
   nlvm::BaseModule m;
   m.TheModule = std::move(std::make_unique<llvm::Module>("shit", m.TheContext));
 
-  KaleidInitialise("", &m);
+  KaleidCompiler compiler{&m};
+  compiler.initialise("");
   llvm::IRBuilder<> builder(m.TheContext);
   std::string line;
   while (true) {
     std::cout << "> ";
     std::getline(std::cin, line);
 
-    KaleidCompile(line, builder, true);
+    compiler.compile(line, builder, true);
     if (line == "")
       break;
   }
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "llvm/IR/IRBuilder.h"
+#include <memory>
+#include <string>
+
+namespace nlvm {
+struct BaseModule;
+}
+struct KaleidState;
+
+/// KaleidCompiler - Compiles embedded rule actions and `define's into a
+/// module.  All of the lexer, parser and code generator state belongs to the
+/// instance, so compilers working on separate modules (and contexts) can run
+/// on separate threads.
+class KaleidCompiler {
+  std::unique_ptr<KaleidState> state;
+  bool initialised = false;
+
+public:
+  KaleidCompiler(nlvm::BaseModule *module);
+  ~KaleidCompiler();
+
+  /// Install the builtin operators and queue `startup_code' to be compiled
+  /// along with the first compile(); only the first call has any effect.
+  void initialise(std::string startup_code);
+
+  /// Compile `code' at the insertion point of `builder'; top-level
+  /// expressions are only emitted if `allow_bare_expressions' is set.
+  void compile(std::string code, llvm::IRBuilder<> &builder,
+               bool allow_bare_expressions = false);
+};
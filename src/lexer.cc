@@ -85,7 +85,8 @@ void Token::print() {
     std::printf("Token { %s, line %d, offset %d, length %d, value = <%s> }\n",
                 reverse_token_type[type], lineno, offset, length,
                 std::get<Regexp>(value).to_str().c_str());
-  else if (type == TokenType::TOK_TAGPOSEVERY)
+  else if (type == TokenType::TOK_TAGPOSEVERY ||
+           type == TokenType::TOK_NUMBER)
     std::printf("Token { %s, line %d, offset %d, length %d, value = <%d> }\n",
                 reverse_token_type[type], lineno, offset, length,
                 std::get<int>(value));
@@ -532,6 +533,23 @@ inline Token NLexer::_next() {
   }
   case LexerState::OptionBool: {
     bool truth;
+    if (isdigit(c)) {
+      // numeric option value
+      int value = c - '0';
+      length = 1;
+      while (isdigit(*source_p)) {
+        value = value * 10 + (*source_p - '0');
+        advance(1);
+        length++;
+      }
+      state = LexerState::Toplevel;
+      return Token{TOK_NUMBER, lineno, offset - length, length, value};
+    }
+    if (c == '[') {
+      // a list of names, read like the names of `ignore [...]'
+      state = LexerState::IgnoreBrac;
+      return next();
+    }
     if (c == 'o' && strncmp("ff", source_p, 2) == 0 &&
         isspace(*(source_p + 2))) {
       advance(2);
@@ -545,7 +563,7 @@ inline Token NLexer::_next() {
     } else {
       const Token &mtoken = error_token();
       lexer_error(*this, Errors::Unexpected, mtoken, ErrorPosition::On,
-                  "Expected either `on' or `off'");
+                  "Expected either `on', `off', a number or a list of names");
       state = LexerState::Toplevel;
       return mtoken;
     }
@@ -2098,6 +2116,18 @@ Regexp::compile(std::multimap<const Regexp *, NFANode<std::string> *> &cache,
     parent->epsilon_transition_to(tl);
     tl->named_rule = namef;
     tl->backreference = index;
+    // the node compares the whole capture at once, so repeat it there
+    // instead of making copies (they would all end up in one DFA state)
+    if (star)
+      tl->backreference_repeat = {0, -1};
+    else if (plus)
+      tl->backreference_repeat = {1, -1};
+    else if (repeat.has_value())
+      tl->backreference_repeat = {
+          repeat->lowbound,
+          repeat->has_highbound ? repeat->highbound : repeat->lowbound};
+    if (lazy)
+      tl->backreference_repeat.first = 0;
     result = tl;
     result->debug_info = debug_info;
     break;
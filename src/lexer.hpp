@@ -33,6 +33,7 @@ enum TokenType {
   TOK_TAGPOSFROM,
   TOK_TAGPOSEVERY,
   TOK_TAGPOSDELIM,
+  TOK_NUMBER,
   TOK_ERROR
 };
 
@@ -59,6 +60,7 @@ static char *reverse_token_type[TOK_ERROR + 1] = {
     [TOK_TAGPOSFROM] = "TagPosFrom",
     [TOK_TAGPOSEVERY] = "TagPosEvery",
     [TOK_TAGPOSDELIM] = "TagPosDelimiter",
+    [TOK_NUMBER] = "Number",
     [TOK_ERROR] = "Error"};
 
 struct Token {
@@ -31,6 +31,7 @@ public:
   std::optional<StateInfoT> state_info = {};
   struct {
     int total_capturing_groups = -1;
+    bool has_backreferences = false;
   } metadata;
 
   std::string
@@ -72,6 +73,7 @@ public:
   std::set<int> subexpr_end_idxs = {};
   int inside_subexpr = -1;
   std::optional<int> backreference{};
+  std::pair<int, int> backreference_repeat{1, 1}; // min, max (-1 :- unbounded)
   int subexpr_call = -1;
   bool subexpr_recurses = false;
 
@@ -149,6 +151,7 @@ public:
   std::optional<std::string> named_rule = {};
   std::vector<RegexpAssertion> assertions = {};
   std::optional<int> backreference{};
+  std::pair<int, int> backreference_repeat{1, 1}; // min, max (-1 :- unbounded)
   int subexpr_idx = -1;
   int subexpr_end_idx = -1;
   int subexpr_call = -1;
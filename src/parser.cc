@@ -32,6 +32,11 @@
 #include "unicode/emojis.hpp"
 
 std::string output_file_name = "";
+std::string postag_model_file_name = "";
+std::string header_file_name = "";
+std::string symbol_prefix = "";
+bool table_backend = false;
+std::string table_compression = "classes";
 nlvm::TargetTriple targetTriple;
 
 constexpr EpsilonTransitionT EpsilonTransition {};
@@ -210,6 +215,23 @@ void NParser::parse()
             statestack.push(ParserState::OptionName);
             break;
         case ParserState::OptionName:
+            if (token.type == TokenType::TOK_NUMBER) {
+                gen_lexer_option_values[std::get<std::string>(persist)] = std::get<int>(token.value);
+                statestack.pop(); // OptionName
+                statestack.pop(); // Option
+                break;
+            }
+            if (token.type == TokenType::TOK_NAME || token.type == TokenType::TOK_CBRAC) {
+                // `option name [a b c]', one name at a time
+                auto& list = gen_lexer_option_lists[std::get<std::string>(persist)];
+                if (token.type == TokenType::TOK_NAME) {
+                    list.insert(std::get<std::string>(token.value));
+                    break;
+                }
+                statestack.pop(); // OptionName
+                statestack.pop(); // Option
+                break;
+            }
             if (token.type != TokenType::TOK_BOOL) {
                 parser_error(ParserErrors::InvalidToken, token, ErrorPosition::On,
                     "Expected a Boolean");
@@ -280,8 +302,11 @@ void NParser::parse()
                         ErrorPosition::On,
                         "the metastring(s) in '%s' must be any of: RGI",
                         std::get<std::string>(token.value).c_str());
+                auto& tag = std::get<std::string>(persist);
+                if (!gen_lexer_literal_tags.count(tag))
+                    gen_lexer_tag_order.push_back(tag);
                 for (auto t : vec)
-                    gen_lexer_literal_tags[std::get<std::string>(persist)].push_back(t);
+                    gen_lexer_literal_tags[tag].push_back(t);
             }
             break;
         case ParserState::KDefine:
@@ -346,6 +371,7 @@ void NParser::parse()
                 { SymbolType::Define, token.lineno, token.offset, token.length, name,
                     reg.str },
                 new Regexp { reg });
+            gen_lexer_tag_order.push_back(name);
             statestack.pop(); // define
             statestack.pop(); // name
             break;
@@ -1227,6 +1253,7 @@ DFANode<std::set<NFANode<T>*>>* NFANode<T>::to_dfa()
 
     std::set<NFANode<T>*> init = get_epsilon_closure(this, {});
     int max_seen_capture_group = -1;
+    bool has_backreferences = false;
 
     std::queue<std::set<NFANode<T>*>> remaining;
     remaining.push(init);
@@ -1306,6 +1333,8 @@ DFANode<std::set<NFANode<T>*>>* NFANode<T>::to_dfa()
                     abort();
                 }
                 dfanode->backreference = s->backreference;
+                dfanode->backreference_repeat = s->backreference_repeat;
+                has_backreferences = true;
             }
             if (s->final) {
                 slts.show(Display::Type::DEBUG,
@@ -1411,6 +1440,7 @@ DFANode<std::set<NFANode<T>*>>* NFANode<T>::to_dfa()
         }
     }
     dfa_root->metadata.total_capturing_groups = max_seen_capture_group;
+    dfa_root->metadata.has_backreferences = has_backreferences;
     return dfa_root;
 }
 
@@ -1501,8 +1531,26 @@ void DFANLVMCodeGenerator<T>::generate(
 {
     std::map<DFANode<std::set<NFANode<T>*>>*, llvm::BasicBlock*> blk {};
     auto wasub = builder.issubexp;
-    generate(node, visited, blk);
-    {
+    if (builder.do_capture_groups && !wasub)
+        generate_capture_replay(node);
+    if (builder.memoise_subexpressions && !wasub && has_inline_code(node)) {
+        // a replayed call would skip the actions
+        slts.show(Display::Type::WARNING,
+            "memoise_subexpressions is ignored with embedded rule actions\n");
+        builder.memoise_subexpressions = false;
+    }
+    nlvm::DFATable table;
+    if (table_backend && !wasub && build_table(node, table)) {
+        // one loop over the tables instead of a block per state
+        auto entry = builder.emit_table_dfa(table);
+        llvm::IRBuilder<> dbuilder(builder.module.TheContext);
+        dbuilder.SetInsertPoint(builder.module.start);
+        dbuilder.CreateBr(entry);
+        // it never backtracks
+        dbuilder.SetInsertPoint(builder.module.backtrackBB);
+        dbuilder.CreateBr(builder.module.BBfinalise);
+    } else {
+        generate(node, visited, blk);
         auto mroot = blk[node];
 
         llvm::IRBuilder<> dbuilder(builder.module.TheContext);
@@ -1523,10 +1571,23 @@ void DFANLVMCodeGenerator<T>::generate(
             dbuilder.CreateSelect(
                 matched, dbuilder.CreateLoad(builder.module.nlex_errc),
                 llvm::ConstantInt::get(
-                    llvm::Type::getInt8Ty(builder.module.TheContext), 42)),
+                    llvm::Type::getInt8Ty(builder.module.TheContext), NLEX_ERRC_TABLE_DFA)),
             builder.module.nlex_errc);
         dbuilder.CreateCondBr(matched, mroot, builder.module.BBfinalise);
     }
+    if (builder.module.nlex_resync && !wasub) {
+        // bytes that can start a match from the root
+        std::bitset<256> first;
+        if (node->final || node->default_transition)
+            first.set();
+        for (auto tr : node->outgoing_transitions) {
+            if (std::holds_alternative<EpsilonTransitionT>(tr->input))
+                first.set();
+            else
+                first.set((unsigned char)std::get<char>(tr->input));
+        }
+        builder.emit_resync(first);
+    }
     builder.issubexp = true;
     std::set<llvm::Function*> visitedFuncs {};
 
@@ -1546,7 +1607,7 @@ void DFANLVMCodeGenerator<T>::generate(
 
                 builder.module.enter_new_main(scope);
 
-                builder.begin(builder.module.current_main(), true, false);
+                builder.begin(builder.module.current_main(), true);
                 const auto& vref = builder.create_backtrack_block(builder.module.current_main());
                 scope.backtrackBB = vref[0];
                 scope.backtrackExitBB = vref[1];
@@ -1577,10 +1638,12 @@ void DFANLVMCodeGenerator<T>::generate(
                     dbuilder.CreateSelect(
                         matched, dbuilder.CreateLoad(builder.module.nlex_errc),
                         llvm::ConstantInt::get(
-                            llvm::Type::getInt8Ty(builder.module.TheContext), 42)),
+                            llvm::Type::getInt8Ty(builder.module.TheContext), NLEX_ERRC_TABLE_DFA)),
                     builder.module.nlex_errc);
                 dbuilder.CreateCondBr(matched, mroot, builder.module.BBfinalise);
 
+                if (builder.explicit_subexpr_stack)
+                    builder.move_locals_to_frames(builder.module.current_main());
                 builder.module.exit_main();
                 sexpr_being_built = sbb;
             }
@@ -1588,6 +1651,264 @@ void DFANLVMCodeGenerator<T>::generate(
     builder.issubexp = wasub;
 }
 
+/// Lay the DFA at `root' out as tables for the table backend, unless it
+/// needs something only generated states do (assertions, captures,
+/// backreferences, subexpression calls, rule actions)
+template<typename T>
+bool DFANLVMCodeGenerator<T>::build_table(DFANode<std::set<NFANode<T>*>>* root,
+    nlvm::DFATable& table)
+{
+    auto unsupported = [](const char* what) {
+        slts.show(Display::Type::WARNING,
+            "the table backend does not support %s, using the code backend\n", what);
+        return false;
+    };
+    if (builder.do_capture_groups)
+        return unsupported("capturing groups");
+    if (builder.module.debug_mode)
+        return unsupported("debug_mode");
+
+    // number the states breadth first, the root is 0
+    std::vector<DFANode<std::set<NFANode<T>*>>*> nodes { root };
+    std::map<DFANode<std::set<NFANode<T>*>>*, int> index { { root, 0 } };
+    auto number = [&](DFANode<std::set<NFANode<T>*>>* node) {
+        if (index.insert({ node, (int)nodes.size() }).second)
+            nodes.push_back(node);
+        return index[node];
+    };
+    std::vector<std::array<uint32_t, 256>> rows;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        auto* node = nodes[i];
+        if (node->assertions.size() > 0)
+            return unsupported("assertions");
+        if (node->backreference.has_value())
+            return unsupported("backreferences");
+        if (node->subexpr_call > -1)
+            return unsupported("subexpression calls");
+        if (node->inline_code.has_value() && node->inline_code.value() != "")
+            return unsupported("rule actions");
+
+        std::string tag;
+        for (auto state : node->state_info.value())
+            if (state->named_rule.has_value()) {
+                tag = state->named_rule.value();
+                tag = tag.substr(0, tag.find("{::}"));
+                break;
+            }
+        table.tags.push_back(node->final ? tag == "" ? "<Unknown State>" : tag : "");
+
+        // bytes without a transition of their own take the default one (a
+        // whole codepoint) or the jump (a single byte), the zero ends the input
+        std::array<uint32_t, 256> row {};
+        auto* jump = node->default_transition;
+        uint32_t codepoint = jump != nullptr;
+        for (auto tr : node->outgoing_transitions)
+            if (std::holds_alternative<EpsilonTransitionT>(tr->input) && !jump)
+                jump = tr->target;
+        if (jump) {
+            uint32_t cell = (number(jump) + 1) << 1 | codepoint;
+            row.fill(cell);
+        }
+        for (auto tr : node->outgoing_transitions)
+            if (!std::holds_alternative<EpsilonTransitionT>(tr->input))
+                row[(unsigned char)std::get<char>(tr->input)] = (number(tr->target) + 1) << 1;
+        row[0] = 0;
+        rows.push_back(row);
+    }
+
+    // bytes that every state treats alike share a class
+    std::map<std::vector<uint32_t>, int> classes;
+    std::vector<int> representative;
+    for (int c = 0; c < 256; ++c) {
+        std::vector<uint32_t> column;
+        for (auto& row : rows)
+            column.push_back(row[c]);
+        auto [it, inserted] = classes.insert({ column, (int)classes.size() });
+        if (inserted)
+            representative.push_back(c);
+        table.byte_class[c] = it->second;
+    }
+    table.classes = classes.size();
+    for (auto& row : rows)
+        for (auto c : representative)
+            table.next.push_back(row[c]);
+    table.start = 0;
+    return true;
+}
+
+/// Whether any node reachable from `root' runs an embedded rule action
+template<typename T>
+bool DFANLVMCodeGenerator<T>::has_inline_code(
+    DFANode<std::set<NFANode<T>*>>* root)
+{
+    std::set<DFANode<std::set<NFANode<T>*>>*> seen { root };
+    std::queue<DFANode<std::set<NFANode<T>*>>*> queue;
+    queue.push(root);
+    while (!queue.empty()) {
+        auto* node = queue.front();
+        queue.pop();
+        if (node->inline_code.has_value() && node->inline_code.value() != "")
+            return true;
+        if (node->default_transition && !seen.count(node->default_transition)) {
+            seen.insert(node->default_transition);
+            queue.push(node->default_transition);
+        }
+        for (auto tr : node->outgoing_transitions)
+            if (!seen.count(tr->target)) {
+                seen.insert(tr->target);
+                queue.push(tr->target);
+            }
+    }
+    return false;
+}
+
+/// Build __nlex_capture_resolve. Unless the DFA contains subexpression calls
+/// or backreferences (which need the captures while scanning), captures are
+/// not stored during the scan at all; instead, the first query after a match
+/// replays the DFA over the matched span and records only the capture
+/// positions, following the path the match took.
+template<typename T>
+void DFANLVMCodeGenerator<T>::generate_capture_replay(
+    DFANode<std::set<NFANode<T>*>>* root)
+{
+    auto& ctx = builder.module.TheContext;
+    auto* resolve = builder.module.nlex_capture_resolve;
+    auto* i8 = llvm::Type::getInt8Ty(ctx);
+    auto* i8p = llvm::Type::getInt8PtrTy(ctx);
+    auto* i32 = llvm::Type::getInt32Ty(ctx);
+
+    std::vector<DFANode<std::set<NFANode<T>*>>*> nodes;
+    std::set<DFANode<std::set<NFANode<T>*>>*> seen { root };
+    std::queue<DFANode<std::set<NFANode<T>*>>*> queue;
+    queue.push(root);
+    bool lazy = true;
+    while (!queue.empty()) {
+        auto* node = queue.front();
+        queue.pop();
+        nodes.push_back(node);
+        if (node->subexpr_call > -1 || node->backreference.has_value())
+            lazy = false;
+        if (node->default_transition && !seen.count(node->default_transition)) {
+            seen.insert(node->default_transition);
+            queue.push(node->default_transition);
+        }
+        for (auto tr : node->outgoing_transitions)
+            if (!seen.count(tr->target)) {
+                seen.insert(tr->target);
+                queue.push(tr->target);
+            }
+    }
+
+    llvm::IRBuilder<> rbuilder { ctx };
+    auto* entry = llvm::BasicBlock::Create(ctx, "", resolve);
+    rbuilder.SetInsertPoint(entry);
+    builder.lazy_capture_groups = lazy;
+    if (!lazy) {
+        // stored while scanning
+        rbuilder.CreateRetVoid();
+        return;
+    }
+
+    auto* replayBB = llvm::BasicBlock::Create(ctx, "replay", resolve);
+    auto* doneBB = llvm::BasicBlock::Create(ctx, "done", resolve);
+    auto* exitBB = llvm::BasicBlock::Create(ctx, "exit", resolve);
+    // already resolved for this match?
+    auto* end = rbuilder.CreateCall(builder.module.nlex_current_p);
+    rbuilder.CreateCondBr(
+        rbuilder.CreateICmpEQ(end, rbuilder.CreateLoad(builder.module.nlex_capture_resolved_end)),
+        exitBB, replayBB);
+
+    rbuilder.SetInsertPoint(replayBB);
+    auto* endi = rbuilder.CreatePtrToInt(end, llvm::Type::getInt64Ty(ctx));
+    // the replay reads the match again through nlex_next, which can start
+    // expansions of its own; the one pending at the end of the match (and
+    // so the tokens after it) must not depend on whether a group was asked for
+    std::vector<std::pair<llvm::GlobalVariable*, llvm::Value*>> saved;
+    for (auto* state : { builder.module.nlex_fed_string, builder.module.nlex_injected,
+             builder.module.nlex_injected_length, builder.module.nlex_injected_length_diff,
+             builder.module.nlex_tmp_char })
+        saved.emplace_back(state, rbuilder.CreateLoad(state));
+    rbuilder.CreateStore(
+        llvm::Constant::getNullValue(
+            builder.module.nlex_capture_indices->getType()->getPointerElementType()),
+        builder.module.nlex_capture_indices);
+    rbuilder.CreateCall(builder.module.nlex_restore,
+        { rbuilder.CreateLoad(builder.module.nlex_match_start) });
+
+    std::map<DFANode<std::set<NFANode<T>*>>*, llvm::BasicBlock*> blocks;
+    for (auto* node : nodes)
+        blocks[node] = llvm::BasicBlock::Create(ctx, "", resolve);
+    rbuilder.CreateBr(blocks[root]);
+
+    auto store_capture = [&](llvm::Value* p, int idx) {
+        rbuilder.CreateStore(p,
+            rbuilder.CreateInBoundsGEP(builder.module.nlex_capture_indices,
+                { llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i32, idx) }));
+    };
+    for (auto* node : nodes) {
+        rbuilder.SetInsertPoint(blocks[node]);
+        auto* p = rbuilder.CreateCall(builder.module.nlex_current_p);
+        // same order as the eager stores
+        for (auto i : node->subexpr_end_idxs)
+            store_capture(p, i * 2 + 1);
+        for (auto i : node->subexpr_idxs)
+            store_capture(p, i * 2);
+
+        auto* readBB = llvm::BasicBlock::Create(ctx, "", resolve);
+        rbuilder.CreateCondBr(
+            rbuilder.CreateICmpUGE(rbuilder.CreatePtrToInt(p, endi->getType()), endi),
+            doneBB, readBB);
+        rbuilder.SetInsertPoint(readBB);
+        rbuilder.CreateCall(builder.module.nlex_next);
+        auto* readv = rbuilder.CreateCall(builder.module.nlex_current_f);
+
+        llvm::BasicBlock* deflBB = doneBB;
+        DFANode<std::set<NFANode<T>*>>* jdst = nullptr;
+        for (auto tr : node->outgoing_transitions)
+            if (std::holds_alternative<EpsilonTransitionT>(tr->input))
+                jdst = tr->target;
+        if (jdst)
+            deflBB = blocks[jdst];
+        else if (node->default_transition) {
+            // consume the rest of the codepoint
+            deflBB = llvm::BasicBlock::Create(ctx, "", resolve);
+            auto* loopBB = llvm::BasicBlock::Create(ctx, "", resolve);
+            auto* stepBB = llvm::BasicBlock::Create(ctx, "", resolve);
+            llvm::IRBuilder<> dbuilder { deflBB };
+            auto* extra = dbuilder.CreateCall(builder.module.nlex_get_utf8_length, { readv });
+            dbuilder.CreateBr(loopBB);
+            dbuilder.SetInsertPoint(loopBB);
+            auto* left = dbuilder.CreatePHI(i32, 2);
+            left->addIncoming(extra, deflBB);
+            dbuilder.CreateCondBr(dbuilder.CreateICmpSGT(left, llvm::ConstantInt::get(i32, 0)),
+                stepBB, blocks[node->default_transition]);
+            dbuilder.SetInsertPoint(stepBB);
+            dbuilder.CreateCall(builder.module.nlex_next);
+            left->addIncoming(dbuilder.CreateNSWSub(left, llvm::ConstantInt::get(i32, 1)), stepBB);
+            dbuilder.CreateBr(loopBB);
+        }
+        auto* sw = rbuilder.CreateSwitch(readv, deflBB);
+        sw->addCase(llvm::ConstantInt::get(llvm::cast<llvm::IntegerType>(i8), 0), doneBB);
+        for (auto tr : node->outgoing_transitions) {
+            if (!std::holds_alternative<char>(tr->input) || std::get<char>(tr->input) == 0)
+                continue;
+            sw->addCase(llvm::ConstantInt::get(llvm::cast<llvm::IntegerType>(i8),
+                            std::get<char>(tr->input)),
+                blocks[tr->target]);
+        }
+    }
+
+    // put the position back where the match left it
+    rbuilder.SetInsertPoint(doneBB);
+    for (auto [state, value] : saved)
+        rbuilder.CreateStore(value, state);
+    rbuilder.CreateStore(end, builder.module.nlex_capture_resolved_end);
+    rbuilder.CreateBr(exitBB);
+
+    rbuilder.SetInsertPoint(exitBB);
+    rbuilder.CreateRetVoid();
+}
+
 static const inline void increment_(llvm::Value* v,
     llvm::IRBuilder<>& builder)
 {
@@ -1780,7 +2101,7 @@ void DFANLVMCodeGenerator<T>::generate(
         }
     }
     // store the ending captures if any exist
-    if (builder.do_capture_groups)
+    if (builder.do_capture_groups && !builder.lazy_capture_groups)
         if (node->subexpr_end_idxs.size()) {
             for (auto i : node->subexpr_end_idxs) {
                 int idx = i * 2 + 1;
@@ -1798,7 +2119,7 @@ void DFANLVMCodeGenerator<T>::generate(
                         })));
             }
         }
-    if (builder.do_capture_groups)
+    if (builder.do_capture_groups && !builder.lazy_capture_groups)
         if (node->subexpr_idxs.size()) {
             for (auto i : node->subexpr_idxs) {
                 int idx = i * 2;
@@ -1816,38 +2137,11 @@ void DFANLVMCodeGenerator<T>::generate(
                         })));
             }
         }
-    // if this node has a backreference, generate the code here
-    // how do we want to actually do backreferences?
-    // @TODO: Figure out a way to apply backreferences
-    if (node->backreference.has_value()) {
-        auto backref_index = node->backreference.value();
-        // get the matched indices
-        // auto idx_end = builder.module.Builder.CreateLoad(
-        //     llvm::ConstantExpr::getInBoundsGetElementPtr(
-        //         builder.module.nlex_capture_indices->getType()
-        //             ->getPointerElementType(),
-        //         builder.module.nlex_capture_indices,
-        //         llvm::ArrayRef<llvm::Constant *>({
-        //             llvm::ConstantInt::get(
-        //                 llvm::Type::getInt32Ty(builder.module.TheContext), 0),
-        //             llvm::ConstantInt::get(
-        //                 llvm::Type::getInt32Ty(builder.module.TheContext),
-        //                 backref_index * 2 + 1),
-        //         })));
-        // auto idx_start = builder.module.Builder.CreateLoad(
-        //     llvm::ConstantExpr::getInBoundsGetElementPtr(
-        //         builder.module.nlex_capture_indices->getType()
-        //             ->getPointerElementType(),
-        //         builder.module.nlex_capture_indices,
-        //         llvm::ArrayRef<llvm::Constant *>({
-        //             llvm::ConstantInt::get(
-        //                 llvm::Type::getInt32Ty(builder.module.TheContext), 0),
-        //             llvm::ConstantInt::get(
-        //                 llvm::Type::getInt32Ty(builder.module.TheContext),
-        //                 backref_index * 2),
-        //         })));
-        assert(false && "Backreferences not allowed");
-    }
+    // match the backreference against the input here, the group's capture
+    // indices are always stored while scanning if there are any
+    if (node->backreference.has_value())
+        builder.emit_backreference(node->backreference.value(),
+            node->backreference_repeat.first, node->backreference_repeat.second, BBend);
     if (finalm) {
         // store the tag and string position upon getting here
         auto em = false;
@@ -1934,7 +2228,7 @@ void DFANLVMCodeGenerator<T>::generate(
                         "debug_ex"),
                 });
         }
-        builder.module.Builder.CreateCall(fn, { val });
+        builder.emit_subexpr_call(fn, val, node->subexpr_call);
         if (builder.module.debug_mode) {
             builder.module.Builder.CreateCall(
                 builder.module.nlex_debug,
@@ -1996,11 +2290,11 @@ void DFANLVMCodeGenerator<T>::generate(
         //   );
         // }
     }
-    // if there's an inline code piece, insert it here
+    // if there's an inline code piece, call it here
     if (node->inline_code.has_value()) {
         std::string code = node->inline_code.value();
         if (code != "") {
-            KaleidCompile(code, builder.module.Builder, true);
+            builder.module.Builder.CreateCall(builder.get_or_create_action(code), {});
         }
     }
     if (builder.module.debug_mode) {
@@ -2268,6 +2562,30 @@ ARGS:
 
     --library
         generate a pure library with no dependency
+    --postag-model [file]
+        also write the compiled POS tagger model to this file, it can be
+        given to `tag pos ... from' or loaded at runtime with
+        nlex_postag_load_model()
+    --header [file]
+        also write a C header with the tag ids (enum nlex_tag), struct
+        sresult and the functions the lexer exports
+    --backend [code|table]
+        how the DFA is compiled: 'code' (the default) generates code for
+        every state, 'table' a loop over (byte class compressed) transition
+        tables, which is much smaller for large grammars; lexers using
+        assertions, captures, backreferences, subexpression calls or rule
+        actions always use 'code'
+    --table-compression [full|classes|comb|sparse]
+        how the table backend stores transitions, from the largest and
+        fastest to the smallest: 'full' rows of 256 bytes, 'classes' (the
+        default) rows of byte classes, 'comb' rows packed into each other
+        (row displacement), 'sparse' lists of the transitions of each state;
+        the size and reads per byte of each are shown when compiling
+    --symbol-prefix [name]
+        export the lexer's symbols under this name (a C identifier)
+        instead of nlex (__nlex_root becomes __name_root,
+        nlex_tag_document becomes name_tag_document), so several lexers
+        can be linked together; overrides `option name [name]'
 
   The following arguments modify the output format
 
@@ -2339,6 +2657,7 @@ void parse_commandline(int argc, char* argv[], /* out */ char** filename,
     int i = 0;
     int split = 0;
     int file = 0;
+    bool compression_given = false;
     *compile = true;
     *outname = "";
     for (char* arg = argv[i]; i < argc; i++, arg = argv[i]) {
@@ -2489,6 +2808,71 @@ void parse_commandline(int argc, char* argv[], /* out */ char** filename,
             })(argv[++i]);
             continue;
         }
+        if (strcmp(arg, "--postag-model") == 0) {
+            if (i == argc - 1) {
+                slts.show(Display::Type::ERROR,
+                    "argument {<magenta>}--postag-model{<clean>} expects a parameter");
+                continue;
+            }
+            postag_model_file_name = argv[++i];
+            continue;
+        }
+        if (strcmp(arg, "--header") == 0) {
+            if (i == argc - 1) {
+                slts.show(Display::Type::ERROR,
+                    "argument {<magenta>}--header{<clean>} expects a parameter");
+                continue;
+            }
+            header_file_name = argv[++i];
+            continue;
+        }
+        if (strcmp(arg, "--backend") == 0 || strncmp(arg, "--backend=", 10) == 0) {
+            if (arg[9] != '=' && i == argc - 1) {
+                slts.show(Display::Type::ERROR,
+                    "argument {<magenta>}--backend{<clean>} expects a parameter");
+                continue;
+            }
+            std::string backend = arg[9] == '=' ? arg + 10 : argv[++i];
+            if (backend == "table" || backend == "code")
+                table_backend = backend == "table";
+            else
+                slts.show(Display::Type::ERROR,
+                    "Unknown backend '{<red>}%s{<clean>}', expected 'code' or 'table'",
+                    backend.c_str());
+            continue;
+        }
+        if (strcmp(arg, "--table-compression") == 0 || strncmp(arg, "--table-compression=", 20) == 0) {
+            if (arg[19] != '=' && i == argc - 1) {
+                slts.show(Display::Type::ERROR,
+                    "argument {<magenta>}--table-compression{<clean>} expects a parameter");
+                continue;
+            }
+            std::string scheme = arg[19] == '=' ? arg + 20 : argv[++i];
+            compression_given = true;
+            if (scheme == "full" || scheme == "classes" || scheme == "comb" || scheme == "sparse")
+                table_compression = scheme;
+            else
+                slts.show(Display::Type::ERROR,
+                    "Unknown table compression '{<red>}%s{<clean>}', expected 'full', "
+                    "'classes', 'comb' or 'sparse'",
+                    scheme.c_str());
+            continue;
+        }
+        if (strcmp(arg, "--symbol-prefix") == 0) {
+            if (i == argc - 1) {
+                slts.show(Display::Type::ERROR,
+                    "argument {<magenta>}--symbol-prefix{<clean>} expects a parameter");
+                continue;
+            }
+            if (valid_symbol_prefix(argv[++i]))
+                symbol_prefix = argv[i];
+            else
+                slts.show(Display::Type::ERROR,
+                    "Invalid symbol prefix '{<red>}%s{<clean>}', expected a C identifier "
+                    "([A-Za-z_][A-Za-z0-9_]*)",
+                    argv[i]);
+            continue;
+        }
         if (strcmp(arg, "--library") == 0) {
             targetTriple.library = true;
             continue;
@@ -2505,6 +2889,11 @@ void parse_commandline(int argc, char* argv[], /* out */ char** filename,
             *filename = arg;
         }
     }
+    // only the table backend has tables to compress
+    if (compression_given && !table_backend)
+        slts.show(Display::Type::WARNING,
+            "{<magenta>}--table-compression{<clean>} has no effect without "
+            "{<magenta>}--backend table{<clean>}");
 }
 
 char* read_file(const char* path)
@@ -2553,8 +2942,7 @@ int main(int argc, char* argv[])
     NFANode<std::string>* root;
     DFACCodeGenerator<std::string> cg;
     DFANLVMCodeGenerator<std::string> nlvmg(filename, &llvm::errs());
-    nlvmg.builder.begin(nlvmg.builder.module.main(), false,
-        parser.gen_lexer_options["skip_on_error"]);
+    nlvmg.builder.begin(nlvmg.builder.module.main(), false);
     nlvmg.builder.module._cmain = nlvmg.builder.module._main;
     // auto &&file = fromstdin ? std::move(std::cin) : std::ifstream{filename};
     std::ifstream file { filename };
@@ -2615,45 +3003,19 @@ int main(int argc, char* argv[])
                     bool run = true;
 
                     std::thread render { [&]() {
-                        nlvmg.builder.prepare(
-                            { parser.gen_lexer_options, parser.gen_lexer_stopwords,
-                                parser.gen_lexer_ignores, parser.gen_lexer_normalisations,
-                                parser.gen_lexer_literal_tags, parser.gen_lexer_kdefines,
-                                parser.hastagpos
-                                    ? std::optional<TagPosSpecifier>(parser.tagpos)
-                                    : std::optional<TagPosSpecifier> {},
-                                rootdfa->metadata.total_capturing_groups });
+                        nlvmg.builder.prepare(parser.gen_lexer(rootdfa->metadata.total_capturing_groups, rootdfa->metadata.has_backreferences));
 
                         nlvmg.generate(rootdfa);
-                        nlvmg.output(
-                            { parser.gen_lexer_options, parser.gen_lexer_stopwords,
-                                parser.gen_lexer_ignores, parser.gen_lexer_normalisations,
-                                parser.gen_lexer_literal_tags, parser.gen_lexer_kdefines,
-                                parser.hastagpos
-                                    ? std::optional<TagPosSpecifier>(parser.tagpos)
-                                    : std::optional<TagPosSpecifier> {},
-                                rootdfa->metadata.total_capturing_groups });
+                        nlvmg.output(parser.gen_lexer(rootdfa->metadata.total_capturing_groups, rootdfa->metadata.has_backreferences));
                         run = false;
                     } };
                     exec(("../tools/wm '" + name + "'").c_str(), run);
                     render.join();
                 } else {
-                    nlvmg.builder.prepare(
-                        { parser.gen_lexer_options, parser.gen_lexer_stopwords,
-                            parser.gen_lexer_ignores, parser.gen_lexer_normalisations,
-                            parser.gen_lexer_literal_tags, parser.gen_lexer_kdefines,
-                            parser.hastagpos ? std::optional<TagPosSpecifier> { parser.tagpos }
-                                             : std::optional<TagPosSpecifier> {},
-                            rootdfa->metadata.total_capturing_groups });
+                    nlvmg.builder.prepare(parser.gen_lexer(rootdfa->metadata.total_capturing_groups, rootdfa->metadata.has_backreferences));
 
                     nlvmg.generate(rootdfa);
-                    nlvmg.output(
-                        { parser.gen_lexer_options, parser.gen_lexer_stopwords,
-                            parser.gen_lexer_ignores, parser.gen_lexer_normalisations,
-                            parser.gen_lexer_literal_tags, parser.gen_lexer_kdefines,
-                            parser.hastagpos ? std::optional<TagPosSpecifier>(parser.tagpos)
-                                             : std::optional<TagPosSpecifier> {},
-                            rootdfa->metadata.total_capturing_groups });
+                    nlvmg.output(parser.gen_lexer(rootdfa->metadata.total_capturing_groups, rootdfa->metadata.has_backreferences));
                 }
                 continue;
             } else if (line == "")
@@ -2730,22 +3092,10 @@ int main(int argc, char* argv[])
                 exec(("../tools/wm '" + name + "'").c_str(), true);
         }
         if (compile) {
-            nlvmg.builder.prepare(
-                { parser.gen_lexer_options, parser.gen_lexer_stopwords,
-                    parser.gen_lexer_ignores, parser.gen_lexer_normalisations,
-                    parser.gen_lexer_literal_tags, parser.gen_lexer_kdefines,
-                    parser.hastagpos ? std::optional<TagPosSpecifier> { parser.tagpos }
-                                     : std::optional<TagPosSpecifier> {},
-                    rootdfa->metadata.total_capturing_groups });
+            nlvmg.builder.prepare(parser.gen_lexer(rootdfa->metadata.total_capturing_groups, rootdfa->metadata.has_backreferences));
 
             nlvmg.generate(rootdfa);
-            nlvmg.output({ parser.gen_lexer_options, parser.gen_lexer_stopwords,
-                parser.gen_lexer_ignores, parser.gen_lexer_normalisations,
-                parser.gen_lexer_literal_tags, parser.gen_lexer_kdefines,
-                parser.hastagpos
-                    ? std::optional<TagPosSpecifier>(parser.tagpos)
-                    : std::optional<TagPosSpecifier> {},
-                rootdfa->metadata.total_capturing_groups });
+            nlvmg.output(parser.gen_lexer(rootdfa->metadata.total_capturing_groups, rootdfa->metadata.has_backreferences));
         }
         free(data);
     }
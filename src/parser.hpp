@@ -85,11 +85,14 @@ class NParser {
 public:
   std::stack<ParserState> statestack;
   std::map<std::string, bool> gen_lexer_options;
+  std::map<std::string, int> gen_lexer_option_values;
+  std::map<std::string, std::set<std::string>> gen_lexer_option_lists;
   std::set<std::pair<std::string, debug_offset_info>> gen_lexer_stopwords;
   std::set<std::pair<std::string, debug_offset_info>> gen_lexer_ignores;
   std::map<std::string, std::string> gen_lexer_normalisations;
   std::map<std::string, std::vector<std::string>> gen_lexer_literal_tags;
   std::vector<std::string> gen_lexer_kdefines;
+  std::vector<std::string> gen_lexer_tag_order; // rules and literals
 
   TagPosSpecifier tagpos;
   bool hastagpos = false;
@@ -102,6 +105,24 @@ public:
   NFANode<std::string> *compile();
   void repl_feed(std::string code);
   void parse();
+
+  /// Everything the code generator needs to know about the lexer
+  GenLexer gen_lexer(int total_capturing_groups,
+                     bool has_backreferences) const {
+    return {gen_lexer_options,
+            gen_lexer_stopwords,
+            gen_lexer_ignores,
+            gen_lexer_normalisations,
+            gen_lexer_literal_tags,
+            gen_lexer_kdefines,
+            hastagpos ? std::optional<TagPosSpecifier>{tagpos}
+                      : std::optional<TagPosSpecifier>{},
+            total_capturing_groups,
+            gen_lexer_option_values,
+            has_backreferences,
+            gen_lexer_tag_order,
+            gen_lexer_option_lists};
+  }
 };
 
 static void unreachable [[noreturn]] () { return; /* intentional */ }
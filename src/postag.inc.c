@@ -0,0 +1,128 @@
+/* The POS tagger of lexers whose model is compiled into code (`option
+ * postag_specialise on'): the bigram streaming tagger of deser.inc.cc,
+ * without the C++ runtime, over the same ring (postag_ring.h). The parts that
+ * depend on the model are generated by nlex (see
+ * Builder::emit_postag_specialised) */
+#include "postag_ring.h"
+
+extern int const __nlex_postag_tag_count;
+extern int const __nlex_postag_stride; /* the tag count, rounded up to 8 */
+extern char const *const __nlex_postag_tag_names[];
+/* log P(word | tag), `stride' per word, the last row is for unknown words */
+extern float const __nlex_postag_emissions[];
+/* the id of a word, or of the unknown word */
+extern int __nlex_postag_word_id(char const *word, int length);
+/* one Viterbi column: next[c] = max_p prev[p] + log P(c | p) and back[c] is
+ * the first p that reaches it, plus log P(word | c) */
+extern void __nlex_postag_step(float const *prev, float *next, int *back,
+                               int word);
+
+#define MAX_STRIDE 256
+
+/* StreamingViterbi (hmm.hpp), over the generated step */
+static float m_scores[2][MAX_STRIDE] __attribute__((aligned(32)));
+static int m_current = 0;
+static int *m_back = NULL; /* `m_window' columns of `stride' */
+static int m_window = 0, m_first = 0, m_count = 0;
+static int m_trace[MAX_STRIDE];
+
+static int *back_column(int column) {
+  return m_back + (column % m_window) * __nlex_postag_stride;
+}
+
+static void viterbi_reset(void) {
+  m_window = lattice_window();
+  m_back = malloc(sizeof(int) * m_window * __nlex_postag_stride);
+  if (!m_back)
+    out_of_memory("nlex: out of memory for the POS tagger's lattice\n");
+}
+
+static int best_tag(void) {
+  float const *scores = m_scores[m_current];
+  int best_tag = 0;
+  /* ties go to the last tag */
+  for (int s = 1; s < __nlex_postag_tag_count; ++s)
+    if (!(scores[best_tag] > scores[s]))
+      best_tag = s;
+  return best_tag;
+}
+
+/* Writes the tags of words first..last on the path through `tag' at `last' */
+static int decide(int last, int tag) {
+  int n = last - m_first + 1;
+  m_tags[n - 1] = tag;
+  for (int column = last; column > m_first; --column)
+    m_tags[column - m_first - 1] = tag = back_column(column)[tag];
+  m_first = last + 1;
+  return n;
+}
+
+/* Takes the best score off the column, as in hmm.cc: scores only fall, and
+ * under NO_SCORE every back-pointer is 0 */
+static void renormalise(float *scores) {
+  float best = scores[0];
+  for (int s = 1; s < __nlex_postag_tag_count; ++s)
+    if (best < scores[s])
+      best = scores[s];
+  for (int s = 0; s < __nlex_postag_tag_count; ++s)
+    scores[s] -= best;
+}
+
+static int viterbi_push(int word) {
+  int N = __nlex_postag_tag_count;
+  if (!m_back)
+    viterbi_reset();
+  if (m_count == 0) {
+    memcpy(m_scores[m_current],
+           __nlex_postag_emissions + word * __nlex_postag_stride,
+           sizeof(float) * __nlex_postag_stride);
+  } else {
+    __nlex_postag_step(m_scores[m_current], m_scores[!m_current],
+                       back_column(m_count), word);
+    m_current = !m_current;
+  }
+  renormalise(m_scores[m_current]);
+  ++m_count;
+
+  /* follow the best paths to every current tag back, until they meet */
+  for (int s = 0; s < N; ++s)
+    m_trace[s] = s;
+  for (int column = m_count - 1; column > m_first; --column) {
+    int const *column_back = back_column(column);
+    int same = 1;
+    for (int s = 0; s < N; ++s) {
+      m_trace[s] = column_back[m_trace[s]];
+      same &= m_trace[s] == m_trace[0];
+    }
+    if (same)
+      return decide(column - 1, m_trace[0]);
+  }
+
+  /* out of room for the next column, settle for the current best path */
+  if (m_count - m_first == m_window) {
+    int tag = best_tag();
+    for (int column = m_count - 1; column > m_first; --column)
+      tag = back_column(column)[tag];
+    return decide(m_first, tag);
+  }
+  return 0;
+}
+
+static int viterbi_finish(void) {
+  int n = m_first == m_count ? 0 : decide(m_count - 1, best_tag());
+  m_first = m_count = 0;
+  return n;
+}
+
+/* The hooks of postag_ring.h */
+static int tag_word(char const *word, int length) {
+  return viterbi_push(__nlex_postag_word_id(word, length));
+}
+
+static int finish_sentence(void) { return viterbi_finish(); }
+
+static int sentence_length(void) { return m_count; }
+
+static char const *tag_name(int tag) { return __nlex_postag_tag_names[tag]; }
+
+void __nlex_apply_postag(struct sresult *val) { apply_postag(val); }
@@ -0,0 +1,169 @@
+/* The tokens a POS tagger holds back until their tags are decided, and the
+ * streaming driver around them. Shared by deser.inc.cc and postag.inc.c, so
+ * this is C that is also C++; each includes it once, and defines the parts
+ * that depend on how it decodes:
+ *   tag_word(word, length): adds a word to the lattice, and puts the tags it
+ *     decides (of the oldest words not tagged yet) in m_tags, returns how many
+ *   finish_sentence(): the same for the rest of the sentence
+ *   sentence_length(): the words in the lattice
+ *   tag_name(tag): what sresult.pos points to for `tag' */
+#pragma once
+
+#include "errc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct sresult {
+  char const *start;
+  int length;
+  char const *tag;
+  char errc;
+  unsigned char metadata;
+  char const *pos; /* points into the model's tag names */
+  int tag_id;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern void __nlex_root(struct sresult *);
+extern char const __nlex_ptag;
+extern int const __nlex_postag_lookahead;
+extern int const __nlex_postag_max_sentence;
+#ifdef __cplusplus
+}
+#endif
+
+static int tag_word(char const *word, int length);
+static int finish_sentence(void);
+static int sentence_length(void);
+static char const *tag_name(int tag);
+
+/* Tokens waiting to be handed out, in fixed rings: [tail, tagged) are tagged
+ * and being handed out, and the tags of [tagged, head) are not decided yet
+ * (there are at most `__nlex_postag_lookahead' of them). Indices only ever
+ * grow, and are taken modulo the ring sizes */
+#define RING_TOKENS 4096 /* a power of 2 */
+#define RING_BYTES (1 << 20)
+
+static struct sresult m_tokens[RING_TOKENS];
+static size_t m_token_bytes[RING_TOKENS]; /* where each token's bytes start */
+static char m_token_spilled[RING_TOKENS];
+static char m_bytes[RING_BYTES];
+static unsigned m_head = 0, m_tagged = 0, m_tail = 0;
+static size_t m_byte_head = 0;
+/* the last token handed out, if it was too big for the ring */
+static char *m_spilled = NULL;
+static int m_toplevel = 1;
+/* tags decided by the last word */
+static int m_tags[RING_TOKENS];
+
+/* like __nlex_feed under normalise_ahead, rather than tag with less */
+static void out_of_memory(char const *message) {
+  write(2, message, strlen(message));
+  abort();
+}
+
+/* The lattice keeps `__nlex_postag_lookahead' words, within half the ring */
+static int lattice_window(void) {
+  int window = __nlex_postag_lookahead;
+  if (window <= 0 || window > RING_TOKENS / 2)
+    window = RING_TOKENS / 2;
+  return window;
+}
+
+static size_t ring_bytes_free(void) {
+  size_t tail = m_tail == m_head ? m_byte_head
+                                 : m_token_bytes[m_tail % RING_TOKENS];
+  return RING_BYTES - (m_byte_head - tail);
+}
+
+static void ring_push(struct sresult const *val) {
+  unsigned slot = m_head % RING_TOKENS;
+  size_t length = val->length;
+  size_t pos = m_byte_head % RING_BYTES;
+  /* a token's bytes never wrap around */
+  size_t skip = pos + length > RING_BYTES ? RING_BYTES - pos : 0;
+  char *dst;
+  if (skip + length <= ring_bytes_free()) {
+    m_byte_head += skip;
+    dst = m_bytes + m_byte_head % RING_BYTES;
+    m_token_bytes[slot] = m_byte_head;
+    m_byte_head += length;
+    m_token_spilled[slot] = 0;
+  } else {
+    /* only when the ring is (nearly) full of one huge sentence */
+    dst = (char *)malloc(length);
+    if (!dst)
+      out_of_memory("nlex: out of memory buffering a token for the POS tagger\n");
+    m_token_bytes[slot] = m_byte_head;
+    m_token_spilled[slot] = 1;
+  }
+  memcpy(dst, val->start, length);
+  m_tokens[slot] = *val;
+  m_tokens[slot].start = dst;
+  m_tokens[slot].pos = NULL;
+  ++m_head;
+}
+
+static void set_tags(int n) {
+  for (int i = 0; i < n; ++i)
+    m_tokens[m_tagged++ % RING_TOKENS].pos = tag_name(m_tags[i]);
+}
+
+static void end_sentence(void) { set_tags(finish_sentence()); }
+
+/* Adds a token to the ring and its word to the lattice */
+static void stream_token(struct sresult const *val) {
+  ring_push(val);
+  set_tags(tag_word(m_tokens[(m_head - 1) % RING_TOKENS].start, val->length));
+  if (strcmp(val->tag, &__nlex_ptag) == 0 ||
+      (__nlex_postag_max_sentence > 0 &&
+       sentence_length() >= __nlex_postag_max_sentence))
+    end_sentence();
+}
+
+/* A skipped run ends the sentence, and is handed out untagged after the
+ * tokens before it */
+static void queue_skipped(struct sresult const *val) {
+  if (m_tagged != m_head)
+    end_sentence();
+  ring_push(val);
+  ++m_tagged;
+}
+
+/* The body of __nlex_apply_postag: takes the token `val' the lexer matched,
+ * and gives back in it the next one whose tag is decided, reading ahead if
+ * there is none yet */
+static void apply_postag(struct sresult *val) {
+  int valid = val->errc == NLEX_ERRC_NONE && val->length > 0;
+  if (valid)
+    stream_token(val);
+  else if (val->errc == NLEX_ERRC_SKIPPED && val->length > 0)
+    queue_skipped(val);
+  if (!m_toplevel)
+    return;
+  free(m_spilled);
+  m_spilled = NULL;
+
+  if (m_tail == m_tagged && m_tagged != m_head) {
+    /* read ahead until a tag is decided, or the input ends */
+    m_toplevel = 0;
+    while (valid && m_tail == m_tagged) {
+      unsigned head = m_head;
+      __nlex_root(val);
+      valid = m_head != head; /* not an error, or the end of the input */
+    }
+    m_toplevel = 1;
+    if (m_tail == m_tagged)
+      end_sentence();
+  }
+
+  if (m_tail == m_tagged)
+    return;
+  unsigned slot = m_tail++ % RING_TOKENS;
+  *val = m_tokens[slot];
+  if (m_token_spilled[slot])
+    m_spilled = (char *)val->start;
+}
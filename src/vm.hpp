@@ -1,8 +1,10 @@
 #pragma once
 
 #include "basevm.hpp"
+#include "errc.h"
 #include "genlexer.hpp"
 #include "hmm.hpp"
+#include "kaleid.hpp"
 #include "target_triple.hpp"
 #include "termdisplay.hpp"
 #include "wordtree.hpp"
@@ -35,12 +37,15 @@
 #include "llvm/Transforms/Scalar/GVN.h"
 
 #include <algorithm>
+#include <bitset>
 #include <cctype>
 #include <cstdio>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <map>
 #include <memory>
+#include <numeric>
 #include <queue>
 #include <set>
 #include <string>
@@ -58,9 +63,39 @@ typename T::mapped_type get(T value, typename T::key_type key)
 
 extern Display::SingleLineTermStatus slts;
 extern std::string output_file_name;
+extern std::string postag_model_file_name;
+extern std::string header_file_name;
+extern std::string symbol_prefix;
+extern std::string table_compression;
+
+/// The name `name' is exported as under the symbol prefix `prefix': __nlex_x
+/// becomes __<prefix>_x and nlex_x <prefix>_x, anything else is just prefixed
+static std::string prefixed_symbol(const std::string& prefix, const std::string& name)
+{
+    if (prefix == "")
+        return name;
+    if (name.rfind("__nlex_", 0) == 0)
+        return "__" + prefix + "_" + name.substr(7);
+    if (name.rfind("nlex_", 0) == 0)
+        return prefix + "_" + name.substr(5);
+    return prefix + "_" + name;
+}
+
+/// Whether `prefix' makes C identifiers of the names it prefixes
+/// ([A-Za-z_][A-Za-z0-9_]*), so that the header can declare them
+static bool valid_symbol_prefix(const std::string& prefix)
+{
+    if (prefix == "" || isdigit((unsigned char)prefix[0]))
+        return false;
+    for (auto c : prefix)
+        if (!isalnum((unsigned char)c) && c != '_')
+            return false;
+    return true;
+}
 extern nlvm::TargetTriple targetTriple;
 
 #include "deser.inc"
+#include "postag.inc"
 #include "test_bc.h"
 
 namespace nlvm {
@@ -127,9 +162,42 @@ public:
     llvm::Function* nlex_get_group_start_ptr = nullptr;
     llvm::Function* nlex_get_group_end_ptr = nullptr;
     llvm::Function* nlex_get_group_length = nullptr;
+    /// Fills the capture indices for the current match, if they are resolved
+    /// lazily (see DFANLVMCodeGenerator::generate_capture_replay)
+    llvm::Function* nlex_capture_resolve = nullptr;
+    /// Stores the match end the capture indices were last resolved for
+    llvm::GlobalVariable* nlex_capture_resolved_end = nullptr;
 
     llvm::Function* nlex_apply_postag = nullptr;
     bool postag_applies = false;
+    /// The tagger is postag.inc.c over code generated for the model
+    /// (`option postag_specialise on`), instead of deser.inc.cc
+    bool postag_specialised = false;
+
+    /// Exported symbols are renamed with this (`--symbol-prefix' or `option
+    /// name'), see prefixed_symbol
+    std::string symbol_prefix = "";
+
+    /// Advances one (normalised) character, this is nlex_next unless
+    /// `option normalise_ahead on`, in which case it only runs in nlex_feed
+    llvm::Function* nlex_normalise_step;
+
+    /// Finds the next position that can start a token
+    /// exists only if `option skip_on_error on`
+    llvm::Function* nlex_resync = nullptr;
+
+    /// Memo table of subexpression calls, indexed by a hash of (subexpression,
+    /// position); exists only if `option memoise_subexpressions on`
+    llvm::GlobalVariable* nlex_memo_generation = nullptr; // bumped by nlex_feed
+    llvm::GlobalVariable* nlex_memo_key; // (generation << 32) | subexpression
+    llvm::GlobalVariable* nlex_memo_pos;
+    llvm::GlobalVariable* nlex_memo_end;
+    llvm::GlobalVariable* nlex_memo_length; // bytes the call added to the token
+    llvm::GlobalVariable* nlex_memo_errc;
+
+    /// Nesting depth of subexpression calls, exists only if they are bounded
+    /// (`option subexpr_depth_limit <n>' or `option explicit_subexpr_stack on')
+    llvm::GlobalVariable* nlex_subexpr_depth = nullptr;
 
     /// Stores the start of this match
     llvm::GlobalVariable* nlex_match_start;
@@ -139,6 +207,16 @@ public:
     llvm::GlobalVariable* token_length;
     /// Stores the subject string
     llvm::GlobalVariable* nlex_fed_string;
+    /// The pending expansion of a normalisation: the rest of it, the bytes
+    /// left of it, and how much longer it is than the input it replaced
+    llvm::GlobalVariable* nlex_injected;
+    llvm::GlobalVariable* nlex_injected_length;
+    llvm::GlobalVariable* nlex_injected_length_diff;
+    /// Stores the current (normalised) character
+    llvm::GlobalVariable* nlex_tmp_char;
+    /// libc memchr and memcmp, declared on first use (see Builder::emit_backreference)
+    llvm::Function* nlex_memchr = nullptr;
+    llvm::Function* nlex_memcmp = nullptr;
     /// Stores the capture indices
     /// [i0_start, i0_end, i1_start, i1_end] (start = i*2, end = i*2+1)
     /// exists only if `option capture_groups on`
@@ -532,6 +610,7 @@ public:
             llvm::Type::getInt8Ty(TheContext),                            // error code (0 = ok)
             llvm::Type::getInt8Ty(TheContext),                            // metadata (1 = stopword, )
             llvm::PointerType::get(llvm::Type::getInt8Ty(TheContext), 0), // POS
+            llvm::Type::getInt32Ty(TheContext),                           // tag id
         };
         input_struct_type = llvm::StructType::create(members);
         _main = mkfunc();
@@ -553,6 +632,7 @@ public:
 
     std::unique_ptr<llvm::Module> RTSModule;
     std::unique_ptr<llvm::Module> DeserModule;
+    std::unique_ptr<llvm::Module> PostagModule;
 
     Module(std::string name, llvm::raw_ostream* os)
         : BaseModule()
@@ -577,6 +657,14 @@ public:
             ed.print(name.c_str(), *os);
         assert(DeserModule.get() != nullptr && "Deser compilation failed");
 
+        static llvm::StringRef mPostagBitcode = llvm::StringRef((const char*)postag_inc_bc, postag_inc_bc_len);
+        PostagModule = llvm::parseIR(
+            llvm::MemoryBufferRef(mPostagBitcode, "postag_bc"), ed, TheContext);
+
+        if (!PostagModule)
+            ed.print(name.c_str(), *os);
+        assert(PostagModule.get() != nullptr && "Postag compilation failed");
+
         TheModule = std::make_unique<llvm::Module>(name, TheContext);
 
         TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version",
@@ -662,6 +750,28 @@ public:
                 llvm::PointerType::get(llvm::Type::getInt8Ty(TheContext), 0)),
             "nlex_match_start");
 
+        // the position in the input, created here rather than in prepare()
+        // for the code generated before it (see generate_capture_replay)
+        nlex_fed_string = createGlobal(
+            llvm::PointerType::get(llvm::Type::getInt8Ty(TheContext), 0),
+            llvm::Constant::getNullValue(
+                llvm::PointerType::get(llvm::Type::getInt8Ty(TheContext), 0)),
+            "nlex_fed_string");
+        nlex_tmp_char = createGlobal(llvm::Type::getInt8Ty(TheContext),
+            llvm::Constant::getNullValue(llvm::Type::getInt8Ty(TheContext)),
+            "nlex_tmp_char");
+        nlex_injected = createGlobal(
+            llvm::PointerType::get(llvm::Type::getInt8Ty(TheContext), 0),
+            llvm::Constant::getNullValue(
+                llvm::PointerType::get(llvm::Type::getInt8Ty(TheContext), 0)),
+            "nlex_injected");
+        nlex_injected_length = createGlobal(llvm::Type::getInt32Ty(TheContext),
+            llvm::Constant::getNullValue(llvm::Type::getInt32Ty(TheContext)),
+            "nlex_injected_length");
+        nlex_injected_length_diff = createGlobal(llvm::Type::getInt32Ty(TheContext),
+            llvm::Constant::getNullValue(llvm::Type::getInt32Ty(TheContext)),
+            "nlex_injected_length_diff");
+
         token_value = createGlobal(
             llvm::ArrayType::get(llvm::Type::getInt8Ty(TheContext), 1024000),
             llvm::Constant::getNullValue(
@@ -676,11 +786,6 @@ public:
 };
 } // namespace nlvm
 
-extern void KaleidInitialise(std::string startup_code,
-    nlvm::BaseModule* module);
-extern void KaleidCompile(std::string code, llvm::IRBuilder<>& builder,
-    bool allow_bare_expressions);
-
 namespace nlvm {
 static void debugPrintValue(llvm::Value* v) { v->print(llvm::errs(), true); }
 static void debugPrintType(llvm::Value* v)
@@ -688,13 +793,141 @@ static void debugPrintType(llvm::Value* v)
     v->getType()->print(llvm::errs(), true);
 }
 
+/// How the table backend stores the transitions (`--table-compression'),
+/// see DFATable
+enum class TableCompression {
+    Full,    // a 256-wide row per state: 1 read per byte, the largest
+    Classes, // a row of byte classes per state: 2 reads per byte
+    Comb,    // rows packed by row displacement (base/next/check/fallback): 4 reads
+    Sparse,  // rows as lists of (class, cell): small for near-empty rows, a scan
+};
+
+/// A DFA laid out as tables, for the table backend (`--backend table'): bytes
+/// map to classes of bytes every state treats alike, and `next' holds, for
+/// each state and class, 0 if the state has no transition on it, or
+/// ((target + 1) << 1 | codepoint), where codepoint is set for default
+/// transitions, which consume the rest of a utf-8 codepoint
+struct DFATable {
+    int classes = 0;
+    std::array<uint8_t, 256> byte_class {};
+    std::vector<uint32_t> next;
+    /// the tag of each state, "" if it is not final
+    std::vector<std::string> tags;
+    int start = 0;
+
+    /// Compressed layouts (see compress): the rows keep only the classes
+    /// whose cell differs from the row's most common one, `fallback'
+    std::vector<uint32_t> fallback;
+    /// comb: the cell of class c in row s is comb_next[base[s] + c] if
+    /// comb_check there is s + 1, the fallback otherwise
+    std::vector<uint32_t> base, comb_next, comb_check;
+    /// sparse: row s is entries offsets[s]..offsets[s + 1]
+    std::vector<uint32_t> offsets, sparse_cell;
+    std::vector<uint8_t> sparse_class;
+
+    uint32_t cell(int state, int c) const { return next[state * classes + c]; }
+
+    void compress()
+    {
+        int states = tags.size();
+        std::vector<std::vector<int>> entries(states);
+        fallback.assign(states, 0);
+        for (auto s = 0; s < states; ++s) {
+            std::map<uint32_t, int> counts;
+            for (auto c = 0; c < classes; ++c)
+                if (++counts[cell(s, c)] > counts[fallback[s]])
+                    fallback[s] = cell(s, c);
+            for (auto c = 0; c < classes; ++c)
+                if (cell(s, c) != fallback[s])
+                    entries[s].push_back(c);
+        }
+
+        // row displacement, first fit with the fullest rows first
+        std::vector<int> order(states);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+            [&](int a, int b) { return entries[a].size() > entries[b].size(); });
+        base.assign(states, 0);
+        comb_next.clear();
+        comb_check.clear();
+        size_t first_free = 0;
+        for (auto s : order) {
+            if (entries[s].empty())
+                continue;
+            auto fits = [&](size_t b) {
+                for (auto c : entries[s])
+                    if (b + c < comb_check.size() && comb_check[b + c])
+                        return false;
+                return true;
+            };
+            // slots below first_free are taken
+            size_t b = first_free > (size_t)entries[s][0] ? first_free - entries[s][0] : 0;
+            while (!fits(b))
+                ++b;
+            if (comb_check.size() < b + classes) {
+                comb_check.resize(b + classes, 0);
+                comb_next.resize(b + classes, 0);
+            }
+            for (auto c : entries[s]) {
+                comb_check[b + c] = s + 1;
+                comb_next[b + c] = cell(s, c);
+            }
+            base[s] = b;
+            while (first_free < comb_check.size() && comb_check[first_free])
+                ++first_free;
+        }
+        // any class of any row can be looked up
+        comb_check.resize(std::max(comb_check.size(), (size_t)classes), 0);
+        comb_next.resize(comb_check.size(), 0);
+
+        offsets.clear();
+        sparse_class.clear();
+        sparse_cell.clear();
+        for (auto s = 0; s < states; ++s) {
+            offsets.push_back(sparse_class.size());
+            for (auto c : entries[s]) {
+                sparse_class.push_back(c);
+                sparse_cell.push_back(cell(s, c));
+            }
+        }
+        offsets.push_back(sparse_class.size());
+    }
+
+    /// Memory reads per input byte of the sparse rows, if every class is as
+    /// likely: the class, the row bounds, the entries compared and the cell
+    double sparse_lookups() const
+    {
+        double scanned = 0;
+        int states = tags.size();
+        for (auto s = 0; s < states; ++s) {
+            double k = offsets[s + 1] - offsets[s];
+            scanned += (k * (k + 1) / 2 + (classes - k) * k) / classes;
+        }
+        return 4 + (states ? scanned / states : 0);
+    }
+};
+
 class Builder {
 public:
     Module module;
+    /// compiler for rule actions and `define's
+    KaleidCompiler kaleid { &module };
     llvm::raw_ostream* outputv = nullptr;
     llvm::BasicBlock* first_root = nullptr;
     bool issubexp = false;
     bool do_capture_groups = false;
+    /// captures are resolved on demand by replaying the DFA over the match,
+    /// instead of being stored while scanning
+    bool lazy_capture_groups = false;
+    /// bytes that can start a token outside the DFA (normalisations, literals)
+    std::bitset<256> resync_bytes;
+    /// subexpression calls go through the memo table (see emit_memoised_call)
+    bool memoise_subexpressions = false;
+    static constexpr int memo_table_bits = 12;
+    /// deeper subexpression calls fail with NLEX_ERRC_DEPTH_LIMIT (0: unbounded)
+    int subexpr_depth_limit = 0;
+    /// locals of subexpression functions live in an arena indexed by depth
+    bool explicit_subexpr_stack = false;
     llvm::TargetMachine* TheTargetMachine;
 
     Builder(std::string mname, llvm::raw_ostream* o)
@@ -761,10 +994,9 @@ public:
         return { backtrackBB, backtrackExitBB };
     }
 
-    void begin(llvm::Function* fn, bool cleanup_if_fail = false,
-        bool skip_on_error = true)
+    void begin(llvm::Function* fn, bool cleanup_if_fail = false)
     {
-        KaleidInitialise(R"(
+        kaleid.initialise(R"(
         extern putchard(x);
         extern eputchard(x);
         extern printd(x);
@@ -780,17 +1012,15 @@ public:
         extern dderef(ptr);
         extern dderefset(ptr val);
 
-        def binary : (x y) y;
         def unary ^ (ptr) cderef(ptr);
         def binary ` (ptr val) cderefset(ptr, val);
 
-        def print_string(str) for x=0,^(str+x) in
+        def print_string(str: ptr) for x: i64 = 0, ^(str+x) in
             putchard(^(str+x))
 
-        def eprint_string(str) for x=0,^(str+x) in
+        def eprint_string(str: ptr) for x: i64 = 0, ^(str+x) in
             eputchard(^(str+x))
-    )",
-            &module);
+    )");
 
         module.emitLocation((DFANode<NFANode<std::nullptr_t>*>*)NULL);
         auto BBfinalise = llvm::BasicBlock::Create(module.TheContext, "_escape_top", fn);
@@ -802,17 +1032,8 @@ public:
 
         module.exit_blocks.push_back(bbF);
 
-        if (skip_on_error) {
-            auto advance_and_callFbb = llvm::BasicBlock::Create(module.TheContext, "_escape_redo", fn);
-            module.Builder.CreateCondBr(
-                module.Builder.CreateLoad(module.anything_matched), bbF,
-                advance_and_callFbb);
-            module.Builder.SetInsertPoint(advance_and_callFbb);
-            module.Builder.CreateCall(module.nlex_next);
-            module.Builder.CreateCall(fn, { fn->arg_begin() })->setTailCall(true);
-            module.Builder.CreateRetVoid();
-        } else
-            module.Builder.CreateBr(bbF);
+        // `skip_on_error` patches this jump in prepare(), once the options are known
+        module.Builder.CreateBr(bbF);
         module.Builder.SetInsertPoint(bbF);
         auto istruct = fn->arg_begin();
         auto stgep = module.Builder.CreateInBoundsGEP(
@@ -835,8 +1056,9 @@ public:
                     llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
                         1) },
                 "length"));
+        auto tag = module.Builder.CreateLoad(module.last_tag);
         module.Builder.CreateStore(
-            module.Builder.CreateLoad(module.last_tag),
+            tag,
             module.Builder.CreateInBoundsGEP(
                 istruct,
                 {
@@ -853,6 +1075,32 @@ public:
                                                                 llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 3),
                                                             },
                       "errc"));
+        // metadata bit 2 is only set by skip_on_error's runs, which return
+        // without coming here; clear it for the tokens after one
+        auto metadata = module.Builder.CreateInBoundsGEP(istruct, {
+                                                                      llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 0),
+                                                                      llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 4),
+                                                                  },
+            "metadata");
+        module.Builder.CreateStore(
+            module.Builder.CreateAnd(module.Builder.CreateLoad(metadata),
+                llvm::ConstantInt::get(llvm::Type::getInt8Ty(module.TheContext), ~4)),
+            metadata);
+        // the id sits in front of the tag (see mk_tag_string), the tag is only
+        // set if something matched
+        auto id_tag = module.Builder.CreateSelect(
+            module.Builder.CreateICmpEQ(errc, llvm::ConstantInt::get(llvm::Type::getInt8Ty(module.TheContext), 0)),
+            tag, get_or_create_tag(""));
+        module.Builder.CreateStore(
+            module.Builder.CreateLoad(module.Builder.CreateBitCast(
+                module.Builder.CreateInBoundsGEP(id_tag,
+                    { llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), -4) }),
+                llvm::Type::getInt32PtrTy(module.TheContext))),
+            module.Builder.CreateInBoundsGEP(istruct, {
+                                                          llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 0),
+                                                          llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 6),
+                                                      },
+                "tag_id"));
         if (cleanup_if_fail) {
             auto mbb = llvm::BasicBlock::Create(module.TheContext, "_cleanup", fn);
             auto ebb = llvm::BasicBlock::Create(module.TheContext, "_exit", fn);
@@ -875,34 +1123,64 @@ public:
     }
     void prepare(const GenLexer&& lexer_stuff)
     {
+        // number the tags before any of them is created, in the order they
+        // are declared, so adding a rule at the end keeps the others' ids
+        tag_ids["<Skipped>"] = 1;
+        for (auto& tag : lexer_stuff.tag_order)
+            tag_ids.insert({ tag, tag_ids.size() + 1 });
+        // the symbol prefix, `--symbol-prefix' overrides `option name [x]'
+        module.symbol_prefix = symbol_prefix;
+        auto name = lexer_stuff.option_lists.find("name");
+        if (name != lexer_stuff.option_lists.end() && symbol_prefix == "") {
+            if (name->second.size() != 1)
+                slts.show(Display::Type::WARNING,
+                    "option {<magenta>}name{<clean>} takes exactly one name, ignoring it");
+            else if (!valid_symbol_prefix(*name->second.begin()))
+                slts.show(Display::Type::ERROR,
+                    "option {<magenta>}name{<clean>} '{<red>}%s{<clean>}' is not a valid C "
+                    "identifier ([A-Za-z_][A-Za-z0-9_]*), ignoring it",
+                    name->second.begin()->c_str());
+            else
+                module.symbol_prefix = *name->second.begin();
+        }
         // create global values & normalisation logic
         module.emitLocation((DFANode<NFANode<std::nullptr_t>*>*)NULL);
         // produce debug stuff
         if (get(lexer_stuff.options, "debug_mode"))
             module.debug_mode = true;
-        // record capture groups if set
-        if (get(lexer_stuff.options, "capturing_groups")) {
+        // record capture groups if set, backreferences need them too
+        if (get(lexer_stuff.options, "capturing_groups") || lexer_stuff.has_backreferences) {
             do_capture_groups = true;
             auto arrty = llvm::ArrayType::get(llvm::Type::getInt8PtrTy(module.TheContext),
                 (lexer_stuff.total_capturing_groups + 1) * 2);
             module.nlex_capture_indices = module.createGlobal(arrty, llvm::ConstantArray::getNullValue(arrty),
                 "capturing_group_indices");
 
+            module.nlex_capture_resolved_end = module.createGlobal(
+                llvm::Type::getInt8PtrTy(module.TheContext),
+                llvm::Constant::getNullValue(llvm::Type::getInt8PtrTy(module.TheContext)),
+                "nlex_capture_resolved_end");
+            // body is generated along with the DFA
+            module.nlex_capture_resolve = llvm::Function::Create(
+                llvm::FunctionType::get(llvm::Type::getVoidTy(module.TheContext), {}, false),
+                llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                "__nlex_capture_resolve", *module.TheModule);
+
             // create lib functions that require this option
             auto iptrt = llvm::FunctionType::get(
                 llvm::Type::getInt8PtrTy(module.TheContext),
-                { llvm::Type::getDoubleTy(module.TheContext) }, false);
+                { llvm::Type::getInt32Ty(module.TheContext) }, false);
             auto iit = llvm::FunctionType::get(
                 llvm::Type::getInt32Ty(module.TheContext),
-                { llvm::Type::getDoubleTy(module.TheContext) }, false);
+                { llvm::Type::getInt32Ty(module.TheContext) }, false);
             module.nlex_get_group_start_ptr = llvm::Function::Create(
-                iptrt, llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                iptrt, llvm::GlobalValue::LinkageTypes::ExternalLinkage,
                 "nlex_get_group_start_ptr", *module.TheModule);
             module.nlex_get_group_end_ptr = llvm::Function::Create(
-                iptrt, llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                iptrt, llvm::GlobalValue::LinkageTypes::ExternalLinkage,
                 "nlex_get_group_end_ptr", *module.TheModule);
             module.nlex_get_group_length = llvm::Function::Create(
-                iit, llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                iit, llvm::GlobalValue::LinkageTypes::ExternalLinkage,
                 "nlex_get_group_length", *module.TheModule);
 
             auto total_groups = llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
@@ -919,9 +1197,9 @@ public:
                     module.nlex_get_group_start_ptr);
 
                 builder.SetInsertPoint(bb0);
-                auto arg = builder.CreateFPToSI(module.nlex_get_group_start_ptr->arg_begin(),
-                    llvm::Type::getInt32Ty(module.TheContext));
-                builder.CreateCondBr(builder.CreateICmpSGT(arg, total_groups), bb2,
+                builder.CreateCall(module.nlex_capture_resolve);
+                auto arg = module.nlex_get_group_start_ptr->arg_begin();
+                builder.CreateCondBr(builder.CreateICmpUGT(arg, total_groups), bb2,
                     bb1);
                 builder.SetInsertPoint(bb1);
                 auto phiout0 = builder.CreateLoad(builder.CreateInBoundsGEP(
@@ -952,9 +1230,9 @@ public:
                     module.nlex_get_group_end_ptr);
 
                 builder.SetInsertPoint(bb0);
-                auto arg = builder.CreateFPToSI(module.nlex_get_group_end_ptr->arg_begin(),
-                    llvm::Type::getInt32Ty(module.TheContext));
-                builder.CreateCondBr(builder.CreateICmpSGT(arg, total_groups), bb2,
+                builder.CreateCall(module.nlex_capture_resolve);
+                auto arg = module.nlex_get_group_end_ptr->arg_begin();
+                builder.CreateCondBr(builder.CreateICmpUGT(arg, total_groups), bb2,
                     bb1);
                 builder.SetInsertPoint(bb1);
                 auto phiout0 = builder.CreateLoad(builder.CreateInBoundsGEP(
@@ -987,9 +1265,9 @@ public:
                     module.nlex_get_group_length);
 
                 builder.SetInsertPoint(bb0);
-                auto arg = builder.CreateFPToSI(module.nlex_get_group_length->arg_begin(),
-                    llvm::Type::getInt32Ty(module.TheContext));
-                builder.CreateCondBr(builder.CreateICmpSGT(arg, total_groups), bb2,
+                builder.CreateCall(module.nlex_capture_resolve);
+                auto arg = module.nlex_get_group_length->arg_begin();
+                builder.CreateCondBr(builder.CreateICmpUGT(arg, total_groups), bb2,
                     bb1);
                 builder.SetInsertPoint(bb1);
                 auto a0 = builder.CreateLoad(builder.CreateBitCast(
@@ -1026,6 +1304,47 @@ public:
                 builder.CreateRet(phi);
             }
         }
+        // bound the nesting of subexpression calls, so deep input fails the
+        // match instead of overflowing the (native) stack
+        explicit_subexpr_stack = get(lexer_stuff.options, "explicit_subexpr_stack");
+        subexpr_depth_limit = get(lexer_stuff.option_values, "subexpr_depth_limit");
+        if (explicit_subexpr_stack && subexpr_depth_limit <= 0)
+            subexpr_depth_limit = 1024;
+        if (subexpr_depth_limit > 0)
+            module.nlex_subexpr_depth = module.createGlobal(
+                llvm::Type::getInt32Ty(module.TheContext),
+                llvm::Constant::getNullValue(llvm::Type::getInt32Ty(module.TheContext)),
+                "nlex_subexpr_depth");
+
+        // memo table for subexpression calls; a replayed call only re-appends
+        // the bytes it consumed, so it can't skip captures or changes made by
+        // the normaliser
+        if (get(lexer_stuff.options, "memoise_subexpressions")) {
+            if (do_capture_groups)
+                slts.show(Display::Type::WARNING,
+                    "memoise_subexpressions is ignored with capturing_groups\n");
+            else if (lexer_stuff.normalisations.size() > 0
+                && !get(lexer_stuff.options, "normalise_ahead"))
+                slts.show(Display::Type::WARNING,
+                    "memoise_subexpressions is ignored with normalisations, unless "
+                    "normalise_ahead is on\n");
+            else {
+                memoise_subexpressions = true;
+                auto table = [&](llvm::Type* ty, const char* name) {
+                    auto arrty = llvm::ArrayType::get(ty, 1 << memo_table_bits);
+                    return module.createGlobal(arrty, llvm::Constant::getNullValue(arrty), name);
+                };
+                module.nlex_memo_generation = module.createGlobal(
+                    llvm::Type::getInt32Ty(module.TheContext),
+                    llvm::Constant::getNullValue(llvm::Type::getInt32Ty(module.TheContext)),
+                    "nlex_memo_generation");
+                module.nlex_memo_key = table(llvm::Type::getInt64Ty(module.TheContext), "nlex_memo_key");
+                module.nlex_memo_pos = table(llvm::Type::getInt8PtrTy(module.TheContext), "nlex_memo_pos");
+                module.nlex_memo_end = table(llvm::Type::getInt8PtrTy(module.TheContext), "nlex_memo_end");
+                module.nlex_memo_length = table(llvm::Type::getInt32Ty(module.TheContext), "nlex_memo_length");
+                module.nlex_memo_errc = table(llvm::Type::getInt8Ty(module.TheContext), "nlex_memo_errc");
+            }
+        }
 
         // crucial library functions
         {
@@ -1040,33 +1359,16 @@ public:
             module.nlex_debug = module.mkfunc(true, "__nlex_produce_debug", false,
                 false, true, dfnty);
 
-            auto nlex_fed_string = module.nlex_fed_string = module.createGlobal(
-                llvm::PointerType::get(llvm::Type::getInt8Ty(module.TheContext), 0),
-                llvm::Constant::getNullValue(llvm::PointerType::get(
-                    llvm::Type::getInt8Ty(module.TheContext), 0)),
-                "nlex_fed_string");
+            auto nlex_fed_string = module.nlex_fed_string;
             auto nlex_true_start = module.createGlobal(
                 llvm::PointerType::get(llvm::Type::getInt8Ty(module.TheContext), 0),
                 llvm::Constant::getNullValue(llvm::PointerType::get(
                     llvm::Type::getInt8Ty(module.TheContext), 0)),
                 "nlex_true_start");
-            auto nlex_tmp_char = module.createGlobal(llvm::Type::getInt8Ty(module.TheContext),
-                llvm::Constant::getNullValue(
-                    llvm::Type::getInt8Ty(module.TheContext)),
-                "nlex_tmp_char");
-            auto nlex_injected = module.createGlobal(
-                llvm::PointerType::get(llvm::Type::getInt8Ty(module.TheContext), 0),
-                llvm::Constant::getNullValue(llvm::PointerType::get(
-                    llvm::Type::getInt8Ty(module.TheContext), 0)),
-                "nlex_injected");
-            auto nlex_injected_length = module.createGlobal(llvm::Type::getInt32Ty(module.TheContext),
-                llvm::Constant::getNullValue(
-                    llvm::Type::getInt32Ty(module.TheContext)),
-                "nlex_injected_length");
-            auto nlex_injected_length_diff = module.createGlobal(llvm::Type::getInt32Ty(module.TheContext),
-                llvm::Constant::getNullValue(
-                    llvm::Type::getInt32Ty(module.TheContext)),
-                "nlex_injected_length_diff");
+            auto nlex_tmp_char = module.nlex_tmp_char;
+            auto nlex_injected = module.nlex_injected;
+            auto nlex_injected_length = module.nlex_injected_length;
+            auto nlex_injected_length_diff = module.nlex_injected_length_diff;
 
             // create "library" functions
             llvm::IRBuilder<> builder(module.TheContext);
@@ -1085,13 +1387,143 @@ public:
                 builder.CreateGEP(builder.CreateLoad(nlex_fed_string),
                     builder.CreateLoad(nlex_injected_length_diff)));
 
+            // with `normalise_ahead`, the whole input is normalised once by
+            // nlex_feed into nlex_normalised, and the DFA reads that buffer
+            // directly. nlex_normalised_offsets maps each of its bytes back to
+            // an offset in the original input. Both are malloc'd, and grown
+            // by nlex_feed to fit the input (nlex_normalised_cap bytes).
+            bool normalise_ahead = get(lexer_stuff.options, "normalise_ahead");
+            llvm::GlobalVariable *nlex_normalised = nullptr, *nlex_normalised_offsets = nullptr,
+                                 *nlex_normalised_cap = nullptr;
+            module.nlex_normalise_step = module.nlex_next;
+            if (normalise_ahead) {
+                module.nlex_normalise_step = llvm::Function::Create(
+                    module.nlex_next->getFunctionType(), llvm::Function::InternalLinkage,
+                    "__nlex_normalise_step", module.TheModule.get());
+                auto bufty = llvm::Type::getInt8PtrTy(module.TheContext);
+                nlex_normalised = module.createGlobal(bufty,
+                    llvm::Constant::getNullValue(bufty), "nlex_normalised");
+                auto offty = llvm::PointerType::get(llvm::Type::getInt32Ty(module.TheContext), 0);
+                nlex_normalised_offsets = module.createGlobal(offty,
+                    llvm::Constant::getNullValue(offty), "nlex_normalised_offsets");
+                auto capty = llvm::Type::getInt64Ty(module.TheContext);
+                nlex_normalised_cap = module.createGlobal(capty,
+                    llvm::Constant::getNullValue(capty), "nlex_normalised_cap");
+            }
+            auto* advance = module.nlex_normalise_step;
+
             // nlex_distance - get current position in string (as int)
             BB = llvm::BasicBlock::Create(module.TheContext, "", module.nlex_distance);
             builder.SetInsertPoint(BB);
-            builder.CreateRet(builder.CreatePtrDiff(
-                builder.CreateGEP(builder.CreateLoad(nlex_fed_string),
-                    builder.CreateLoad(nlex_injected_length_diff)),
-                builder.CreateLoad(nlex_true_start)));
+            if (normalise_ahead) {
+                // report the position in the original input
+                auto pos = builder.CreatePtrDiff(builder.CreateLoad(nlex_fed_string),
+                    builder.CreateLoad(nlex_true_start));
+                builder.CreateRet(builder.CreateSExt(
+                    builder.CreateLoad(builder.CreateInBoundsGEP(
+                        builder.CreateLoad(nlex_normalised_offsets), { pos })),
+                    llvm::Type::getInt64Ty(module.TheContext)));
+            } else
+                builder.CreateRet(builder.CreatePtrDiff(
+                    builder.CreateGEP(builder.CreateLoad(nlex_fed_string),
+                        builder.CreateLoad(nlex_injected_length_diff)),
+                    builder.CreateLoad(nlex_true_start)));
+
+            // int64_t __nlex_token_offset(void): where the last token began
+            // matching, as an offset like those of __nlex_distance (which,
+            // minus the token's length, is only right if nothing is normalised)
+            {
+                auto* token_offset = llvm::Function::Create(
+                    llvm::FunctionType::get(llvm::Type::getInt64Ty(module.TheContext), false),
+                    llvm::Function::ExternalLinkage, "__nlex_token_offset", module.TheModule.get());
+                builder.SetInsertPoint(llvm::BasicBlock::Create(module.TheContext, "", token_offset));
+                auto pos = builder.CreatePtrDiff(builder.CreateLoad(module.nlex_match_start),
+                    builder.CreateLoad(nlex_true_start));
+                if (normalise_ahead)
+                    builder.CreateRet(builder.CreateSExt(
+                        builder.CreateLoad(builder.CreateInBoundsGEP(
+                            builder.CreateLoad(nlex_normalised_offsets), { pos })),
+                        llvm::Type::getInt64Ty(module.TheContext)));
+                else
+                    builder.CreateRet(pos);
+            }
+
+            // size_t __nlex_tokenise_arrays(uint32_t *offset, uint32_t *length,
+            //                               uint16_t *tag, uint8_t *flags, size_t cap)
+            // calls __nlex_root until the input ends (or a token fails), or
+            // `cap' tokens are out, and writes them as separate arrays: where
+            // each starts in the input, its length, tag id and metadata.
+            // Returns the number of tokens written.
+            if (get(lexer_stuff.options, "token_arrays") && !lexer_stuff.tagpos.has_value()) {
+                auto& ctx = module.TheContext;
+                auto* i8 = llvm::Type::getInt8Ty(ctx);
+                auto* i16 = llvm::Type::getInt16Ty(ctx);
+                auto* i32 = llvm::Type::getInt32Ty(ctx);
+                auto* i64 = llvm::Type::getInt64Ty(ctx);
+                auto* arrays = llvm::Function::Create(
+                    llvm::FunctionType::get(i64,
+                        { llvm::PointerType::get(i32, 0), llvm::PointerType::get(i32, 0),
+                            llvm::PointerType::get(i16, 0), llvm::PointerType::get(i8, 0), i64 },
+                        false),
+                    llvm::Function::ExternalLinkage, "__nlex_tokenise_arrays",
+                    module.TheModule.get());
+                auto args = arrays->arg_begin();
+                llvm::Value *offsets = args++, *lengths = args++, *tags = args++,
+                            *flags = args++, *cap = args;
+                auto* entry = llvm::BasicBlock::Create(ctx, "", arrays);
+                auto* loop = llvm::BasicBlock::Create(ctx, "loop", arrays);
+                auto* next = llvm::BasicBlock::Create(ctx, "next", arrays);
+                auto* store = llvm::BasicBlock::Create(ctx, "store", arrays);
+                auto* done = llvm::BasicBlock::Create(ctx, "done", arrays);
+                llvm::IRBuilder<> abuilder { entry };
+                auto* result = abuilder.CreateAlloca(module.input_struct_type);
+                auto field = [&](int i) {
+                    return abuilder.CreateInBoundsGEP(result,
+                        { llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i32, i) });
+                };
+                abuilder.CreateStore(llvm::Constant::getNullValue(module.input_struct_type), result);
+                abuilder.CreateBr(loop);
+
+                abuilder.SetInsertPoint(loop);
+                auto* n = abuilder.CreatePHI(i64, 2);
+                n->addIncoming(llvm::ConstantInt::get(i64, 0), entry);
+                abuilder.CreateCondBr(abuilder.CreateICmpULT(n, cap), next, done);
+
+                abuilder.SetInsertPoint(next);
+                abuilder.CreateCall(module.main(), { result });
+                auto* length = abuilder.CreateLoad(field(1));
+                // runs skipped by skip_on_error (NLEX_ERRC_SKIPPED) are kept
+                auto* errc = abuilder.CreateLoad(field(3));
+                abuilder.CreateCondBr(
+                    abuilder.CreateAnd(
+                        abuilder.CreateOr(abuilder.CreateICmpEQ(errc, llvm::ConstantInt::get(i8, NLEX_ERRC_NONE)),
+                            abuilder.CreateICmpEQ(errc, llvm::ConstantInt::get(i8, NLEX_ERRC_SKIPPED))),
+                        abuilder.CreateICmpSGT(length, llvm::ConstantInt::get(i32, 0))),
+                    store, done);
+
+                // the token started where __nlex_root began matching it
+                abuilder.SetInsertPoint(store);
+                llvm::Value* offset = abuilder.CreatePtrDiff(abuilder.CreateLoad(module.nlex_match_start),
+                    abuilder.CreateLoad(nlex_true_start));
+                if (normalise_ahead)
+                    offset = abuilder.CreateLoad(abuilder.CreateInBoundsGEP(
+                        abuilder.CreateLoad(nlex_normalised_offsets), { offset }));
+                else
+                    offset = abuilder.CreateTrunc(offset, i32);
+                abuilder.CreateStore(offset, abuilder.CreateInBoundsGEP(offsets, { n }));
+                abuilder.CreateStore(length, abuilder.CreateInBoundsGEP(lengths, { n }));
+                abuilder.CreateStore(abuilder.CreateTrunc(abuilder.CreateLoad(field(6)), i16),
+                    abuilder.CreateInBoundsGEP(tags, { n }));
+                abuilder.CreateStore(abuilder.CreateLoad(field(4)), abuilder.CreateInBoundsGEP(flags, { n }));
+                n->addIncoming(abuilder.CreateAdd(n, llvm::ConstantInt::get(i64, 1)), store);
+                abuilder.CreateBr(loop);
+
+                abuilder.SetInsertPoint(done);
+                abuilder.CreateRet(n);
+            } else if (get(lexer_stuff.options, "token_arrays"))
+                slts.show(Display::Type::WARNING,
+                    "token_arrays is ignored with `tag pos', tokens are handed out "
+                    "after the tagger has read ahead\n");
 
             // nlex_restore - restore position from passed in pointer
             BB = llvm::BasicBlock::Create(module.TheContext, "", module.nlex_restore);
@@ -1128,14 +1560,116 @@ public:
             builder.CreateStore(
                 llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 0),
                 nlex_injected_length_diff);
+            if (module.nlex_capture_resolved_end)
+                builder.CreateStore(
+                    llvm::Constant::getNullValue(llvm::Type::getInt8PtrTy(module.TheContext)),
+                    module.nlex_capture_resolved_end);
+            // forget all memoised subexpression calls
+            if (module.nlex_memo_generation)
+                builder.CreateStore(
+                    builder.CreateAdd(builder.CreateLoad(module.nlex_memo_generation),
+                        llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 1)),
+                    module.nlex_memo_generation);
+            if (normalise_ahead) {
+                // run the normaliser over the whole input, recording where
+                // every output byte came from; injected bytes share the offset
+                // of the sequence that produced them. The buffers are doubled
+                // whenever they fill up, and kept for the next input.
+                auto& ctx = module.TheContext;
+                auto* i8 = llvm::Type::getInt8Ty(ctx);
+                auto* i8p = llvm::Type::getInt8PtrTy(ctx);
+                auto* i32 = llvm::Type::getInt32Ty(ctx);
+                auto* i64 = llvm::Type::getInt64Ty(ctx);
+                auto* M = module.TheModule.get();
+                auto libc = [&](const char* name, llvm::FunctionType* type) {
+                    if (auto* fn = M->getFunction(name))
+                        return fn;
+                    return llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, M);
+                };
+                auto* realloc_fn = libc("realloc", llvm::FunctionType::get(i8p, { i8p, i64 }, false));
+                auto* write_fn = libc("write", llvm::FunctionType::get(i64, { i32, i8p, i64 }, false));
+                auto* abort_fn = libc("abort", llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), false));
+                auto* input = module.nlex_feed->arg_begin();
+                auto* loopBB = llvm::BasicBlock::Create(ctx, "normalise", module.nlex_feed);
+                auto* growBB = llvm::BasicBlock::Create(ctx, "grow", module.nlex_feed);
+                auto* failBB = llvm::BasicBlock::Create(ctx, "out_of_memory", module.nlex_feed);
+                auto* grownBB = llvm::BasicBlock::Create(ctx, "grown", module.nlex_feed);
+                auto* storeBB = llvm::BasicBlock::Create(ctx, "store", module.nlex_feed);
+                auto* doneBB = llvm::BasicBlock::Create(ctx, "normalised", module.nlex_feed);
+                builder.CreateBr(loopBB);
+
+                builder.SetInsertPoint(loopBB);
+                auto* i = builder.CreatePHI(i64, 2);
+                auto* prev_offset = builder.CreatePHI(i32, 2);
+                i->addIncoming(llvm::ConstantInt::get(i64, 0), BB);
+                prev_offset->addIncoming(llvm::ConstantInt::get(i32, 0), BB);
+                auto* injecting = builder.CreateICmpSGT(builder.CreateLoad(nlex_injected_length),
+                    llvm::ConstantInt::get(i32, 0));
+                auto* before = builder.CreateLoad(nlex_fed_string);
+                builder.CreateCall(advance);
+                auto* c = builder.CreateLoad(nlex_tmp_char);
+                auto* offset = builder.CreateSelect(injecting, prev_offset,
+                    builder.CreateTrunc(builder.CreatePtrDiff(before, input), i32));
+                auto* next = builder.CreateNSWAdd(i, llvm::ConstantInt::get(i64, 1));
+                // leave room for the end offset at `next'
+                auto* cap = builder.CreateLoad(nlex_normalised_cap);
+                builder.CreateCondBr(builder.CreateICmpULT(next, cap), storeBB, growBB);
+
+                builder.SetInsertPoint(growBB);
+                auto* new_cap = builder.CreateSelect(
+                    builder.CreateICmpEQ(cap, llvm::ConstantInt::get(i64, 0)),
+                    llvm::ConstantInt::get(i64, 65536),
+                    builder.CreateShl(cap, llvm::ConstantInt::get(i64, 1)));
+                auto* buffer = builder.CreateCall(realloc_fn, { builder.CreateLoad(nlex_normalised), new_cap });
+                auto* offsets = builder.CreateCall(realloc_fn,
+                    { builder.CreateBitCast(builder.CreateLoad(nlex_normalised_offsets), i8p),
+                        builder.CreateShl(new_cap, llvm::ConstantInt::get(i64, 2)) });
+                builder.CreateCondBr(
+                    builder.CreateOr(builder.CreateIsNull(buffer), builder.CreateIsNull(offsets)),
+                    failBB, grownBB);
+
+                // rather than lex a truncated input
+                builder.SetInsertPoint(failBB);
+                const std::string message = "nlex: out of memory normalising the input\n";
+                builder.CreateCall(write_fn,
+                    { llvm::ConstantInt::get(i32, 2), builder.CreateGlobalStringPtr(message),
+                        llvm::ConstantInt::get(i64, message.size()) });
+                builder.CreateCall(abort_fn);
+                builder.CreateUnreachable();
+
+                builder.SetInsertPoint(grownBB);
+                builder.CreateStore(buffer, nlex_normalised);
+                builder.CreateStore(builder.CreateBitCast(offsets, nlex_normalised_offsets->getValueType()),
+                    nlex_normalised_offsets);
+                builder.CreateStore(new_cap, nlex_normalised_cap);
+                builder.CreateBr(storeBB);
+
+                builder.SetInsertPoint(storeBB);
+                builder.CreateStore(c, builder.CreateInBoundsGEP(builder.CreateLoad(nlex_normalised), { i }));
+                builder.CreateStore(offset, builder.CreateInBoundsGEP(builder.CreateLoad(nlex_normalised_offsets), { i }));
+                i->addIncoming(next, storeBB);
+                prev_offset->addIncoming(offset, storeBB);
+                // stop at the terminator
+                builder.CreateCondBr(builder.CreateICmpEQ(c, llvm::ConstantInt::get(i8, 0)), doneBB, loopBB);
+
+                builder.SetInsertPoint(doneBB);
+                builder.CreateStore(
+                    builder.CreateTrunc(builder.CreatePtrDiff(builder.CreateLoad(nlex_fed_string), input), i32),
+                    builder.CreateInBoundsGEP(builder.CreateLoad(nlex_normalised_offsets), { next }));
+                auto* start = builder.CreateLoad(nlex_normalised);
+                builder.CreateStore(start, nlex_fed_string);
+                builder.CreateStore(start, nlex_true_start);
+                builder.CreateStore(llvm::ConstantInt::get(i32, 0), nlex_injected_length);
+                builder.CreateStore(llvm::ConstantInt::get(i32, 0), nlex_injected_length_diff);
+            }
             builder.CreateRetVoid();
 
             // nlex_next - advance character position
-            BB = llvm::BasicBlock::Create(module.TheContext, "", module.nlex_next);
+            BB = llvm::BasicBlock::Create(module.TheContext, "", advance);
             auto* uBB = llvm::BasicBlock::Create(module.TheContext, "has_inject",
-                module.nlex_next);
+                advance);
             auto* pBB = llvm::BasicBlock::Create(module.TheContext, "no_inject",
-                module.nlex_next);
+                advance);
             builder.SetInsertPoint(BB);
             auto len = builder.CreateLoad(nlex_injected_length);
             builder.CreateCondBr(
@@ -1168,7 +1702,7 @@ public:
             ::std::map<std::string, llvm::SwitchInst*> levels;
             llvm::IRBuilder<> mbuilder(module.TheContext);
             auto BBend = llvm::BasicBlock::Create(module.TheContext, "default_escape",
-                module.nlex_next);
+                advance);
             // create normalisation logic
             {
                 if (lexer_stuff.normalisations.size() == 0)
@@ -1232,7 +1766,7 @@ public:
                                 sw = mbuilder.CreateSwitch(cvv, BBend);
                             }
                             auto cBB = llvm::BasicBlock::Create(
-                                module.TheContext, norm.substr(0, i), module.nlex_next);
+                                module.TheContext, norm.substr(0, i), advance);
                             sw->addCase(
                                 llvm::ConstantInt::get(
                                     llvm::Type::getInt8Ty(module.TheContext), (int)norm[i]),
@@ -1248,7 +1782,7 @@ public:
                             auto ci = sw->findCaseValue(val);
                             if (ci == sw->case_default()) {
                                 cBB = llvm::BasicBlock::Create(
-                                    module.TheContext, norm.substr(0, i), module.nlex_next);
+                                    module.TheContext, norm.substr(0, i), advance);
                                 sw->addCase(val, cBB);
                             } else
                                 cBB = sw->getSuccessor(ci->getSuccessorIndex());
@@ -1257,6 +1791,18 @@ public:
                     }
                 }
             }
+            if (normalise_ahead) {
+                // the input is already normalised, just step through it
+                BB = llvm::BasicBlock::Create(module.TheContext, "", module.nlex_next);
+                builder.SetInsertPoint(BB);
+                auto fs = builder.CreateLoad(nlex_fed_string);
+                builder.CreateStore(
+                    builder.CreateInBoundsGEP(
+                        fs, { llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 1) }),
+                    nlex_fed_string);
+                builder.CreateStore(builder.CreateLoad(fs), nlex_tmp_char);
+                builder.CreateRetVoid();
+            }
 
             // nlex_start - return the true start of the fed string
             BB = llvm::BasicBlock::Create(module.TheContext, "", module.nlex_start);
@@ -1317,6 +1863,85 @@ public:
             phi->addIncoming(sel, _8);
             builder.CreateRet(phi);
         }
+        // on a failed match, skip ahead to the next byte that can start a token
+        // (see emit_resync) and report the skipped run as a single token
+        if (get(lexer_stuff.options, "skip_on_error")) {
+            auto i8p = llvm::Type::getInt8PtrTy(module.TheContext);
+            module.nlex_resync = llvm::Function::Create(
+                llvm::FunctionType::get(i8p, { i8p }, false),
+                llvm::Function::InternalLinkage, "__nlex_resync",
+                module.TheModule.get());
+
+            // normalised sequences and literals may also start a token
+            for (auto& [src, _] : lexer_stuff.normalisations)
+                if (src.size())
+                    resync_bytes.set((unsigned char)src[0]);
+            for (auto& [_, values] : lexer_stuff.literal_tags)
+                for (auto& value : values)
+                    if (value.size())
+                        resync_bytes.set((unsigned char)value[0]);
+
+            auto* escape_top = module.BBfinalise;
+            auto* bbF = escape_top->getTerminator()->getSuccessor(0);
+            escape_top->getTerminator()->eraseFromParent();
+
+            auto* checkBB = llvm::BasicBlock::Create(module.TheContext, "_escape_check",
+                module.main());
+            auto* resyncBB = llvm::BasicBlock::Create(module.TheContext, "_escape_resync",
+                module.main());
+            llvm::IRBuilder<> builder { module.TheContext };
+            module.emitLocation((DFANode<NFANode<std::nullptr_t>*>*)NULL, builder);
+            builder.SetInsertPoint(escape_top);
+            builder.CreateCondBr(builder.CreateLoad(module.anything_matched), bbF,
+                checkBB);
+
+            // nothing to skip at the end of input
+            builder.SetInsertPoint(checkBB);
+            auto start = builder.CreateLoad(module.nlex_match_start);
+            builder.CreateCondBr(
+                builder.CreateICmpEQ(
+                    builder.CreateLoad(start),
+                    llvm::ConstantInt::get(llvm::Type::getInt8Ty(module.TheContext), 0)),
+                bbF, resyncBB);
+
+            builder.SetInsertPoint(resyncBB);
+            auto next = builder.CreateCall(
+                module.nlex_resync,
+                { builder.CreateInBoundsGEP(
+                    start,
+                    { llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 1) }) });
+            builder.CreateCall(module.nlex_restore, { next });
+
+            auto istruct = module.main()->arg_begin();
+            auto field = [&](int i) {
+                return builder.CreateInBoundsGEP(
+                    istruct,
+                    { llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), 0),
+                        llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), i) });
+            };
+            // the token points straight into the input, it is not copied
+            builder.CreateStore(start, field(0));
+            builder.CreateStore(
+                builder.CreateTrunc(builder.CreatePtrDiff(next, start),
+                    llvm::Type::getInt32Ty(module.TheContext)),
+                field(1));
+            builder.CreateStore(get_or_create_tag("<Skipped>"), field(2));
+            builder.CreateStore(
+                llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext), tag_ids["<Skipped>"]),
+                field(6));
+            // the run matched nothing, but still has its length
+            builder.CreateStore(
+                llvm::ConstantInt::get(llvm::Type::getInt8Ty(module.TheContext), NLEX_ERRC_SKIPPED),
+                field(3));
+            // metadata bit 2 and nothing else: a skipped run is no stopword
+            // either (begin()'s _escape clears the bit again for later tokens)
+            builder.CreateStore(
+                llvm::ConstantInt::get(llvm::Type::getInt8Ty(module.TheContext), 4),
+                field(4));
+            builder.CreateRetVoid();
+            // so the POS tagger sees the run too (and hands it out in order)
+            module.exit_blocks.push_back(resyncBB);
+        }
         // Create a stopword remover if any stopwords are present
         if (lexer_stuff.stopwords.size() > 0) {
             auto isstopword = module.createGlobal(llvm::Type::getInt1Ty(module.TheContext),
@@ -1457,6 +2082,82 @@ public:
             builder.CreateBr(prev_fbb);
             module.BBfinalise = fbb;
         }
+        // `option emit_tags [...]` and `option count_only`: decide by the tag
+        // id before anything else looks at the token, others are dropped here
+        // (counted first with count_only) and the next token is matched
+        auto emit_tags = lexer_stuff.option_lists.find("emit_tags");
+        bool count_only = get(lexer_stuff.options, "count_only");
+        if (emit_tags != lexer_stuff.option_lists.end() || count_only) {
+            auto& ctx = module.TheContext;
+            auto* i8 = llvm::Type::getInt8Ty(ctx);
+            auto* i32 = llvm::Type::getInt32Ty(ctx);
+            auto* i64 = llvm::Type::getInt64Ty(ctx);
+            auto* fbb = llvm::BasicBlock::Create(ctx, "_emit_tags_res", module.main());
+            auto* matchedbb = llvm::BasicBlock::Create(ctx, "_emit_tags_matched", module.main());
+            auto* emitbb = llvm::BasicBlock::Create(ctx, "_emit_tags_emit", module.main());
+            auto* dropbb = llvm::BasicBlock::Create(ctx, "_emit_tags_drop", module.main());
+            auto* nextbb = llvm::BasicBlock::Create(ctx, "_emit_tags_next", module.main());
+            auto* endbb = llvm::BasicBlock::Create(ctx, "_emit_tags_end", module.main());
+            auto* prev_fbb = module.BBfinalise;
+            llvm::IRBuilder<> builder { ctx };
+            module.emitLocation((DFANode<NFANode<std::nullptr_t>*>*)NULL, builder);
+
+            // failures go on as they are, the tag is only set on a match
+            builder.SetInsertPoint(fbb);
+            builder.CreateCondBr(
+                builder.CreateICmpEQ(builder.CreateLoad(module.nlex_errc), llvm::ConstantInt::get(i8, 0)),
+                matchedbb, prev_fbb);
+
+            // the id sits in front of the tag (see mk_tag_string)
+            builder.SetInsertPoint(matchedbb);
+            auto* id = builder.CreateLoad(builder.CreateBitCast(
+                builder.CreateInBoundsGEP(builder.CreateLoad(module.last_tag),
+                    { llvm::ConstantInt::get(i32, -4) }),
+                llvm::Type::getInt32PtrTy(ctx)));
+            if (emit_tags != lexer_stuff.option_lists.end()) {
+                auto* sw = builder.CreateSwitch(id, dropbb, emit_tags->second.size());
+                for (auto& tag : emit_tags->second) {
+                    if (!tag_ids.count(tag)) {
+                        slts.show(Display::Type::WARNING,
+                            "emit_tags: there is no rule named '{<magenta>}%s{<clean>}'\n",
+                            tag.c_str());
+                        continue;
+                    }
+                    sw->addCase(llvm::ConstantInt::get(i32, tag_ids[tag]), emitbb);
+                }
+            } else
+                builder.CreateBr(emitbb);
+
+            builder.SetInsertPoint(emitbb);
+            if (count_only) {
+                auto counts_type = llvm::ArrayType::get(i64, tag_ids.size() + 1);
+                auto* counts = module.createGlobal(counts_type,
+                    llvm::Constant::getNullValue(counts_type), "__nlex_tag_counts", true);
+                auto* count = builder.CreateInBoundsGEP(counts, { llvm::ConstantInt::get(i32, 0), id });
+                builder.CreateStore(
+                    builder.CreateAdd(builder.CreateLoad(count), llvm::ConstantInt::get(i64, 1)), count);
+                builder.CreateBr(dropbb);
+            } else
+                builder.CreateBr(prev_fbb);
+
+            // match the next token, unless the input is over
+            builder.SetInsertPoint(dropbb);
+            builder.CreateCondBr(
+                builder.CreateICmpEQ(builder.CreateCall(module.nlex_current_f), llvm::ConstantInt::get(i8, 0)),
+                endbb, nextbb);
+            // dropping tokens must not grow the stack
+            builder.SetInsertPoint(nextbb);
+            builder.CreateCall(module.main(), { module.main()->arg_begin() })
+                ->setTailCallKind(llvm::CallInst::TCK_MustTail);
+            builder.CreateRetVoid();
+
+            // which leaves an empty token with no tag
+            builder.SetInsertPoint(endbb);
+            builder.CreateStore(llvm::ConstantInt::get(i32, 0), module.token_length);
+            builder.CreateStore(get_or_create_tag(""), module.last_tag);
+            builder.CreateBr(prev_fbb);
+            module.BBfinalise = fbb;
+        }
         // add a function that just reads the input and writes the normalised form
         // out
         if (get(lexer_stuff.options, "pure_normaliser")) {
@@ -1472,6 +2173,208 @@ public:
             fbuilder.SetInsertPoint(entry);
             fbuilder.CreateCall(module.nlex_next);
             fbuilder.CreateRet(fbuilder.CreateCall(module.nlex_current_f));
+
+            // size_t __nlex_pure_normalise_buf(const char *in, size_t n, char *out, size_t cap,
+            //                                  size_t *consumed)
+            // normalises a whole buffer, returning the number of bytes written,
+            // and how much of the input that covers in `consumed' (if not NULL).
+            // Spans without any byte that can start a normalisation are copied
+            // 16 bytes at a time, everything else goes through the normaliser.
+            // Stops at a zero byte, or before an expansion that doesn't fit in
+            // `cap', and leaves the lexer (its position, and any expansion it
+            // is in) as it was. The normaliser never reads past `in + n': near
+            // the end, it runs on a copy of the tail.
+            auto& ctx = module.TheContext;
+            auto* i8 = llvm::Type::getInt8Ty(ctx);
+            auto* i32 = llvm::Type::getInt32Ty(ctx);
+            auto* i64 = llvm::Type::getInt64Ty(ctx);
+            auto* i8p = llvm::Type::getInt8PtrTy(ctx);
+            auto* buf_normalise = llvm::Function::Create(
+                llvm::FunctionType::get(i64, { i8p, i64, i8p, i64, llvm::PointerType::get(i64, 0) }, false),
+                llvm::Function::ExternalLinkage, "__nlex_pure_normalise_buf",
+                module.TheModule.get());
+            auto args = buf_normalise->arg_begin();
+            llvm::Value *in = args++, *n = args++, *out = args++, *cap = args++, *consumed = args;
+
+            std::bitset<256> triggers;
+            triggers.set(0);
+            // the normaliser looks at most this far ahead
+            size_t longest = 1;
+            for (auto& [src, _] : lexer_stuff.normalisations)
+                if (src.size()) {
+                    triggers.set((unsigned char)src[0]);
+                    longest = std::max(longest, src.size());
+                }
+            auto ranges = byte_ranges(triggers);
+            auto* vty = byte_vector_type(ctx);
+            auto* fed_string = module.nlex_fed_string;
+            auto* injected_length = module.nlex_injected_length;
+            auto* tmp_char = module.nlex_tmp_char;
+
+            entry = llvm::BasicBlock::Create(ctx, "", buf_normalise);
+            auto* loop = llvm::BasicBlock::Create(ctx, "loop", buf_normalise);
+            auto* vcheck = llvm::BasicBlock::Create(ctx, "vector", buf_normalise);
+            auto* vcopy = llvm::BasicBlock::Create(ctx, "vector_copy", buf_normalise);
+            auto* vpartial = llvm::BasicBlock::Create(ctx, "vector_partial", buf_normalise);
+            auto* scheck = llvm::BasicBlock::Create(ctx, "scalar_check", buf_normalise);
+            auto* scalar = llvm::BasicBlock::Create(ctx, "scalar", buf_normalise);
+            auto* tail = llvm::BasicBlock::Create(ctx, "tail", buf_normalise);
+            auto* run = llvm::BasicBlock::Create(ctx, "run", buf_normalise);
+            auto* room = llvm::BasicBlock::Create(ctx, "room", buf_normalise);
+            auto* emit = llvm::BasicBlock::Create(ctx, "emit", buf_normalise);
+            auto* inject = llvm::BasicBlock::Create(ctx, "inject", buf_normalise);
+            auto* advanced = llvm::BasicBlock::Create(ctx, "advanced", buf_normalise);
+            auto* done = llvm::BasicBlock::Create(ctx, "done", buf_normalise);
+            auto* report = llvm::BasicBlock::Create(ctx, "report", buf_normalise);
+            auto* ret = llvm::BasicBlock::Create(ctx, "return", buf_normalise);
+            auto zero = llvm::ConstantInt::get(i64, 0);
+            auto sixteen = llvm::ConstantInt::get(i64, 16);
+            auto* M = module.TheModule.get();
+            auto libc = [&](const char* name, llvm::FunctionType* type) {
+                if (auto* fn = M->getFunction(name))
+                    return fn;
+                return llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, M);
+            };
+            auto* memcpy_fn = libc("memcpy", llvm::FunctionType::get(i8p, { i8p, i8p, i64 }, false));
+            auto* memset_fn = libc("memset", llvm::FunctionType::get(i8p, { i8p, i32, i64 }, false));
+
+            fbuilder.SetInsertPoint(entry);
+            // the lexer can be in the middle of an expansion, or have a
+            // character pending, when this is called; leave all of it as it was
+            std::vector<std::pair<llvm::GlobalVariable*, llvm::Value*>> saved;
+            for (auto* state : { fed_string, module.nlex_injected, injected_length,
+                     module.nlex_injected_length_diff, tmp_char })
+                saved.emplace_back(state, fbuilder.CreateLoad(state));
+            // the tail of the input, zero-terminated
+            auto* scratch = fbuilder.CreateBitCast(
+                fbuilder.CreateAlloca(llvm::ArrayType::get(i8, longest + 1)), i8p);
+            fbuilder.CreateBr(loop);
+
+            fbuilder.SetInsertPoint(loop);
+            auto* i = fbuilder.CreatePHI(i64, 4);
+            auto* o = fbuilder.CreatePHI(i64, 4);
+            i->addIncoming(zero, entry);
+            o->addIncoming(zero, entry);
+            fbuilder.CreateCondBr(
+                fbuilder.CreateAnd(
+                    fbuilder.CreateICmpULE(fbuilder.CreateAdd(i, sixteen), n),
+                    fbuilder.CreateICmpULE(fbuilder.CreateAdd(o, sixteen), cap)),
+                vcheck, scheck);
+
+            // copy everything up to the first trigger byte
+            fbuilder.SetInsertPoint(vcheck);
+            auto* v = fbuilder.CreateAlignedLoad(
+                fbuilder.CreateBitCast(fbuilder.CreateInBoundsGEP(in, { i }),
+                    llvm::PointerType::get(vty, 0)),
+#if LLVM_VERSION_MAJOR > 9
+                llvm::MaybeAlign(1)
+#else
+                1
+#endif
+            );
+            fbuilder.CreateAlignedStore(v,
+                fbuilder.CreateBitCast(fbuilder.CreateInBoundsGEP(out, { o }),
+                    llvm::PointerType::get(vty, 0)),
+#if LLVM_VERSION_MAJOR > 9
+                llvm::MaybeAlign(1)
+#else
+                1
+#endif
+            );
+            auto* bits = vector_in_set(fbuilder, v, ranges);
+            fbuilder.CreateCondBr(fbuilder.CreateICmpEQ(bits, llvm::ConstantInt::get(bits->getType(), 0)),
+                vcopy, vpartial);
+
+            fbuilder.SetInsertPoint(vcopy);
+            i->addIncoming(fbuilder.CreateAdd(i, sixteen), vcopy);
+            o->addIncoming(fbuilder.CreateAdd(o, sixteen), vcopy);
+            fbuilder.CreateBr(loop);
+
+            // the bytes after the trigger were stored too, but get overwritten
+            fbuilder.SetInsertPoint(vpartial);
+            auto* skip = fbuilder.CreateZExt(
+                fbuilder.CreateBinaryIntrinsic(llvm::Intrinsic::cttz, bits,
+                    llvm::ConstantInt::getTrue(ctx)),
+                i64);
+            auto* vi = fbuilder.CreateAdd(i, skip);
+            auto* vo = fbuilder.CreateAdd(o, skip);
+            fbuilder.CreateBr(scheck);
+
+            fbuilder.SetInsertPoint(scheck);
+            auto* si = fbuilder.CreatePHI(i64, 2);
+            auto* so = fbuilder.CreatePHI(i64, 2);
+            si->addIncoming(i, loop);
+            so->addIncoming(o, loop);
+            si->addIncoming(vi, vpartial);
+            so->addIncoming(vo, vpartial);
+            fbuilder.CreateCondBr(
+                fbuilder.CreateOr(fbuilder.CreateICmpUGE(si, n),
+                    fbuilder.CreateICmpUGE(so, cap)),
+                done, scalar);
+
+            // run the normaliser on this position, or on a copy of the rest
+            // of the input if a normalisation could run past its end
+            fbuilder.SetInsertPoint(scalar);
+            auto* left = fbuilder.CreateSub(n, si);
+            auto* here = fbuilder.CreateInBoundsGEP(in, { si });
+            fbuilder.CreateCondBr(fbuilder.CreateICmpULE(left, llvm::ConstantInt::get(i64, longest)),
+                tail, run);
+
+            fbuilder.SetInsertPoint(tail);
+            fbuilder.CreateCall(memset_fn,
+                { scratch, llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i64, longest + 1) });
+            fbuilder.CreateCall(memcpy_fn, { scratch, here, left });
+            fbuilder.CreateBr(run);
+
+            fbuilder.SetInsertPoint(run);
+            auto* base = fbuilder.CreatePHI(i8p, 2);
+            base->addIncoming(here, scalar);
+            base->addIncoming(scratch, tail);
+            fbuilder.CreateStore(base, fed_string);
+            fbuilder.CreateStore(llvm::ConstantInt::get(i32, 0), injected_length);
+            fbuilder.CreateBr(inject);
+
+            // emit the produced byte, and any bytes the expansion injected; an
+            // expansion that doesn't fit is left out whole
+            fbuilder.SetInsertPoint(inject);
+            auto* io = fbuilder.CreatePHI(i64, 2);
+            io->addIncoming(so, run);
+            fbuilder.CreateCall(module.nlex_normalise_step);
+            auto* c = fbuilder.CreateLoad(tmp_char);
+            fbuilder.CreateCondBr(fbuilder.CreateICmpEQ(c, llvm::ConstantInt::get(i8, 0)),
+                done, room);
+
+            fbuilder.SetInsertPoint(room);
+            fbuilder.CreateCondBr(fbuilder.CreateICmpULT(io, cap), emit, done);
+
+            fbuilder.SetInsertPoint(emit);
+            fbuilder.CreateStore(c, fbuilder.CreateInBoundsGEP(out, { io }));
+            auto* ion = fbuilder.CreateAdd(io, llvm::ConstantInt::get(i64, 1));
+            io->addIncoming(ion, emit);
+            fbuilder.CreateCondBr(
+                fbuilder.CreateICmpSGT(fbuilder.CreateLoad(injected_length),
+                    llvm::ConstantInt::get(i32, 0)),
+                inject, advanced);
+
+            fbuilder.SetInsertPoint(advanced);
+            i->addIncoming(fbuilder.CreateAdd(si,
+                               fbuilder.CreatePtrDiff(fbuilder.CreateLoad(fed_string), base)),
+                advanced);
+            o->addIncoming(ion, advanced);
+            fbuilder.CreateBr(loop);
+
+            // everything before (si, so) is done
+            fbuilder.SetInsertPoint(done);
+            for (auto [state, value] : saved)
+                fbuilder.CreateStore(value, state);
+            fbuilder.CreateCondBr(fbuilder.CreateIsNull(consumed), ret, report);
+
+            fbuilder.SetInsertPoint(report);
+            fbuilder.CreateStore(si, consumed);
+            fbuilder.CreateBr(ret);
+
+            fbuilder.SetInsertPoint(ret);
+            fbuilder.CreateRet(so);
         }
         // handle all literally tagged values
         if (lexer_stuff.literal_tags.size() > 0) {
@@ -1602,7 +2505,7 @@ public:
         if (lexer_stuff.kdefines.size() > 0) {
             llvm::IRBuilder<> builder(module.TheContext);
             for (auto& kdef : lexer_stuff.kdefines) {
-                KaleidCompile(kdef, builder, true);
+                kaleid.compile(kdef, builder, true);
             }
         }
         // likely to be replaced at link-time with a separate module
@@ -1635,14 +2538,71 @@ public:
                     llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
                         lexer_stuff.tagpos->gram),
                     "__nlex_tagpos_gram", true);
-                std::string postag_data = nlex::POSTag::train(lexer_stuff.tagpos->from);
-                auto* data = mk_string(module.TheModule.get(), module.TheContext,
-                    postag_data, "__nlex_postag_data");
+                // tags are decided while tokens are generated, with at most
+                // this many words left undecided
+                auto postag_lookahead = get(lexer_stuff.option_values, "postag_lookahead");
+                module.createGlobal(
+                    llvm::Type::getInt32Ty(module.TheContext),
+                    llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
+                        postag_lookahead > 0 ? postag_lookahead : 32),
+                    "__nlex_postag_lookahead", true);
+                // and sentences are cut after this many words (0 = never)
+                auto postag_max_sentence = lexer_stuff.option_values.count("postag_max_sentence")
+                    ? std::max(get(lexer_stuff.option_values, "postag_max_sentence"), 0)
+                    : 1024;
                 module.createGlobal(
                     llvm::Type::getInt32Ty(module.TheContext),
                     llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
-                        postag_data.size()),
-                    "__nlex_postag_data_length", true);
+                        postag_max_sentence),
+                    "__nlex_postag_max_sentence", true);
+                // the states of a trigram model are pairs of tags, only this
+                // many are kept in each column
+                auto postag_beam = get(lexer_stuff.option_values, "postag_beam");
+                module.createGlobal(
+                    llvm::Type::getInt32Ty(module.TheContext),
+                    llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
+                        postag_beam > 0 ? postag_beam : 64),
+                    "__nlex_postag_beam", true);
+                std::string postag_data = nlex::POSTag::train(
+                    lexer_stuff.tagpos->from, lexer_stuff.tagpos->gram);
+                if (get(lexer_stuff.options, "postag_specialise")) {
+                    nlex::POSTag::ModelView model;
+                    nlex::POSTag::PerfectHash hash;
+                    model.open(postag_data.data(), postag_data.size());
+                    // see MAX_STRIDE in postag.inc.c
+                    if (model.valid() && model.order() < 3 && model.tag_count() > 0
+                        && model.tag_count() <= 256
+                        && nlex::POSTag::make_perfect_hash(model, hash))
+                        emit_postag_specialised(model, hash);
+                    else
+                        slts.show(Display::Type::WARNING,
+                            "postag_specialise is ignored for trigram models, models with "
+                            "more than 256 tags, or vocabularies with colliding hashes\n");
+                }
+                if (!module.postag_specialised) {
+                    mk_string(module.TheModule.get(), module.TheContext,
+                        postag_data, "__nlex_postag_data");
+                    // the compiled model is read in place, keep its sections aligned
+                    module.TheModule->getNamedGlobal("__nlex_postag_data")
+#if LLVM_VERSION_MAJOR > 9
+                        ->setAlignment(llvm::MaybeAlign(32));
+#else
+                        ->setAlignment(32);
+#endif
+                    module.createGlobal(
+                        llvm::Type::getInt32Ty(module.TheContext),
+                        llvm::ConstantInt::get(llvm::Type::getInt32Ty(module.TheContext),
+                            postag_data.size()),
+                        "__nlex_postag_data_length", true);
+                }
+                if (postag_model_file_name != "") {
+                    std::ofstream model_file { postag_model_file_name, std::ios::binary };
+                    model_file << postag_data;
+                    if (!model_file)
+                        slts.show(Display::Type::ERROR,
+                            "failed to write the POS model to '{<magenta>}%s{<clean>}'",
+                            postag_model_file_name.c_str());
+                }
 
                 module.nlex_apply_postag = module.mkfunc(true, "__nlex_apply_postag", false, false, true);
                 module.postag_applies = true;
@@ -1674,6 +2634,366 @@ public:
             module.backtrackBB = vref[0];
             module.backtrackExitBB = vref[1];
         }
+        if (header_file_name != "")
+            write_header(lexer_stuff);
+    }
+    /// Split a byte set into inclusive [lo, hi] ranges
+    static std::vector<std::pair<int, int>> byte_ranges(const std::bitset<256>& set)
+    {
+        std::vector<std::pair<int, int>> ranges;
+        for (int c = 0; c < 256; c++) {
+            if (!set.test(c))
+                continue;
+            if (ranges.size() && ranges.back().second == c - 1)
+                ranges.back().second = c;
+            else
+                ranges.push_back({ c, c });
+        }
+        return ranges;
+    }
+    /// Test all bytes of a <16 x i8> against a set of byte ranges, returns an
+    /// i16 mask with bit i set if byte i is in the set
+    llvm::Value* vector_in_set(llvm::IRBuilder<>& builder, llvm::Value* v,
+        const std::vector<std::pair<int, int>>& ranges)
+    {
+        auto* i8 = llvm::Type::getInt8Ty(module.TheContext);
+        llvm::Value* match = nullptr;
+        for (auto [lo, hi] : ranges) {
+            // lo <= v <= hi  <=>  (v - lo) <=u (hi - lo)
+            auto* m = builder.CreateICmpULE(
+                builder.CreateSub(v, builder.CreateVectorSplat(16, llvm::ConstantInt::get(i8, lo))),
+                builder.CreateVectorSplat(16, llvm::ConstantInt::get(i8, hi - lo)));
+            match = match ? builder.CreateOr(match, m) : m;
+        }
+        return builder.CreateBitCast(match, llvm::Type::getInt16Ty(module.TheContext));
+    }
+    static llvm::Type* byte_vector_type(llvm::LLVMContext& ctx)
+    {
+#if LLVM_VERSION_MAJOR > 10
+        return llvm::FixedVectorType::get(llvm::Type::getInt8Ty(ctx), 16);
+#else
+        return llvm::VectorType::get(llvm::Type::getInt8Ty(ctx), 16);
+#endif
+    }
+
+    /// Run the DFA in `table' as a loop over its transition table, instead of
+    /// a block per state (see DFATable). Keeps the longest match like the
+    /// generated states do, and returns the block that starts it
+    llvm::BasicBlock* emit_table_dfa(const DFATable& table)
+    {
+        auto& ctx = module.TheContext;
+        auto& B = module.Builder;
+        auto* fn = module.current_main();
+        auto* i1 = llvm::Type::getInt1Ty(ctx);
+        auto* i8 = llvm::Type::getInt8Ty(ctx);
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto* i8p = llvm::Type::getInt8PtrTy(ctx);
+        auto states = table.tags.size();
+
+        auto global = [&](llvm::Type* type, const std::vector<llvm::Constant*>& values, const char* name) {
+            auto* arrty = llvm::ArrayType::get(type, values.size());
+            auto* GV = module.createGlobal(arrty, llvm::ConstantArray::get(arrty, values), name);
+            GV->setConstant(true);
+            return GV;
+        };
+        auto element = [&](llvm::Value* table, llvm::Value* index) {
+            return B.CreateLoad(B.CreateInBoundsGEP(table,
+                { llvm::ConstantInt::get(i32, 0), B.CreateZExt(index, i32) }));
+        };
+        auto array = [&](llvm::Type* type, const auto& cells, const char* name) {
+            std::vector<llvm::Constant*> values;
+            for (auto cell : cells)
+                values.push_back(llvm::ConstantInt::get(type, cell));
+            return global(type, values, name);
+        };
+        // 16-bit cells, unless there are too many states
+        auto* cellty = (states + 1) * 2 <= 0xffff ? llvm::Type::getInt16Ty(ctx) : i32;
+        int width = cellty == i32 ? 4 : 2;
+
+        auto compression = TableCompression::Classes;
+        if (table_compression == "full")
+            compression = TableCompression::Full;
+        else if (table_compression == "comb")
+            compression = TableCompression::Comb;
+        else if (table_compression == "sparse")
+            compression = TableCompression::Sparse;
+        auto packed = table;
+        packed.compress();
+        auto used = [&](TableCompression scheme) { return scheme == compression ? " (used)" : ""; };
+        slts.show(Display::Type::INFO, "table backend: %d states, %d byte classes",
+            (int)states, table.classes);
+        slts.show(Display::Type::INFO, "  full:    %d bytes, 1 read per byte%s",
+            (int)(states * 256 * width), used(TableCompression::Full));
+        slts.show(Display::Type::INFO, "  classes: %d bytes, 2 reads per byte%s",
+            (int)(256 + table.next.size() * width), used(TableCompression::Classes));
+        slts.show(Display::Type::INFO, "  comb:    %d bytes, 4 reads per byte%s",
+            (int)(256 + states * (4 + width) + packed.comb_next.size() * 2 * width),
+            used(TableCompression::Comb));
+        slts.show(Display::Type::INFO, "  sparse:  %d bytes, %.1f reads per byte%s",
+            (int)(256 + states * width + (states + 1) * 4 + packed.sparse_class.size() * (1 + width)),
+            packed.sparse_lookups(), used(TableCompression::Sparse));
+
+        llvm::GlobalVariable *classes = nullptr, *next = nullptr, *fallback = nullptr,
+                             *base = nullptr, *check = nullptr, *offsets = nullptr,
+                             *entry_class = nullptr;
+        if (compression != TableCompression::Full)
+            classes = array(i8, table.byte_class, "nlex_table_class");
+        switch (compression) {
+        case TableCompression::Full: {
+            std::vector<uint32_t> cells;
+            for (auto s = 0; s < (int)states; ++s)
+                for (auto c : table.byte_class)
+                    cells.push_back(table.cell(s, c));
+            next = array(cellty, cells, "nlex_table_next");
+            break;
+        }
+        case TableCompression::Classes:
+            next = array(cellty, table.next, "nlex_table_next");
+            break;
+        case TableCompression::Comb:
+            fallback = array(cellty, packed.fallback, "nlex_table_fallback");
+            base = array(i32, packed.base, "nlex_table_base");
+            next = array(cellty, packed.comb_next, "nlex_table_next");
+            check = array(cellty, packed.comb_check, "nlex_table_check");
+            break;
+        case TableCompression::Sparse:
+            fallback = array(cellty, packed.fallback, "nlex_table_fallback");
+            offsets = array(i32, packed.offsets, "nlex_table_offsets");
+            entry_class = array(i8, packed.sparse_class, "nlex_table_entry_class");
+            next = array(cellty, packed.sparse_cell, "nlex_table_next");
+            break;
+        }
+        std::vector<llvm::Constant*> values;
+        bool unknown_states = false;
+        for (auto& tag : table.tags) {
+            unknown_states |= tag == "<Unknown State>";
+            values.push_back(tag == ""
+                    ? llvm::Constant::getNullValue(i8p)
+                    : llvm::cast<llvm::Constant>(get_or_create_tag(tag)));
+        }
+        auto* tags = global(i8p, values, "nlex_table_tag");
+
+        // the token length at the last final state
+        auto* final_length = createEntryBlockAlloca(fn, "lfinal_length", i32);
+        auto* entry = llvm::BasicBlock::Create(ctx, "table_dfa", fn);
+        auto* state_bb = llvm::BasicBlock::Create(ctx, "table_state", fn);
+        auto* accept = llvm::BasicBlock::Create(ctx, "table_accept", fn);
+        auto* step = llvm::BasicBlock::Create(ctx, "table_step", fn);
+        auto* take = llvm::BasicBlock::Create(ctx, "table_take", fn);
+        auto* codepoint = llvm::BasicBlock::Create(ctx, "table_codepoint", fn);
+        auto* codepoint_loop = llvm::BasicBlock::Create(ctx, "table_codepoint_loop", fn);
+        auto* codepoint_byte = llvm::BasicBlock::Create(ctx, "table_codepoint_byte", fn);
+        auto* dead = llvm::BasicBlock::Create(ctx, "table_dead", fn);
+        auto* dead_matched = llvm::BasicBlock::Create(ctx, "table_matched", fn);
+        auto* dead_failed = llvm::BasicBlock::Create(ctx, "table_failed", fn);
+
+        B.SetInsertPoint(entry);
+        B.CreateStore(llvm::ConstantInt::get(i32, 0), final_length);
+        B.CreateBr(state_bb);
+
+        B.SetInsertPoint(state_bb);
+        auto* state = B.CreatePHI(i32, 3, "state");
+        state->addIncoming(llvm::ConstantInt::get(i32, table.start), entry);
+        auto* tag = element(tags, state);
+        B.CreateCondBr(B.CreateICmpNE(tag, llvm::Constant::getNullValue(i8p)), accept, step);
+
+        // a final state, remember where it is
+        B.SetInsertPoint(accept);
+        B.CreateStore(llvm::ConstantInt::getTrue(i1), module.anything_matched);
+        B.CreateStore(tag, module.last_tag);
+        B.CreateStore(B.CreateCall(module.nlex_current_p), module.last_final_state_position);
+        B.CreateStore(B.CreateLoad(module.token_length), final_length);
+        B.CreateStore(unknown_states
+                ? B.CreateZExt(B.CreateICmpEQ(tag, get_or_create_tag("<Unknown State>")), i8)
+                : llvm::ConstantInt::get(i8, 0),
+            module.nlex_errc);
+        B.CreateBr(step);
+
+        B.SetInsertPoint(step);
+        B.CreateCall(module.nlex_next);
+        auto* c = B.CreateCall(module.nlex_current_f);
+        llvm::Value* cell;
+        switch (compression) {
+        case TableCompression::Full:
+            cell = element(next, B.CreateAdd(B.CreateMul(state, llvm::ConstantInt::get(i32, 256)), B.CreateZExt(c, i32)));
+            break;
+        case TableCompression::Classes:
+            cell = element(next, B.CreateAdd(B.CreateMul(state, llvm::ConstantInt::get(i32, table.classes)), element(classes, c)));
+            break;
+        case TableCompression::Comb: {
+            // the rows are padded, so any index can be read
+            auto* index = B.CreateAdd(element(base, state), B.CreateZExt(element(classes, c), i32));
+            auto* owned = B.CreateICmpEQ(B.CreateZExt(element(check, index), i32),
+                B.CreateAdd(state, llvm::ConstantInt::get(i32, 1)));
+            cell = B.CreateSelect(owned, element(next, index), element(fallback, state));
+            break;
+        }
+        case TableCompression::Sparse: {
+            auto* klass = element(classes, c);
+            auto* first = element(offsets, state);
+            auto* last = element(offsets, B.CreateAdd(state, llvm::ConstantInt::get(i32, 1)));
+            auto* from = B.GetInsertBlock();
+            auto* scan = llvm::BasicBlock::Create(ctx, "table_scan", fn);
+            auto* scan_test = llvm::BasicBlock::Create(ctx, "table_scan_test", fn);
+            auto* scan_next = llvm::BasicBlock::Create(ctx, "table_scan_next", fn);
+            auto* found = llvm::BasicBlock::Create(ctx, "table_found", fn);
+            auto* missed = llvm::BasicBlock::Create(ctx, "table_missed", fn);
+            auto* looked_up = llvm::BasicBlock::Create(ctx, "table_looked_up", fn);
+            B.CreateBr(scan);
+            B.SetInsertPoint(scan);
+            auto* i = B.CreatePHI(i32, 2);
+            i->addIncoming(first, from);
+            B.CreateCondBr(B.CreateICmpULT(i, last), scan_test, missed);
+            B.SetInsertPoint(scan_test);
+            B.CreateCondBr(B.CreateICmpEQ(element(entry_class, i), klass), found, scan_next);
+            B.SetInsertPoint(scan_next);
+            i->addIncoming(B.CreateAdd(i, llvm::ConstantInt::get(i32, 1)), scan_next);
+            B.CreateBr(scan);
+            B.SetInsertPoint(found);
+            auto* hit = element(next, i);
+            B.CreateBr(looked_up);
+            B.SetInsertPoint(missed);
+            auto* miss = element(fallback, state);
+            B.CreateBr(looked_up);
+            B.SetInsertPoint(looked_up);
+            auto* phi = B.CreatePHI(cellty, 2);
+            phi->addIncoming(hit, found);
+            phi->addIncoming(miss, missed);
+            cell = phi;
+            break;
+        }
+        }
+        cell = B.CreateZExt(cell, i32);
+        B.CreateCondBr(B.CreateICmpEQ(cell, llvm::ConstantInt::get(i32, 0)), dead, take);
+
+        B.SetInsertPoint(take);
+        module.add_value_to_token(c);
+        auto* target = B.CreateSub(B.CreateLShr(cell, 1), llvm::ConstantInt::get(i32, 1));
+        state->addIncoming(target, take);
+        B.CreateCondBr(B.CreateTrunc(cell, i1), codepoint, state_bb);
+
+        // a default transition takes the whole codepoint
+        B.SetInsertPoint(codepoint);
+        auto* more = B.CreateCall(module.nlex_get_utf8_length, { c });
+        B.CreateBr(codepoint_loop);
+        B.SetInsertPoint(codepoint_loop);
+        auto* left = B.CreatePHI(more->getType(), 2);
+        left->addIncoming(more, codepoint);
+        state->addIncoming(target, codepoint_loop);
+        B.CreateCondBr(B.CreateICmpSGT(left, llvm::ConstantInt::get(more->getType(), 0)),
+            codepoint_byte, state_bb);
+        B.SetInsertPoint(codepoint_byte);
+        B.CreateCall(module.nlex_next);
+        module.add_value_to_token(B.CreateCall(module.nlex_current_f));
+        left->addIncoming(B.CreateSub(left, llvm::ConstantInt::get(more->getType(), 1)), codepoint_byte);
+        B.CreateBr(codepoint_loop);
+
+        // no transition: go back to the last final state, or fail
+        B.SetInsertPoint(dead);
+        B.CreateCondBr(B.CreateLoad(module.anything_matched), dead_matched, dead_failed);
+        B.SetInsertPoint(dead_matched);
+        B.CreateCall(module.nlex_restore, { B.CreateLoad(module.last_final_state_position) });
+        B.CreateStore(B.CreateLoad(final_length), module.token_length);
+        B.CreateBr(module.BBfinalise);
+        B.SetInsertPoint(dead_failed);
+        B.CreateStore(llvm::ConstantInt::get(i32, 0), module.token_length);
+        B.CreateCall(module.nlex_restore, { B.CreateLoad(module.last_backtrack_branch_position) });
+        B.CreateStore(llvm::ConstantInt::get(i8, NLEX_ERRC_TABLE_DFA), module.nlex_errc);
+        B.CreateBr(module.BBfinalise);
+        return entry;
+    }
+
+    /// Generate the body of __nlex_resync, which returns the first position
+    /// at or after its argument holding a byte from `first` (or the terminating
+    /// zero).
+    /// Runs a scalar loop up to a 16-byte boundary, then tests 16 bytes at a time
+    /// against the set as a handful of byte ranges; aligned loads never cross
+    /// into the next page, so reading past the terminator is harmless.
+    void emit_resync(std::bitset<256> first)
+    {
+        auto& ctx = module.TheContext;
+        auto* fn = module.nlex_resync;
+        auto* i8 = llvm::Type::getInt8Ty(ctx);
+        auto* i64 = llvm::Type::getInt64Ty(ctx);
+
+        first |= resync_bytes;
+        first.set(0);
+
+        auto ranges = byte_ranges(first);
+        std::vector<llvm::Constant*> table;
+        for (int c = 0; c < 256; c++)
+            table.push_back(llvm::ConstantInt::get(i8, first.test(c)));
+        auto* tablety = llvm::ArrayType::get(i8, 256);
+        auto* set = module.createGlobal(tablety, llvm::ConstantArray::get(tablety, table),
+            "nlex_resync_set");
+        set->setConstant(true);
+        // too many ranges to be worth testing in a vector
+        bool vectorise = ranges.size() <= 8;
+
+        auto* entry = llvm::BasicBlock::Create(ctx, "", fn);
+        auto* scalar = llvm::BasicBlock::Create(ctx, "scalar", fn);
+        auto* scalar_next = llvm::BasicBlock::Create(ctx, "scalar_next", fn);
+        auto* found = llvm::BasicBlock::Create(ctx, "found", fn);
+        llvm::IRBuilder<> builder { ctx };
+
+        builder.SetInsertPoint(entry);
+        builder.CreateBr(scalar);
+
+        builder.SetInsertPoint(scalar);
+        auto* p = builder.CreatePHI(fn->getReturnType(), 2);
+        p->addIncoming(fn->arg_begin(), entry);
+        auto* c = builder.CreateLoad(p);
+        auto* inset = builder.CreateLoad(builder.CreateInBoundsGEP(
+            set, { llvm::ConstantInt::get(i64, 0), builder.CreateZExt(c, i64) }));
+        builder.CreateCondBr(builder.CreateICmpNE(inset, llvm::ConstantInt::get(i8, 0)),
+            found, scalar_next);
+
+        builder.SetInsertPoint(found);
+        builder.CreateRet(p);
+
+        builder.SetInsertPoint(scalar_next);
+        auto* pn = builder.CreateInBoundsGEP(p, { llvm::ConstantInt::get(i64, 1) });
+        p->addIncoming(pn, scalar_next);
+        if (!vectorise) {
+            builder.CreateBr(scalar);
+            return;
+        }
+        auto* vector = llvm::BasicBlock::Create(ctx, "vector", fn);
+        auto* vector_next = llvm::BasicBlock::Create(ctx, "vector_next", fn);
+        auto* vfound = llvm::BasicBlock::Create(ctx, "vector_found", fn);
+        builder.CreateCondBr(
+            builder.CreateICmpEQ(
+                builder.CreateAnd(builder.CreatePtrToInt(pn, i64),
+                    llvm::ConstantInt::get(i64, 15)),
+                llvm::ConstantInt::get(i64, 0)),
+            vector, scalar);
+
+        auto* vty = byte_vector_type(ctx);
+        builder.SetInsertPoint(vector);
+        auto* pv = builder.CreatePHI(fn->getReturnType(), 2);
+        pv->addIncoming(pn, scalar_next);
+        auto* v = builder.CreateAlignedLoad(
+            builder.CreateBitCast(pv, llvm::PointerType::get(vty, 0)),
+#if LLVM_VERSION_MAJOR > 9
+            llvm::MaybeAlign(16)
+#else
+            16
+#endif
+        );
+        auto* bits = vector_in_set(builder, v, ranges);
+        builder.CreateCondBr(
+            builder.CreateICmpNE(bits, llvm::ConstantInt::get(bits->getType(), 0)),
+            vfound, vector_next);
+
+        builder.SetInsertPoint(vector_next);
+        auto* pv16 = builder.CreateInBoundsGEP(pv, { llvm::ConstantInt::get(i64, 16) });
+        pv->addIncoming(pv16, vector_next);
+        builder.CreateBr(vector);
+
+        builder.SetInsertPoint(vfound);
+        auto* idx = builder.CreateBinaryIntrinsic(llvm::Intrinsic::cttz, bits,
+            llvm::ConstantInt::getTrue(ctx));
+        builder.CreateRet(builder.CreateInBoundsGEP(pv, { builder.CreateZExt(idx, i64) }));
     }
     void end(const GenLexer& lexer_stuff)
     {
@@ -1705,7 +3025,9 @@ public:
             L.linkInModule(
                 std::move(module.RTSModule)); // RTS only needed for executable build
 
-        if (lexer_stuff.tagpos.has_value()) {
+        if (lexer_stuff.tagpos.has_value() && module.postag_specialised) {
+            L.linkInModule(std::move(module.PostagModule));
+        } else if (lexer_stuff.tagpos.has_value()) {
             L.linkInModule(std::move(
                 module.DeserModule)); // Deser only needed if postag is enabled
             slts.show(Display::Type::MUST_SHOW,
@@ -1715,6 +3037,15 @@ public:
 
         L.linkInModule(std::move(module.TheModule));
 
+        emit_function_table(*Composite);
+        // under a symbol prefix, rename everything the object exports so that
+        // several lexers can be linked into one program
+        if (module.symbol_prefix != "")
+            for (auto& value : Composite->global_values())
+                if (!value.isDeclaration() && value.hasExternalLinkage()
+                    && value.getName() != "main" && value.getName() != "_DllMainCRTStartup")
+                    value.setName(prefixed_symbol(module.symbol_prefix, value.getName().str()));
+
         if (!module.debug_mode) {
             for (auto& function : Composite->functions()) {
                 module.TheFPM->run(function);
@@ -1797,8 +3128,660 @@ public:
         return (llvm::ConstantExpr::getGetElementPtr(Ty, GV, idxs, "gepi"));
     }
 
+    /// Emit the model of `option postag_specialise` as constant data, and the
+    /// parts of postag.inc.c that depend on it: __nlex_postag_word_id, a
+    /// lookup in the perfect hash of the vocabulary, and __nlex_postag_step,
+    /// one Viterbi column for exactly this many tags, 8 tags to a vector.
+    /// The vectors are spelled out, as nothing in TheFPM would form them.
+    void emit_postag_specialised(const nlex::POSTag::ModelView& model,
+        const nlex::POSTag::PerfectHash& hash)
+    {
+        llvm::IRBuilderBase::InsertPointGuard guard { module.Builder };
+        auto& B = module.Builder;
+        auto& ctx = module.TheContext;
+        auto* M = module.TheModule.get();
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto* i64 = llvm::Type::getInt64Ty(ctx);
+        auto* f32 = llvm::Type::getFloatTy(ctx);
+        auto* i8p = llvm::Type::getInt8PtrTy(ctx);
+        auto* i32p = llvm::PointerType::get(i32, 0);
+        auto* f32p = llvm::PointerType::get(f32, 0);
+        constexpr int width = 8;
+#if LLVM_VERSION_MAJOR > 10
+        auto* vfloat = llvm::FixedVectorType::get(f32, width);
+        auto* vint = llvm::FixedVectorType::get(i32, width);
+#else
+        auto* vfloat = llvm::VectorType::get(f32, width);
+        auto* vint = llvm::VectorType::get(i32, width);
+#endif
+        auto N = model.tag_count(), V = model.unknown_word();
+        auto stride = (N + width - 1) / width * width;
+        auto constant = [&](int value) { return llvm::ConstantInt::get(i32, value); };
+        auto table = [&](llvm::Constant* init, const std::string& name, bool exported) {
+            auto* GV = new llvm::GlobalVariable(*M, init->getType(), true,
+                exported ? llvm::GlobalValue::ExternalLinkage
+                         : llvm::GlobalValue::InternalLinkage,
+                init, name);
+#if LLVM_VERSION_MAJOR > 9
+            GV->setAlignment(llvm::MaybeAlign(32));
+#else
+            GV->setAlignment(32);
+#endif
+            return GV;
+        };
+        auto element = [&](llvm::Value* table, llvm::Value* index) {
+            return B.CreateInBoundsGEP(table, { constant(0), index });
+        };
+        auto load = [&](llvm::Value* ptr, llvm::Type* type) {
+            return B.CreateAlignedLoad(B.CreateBitCast(ptr, llvm::PointerType::get(type, 0)),
+#if LLVM_VERSION_MAJOR > 9
+                llvm::MaybeAlign(4)
+#else
+                4
+#endif
+            );
+        };
+        auto store = [&](llvm::Value* value, llvm::Value* ptr) {
+            B.CreateAlignedStore(value,
+                B.CreateBitCast(ptr, llvm::PointerType::get(value->getType(), 0)),
+#if LLVM_VERSION_MAJOR > 9
+                llvm::MaybeAlign(4)
+#else
+                4
+#endif
+            );
+        };
+
+        table(constant(N), "__nlex_postag_tag_count", true);
+        table(constant(stride), "__nlex_postag_stride", true);
+        std::vector<llvm::Constant*> names;
+        for (auto t = 0; t < N; ++t)
+            names.push_back(mk_string(M, ctx, model.tag(t)));
+        table(llvm::ConstantArray::get(llvm::ArrayType::get(i8p, N), names),
+            "__nlex_postag_tag_names", true);
+
+        // rows padded to the stride, with scores no path takes (NO_SCORE)
+        std::vector<float> transitions(N * stride, -1000000), emissions((V + 1) * stride, -1000000);
+        for (auto p = 0; p < N; ++p)
+            std::copy_n(model.transitions() + p * N, N, transitions.begin() + p * stride);
+        for (auto w = 0; w <= V; ++w)
+            std::copy_n(model.emissions() + w * N, N, emissions.begin() + w * stride);
+        auto* transitions_table = table(llvm::ConstantDataArray::get(ctx, llvm::makeArrayRef(transitions)),
+            "__nlex_postag_transitions", false);
+        auto* emissions_table = table(llvm::ConstantDataArray::get(ctx, llvm::makeArrayRef(emissions)),
+            "__nlex_postag_emissions", true);
+
+        // the words back to back, word w is bytes offsets[w]..offsets[w + 1]
+        std::string words;
+        std::vector<uint32_t> offsets;
+        for (auto w = 0; w < V; ++w) {
+            offsets.push_back(words.size());
+            words += model.word(w);
+        }
+        offsets.push_back(words.size());
+        auto* word_bytes = mk_string(M, ctx, words);
+        auto* offsets_table = table(llvm::ConstantDataArray::get(ctx, llvm::makeArrayRef(offsets)),
+            "__nlex_postag_word_offsets", false);
+        auto* displacements_table = table(
+            llvm::ConstantDataArray::get(ctx, llvm::makeArrayRef(hash.displacements)),
+            "__nlex_postag_displacements", false);
+        auto* slots_table = table(llvm::ConstantDataArray::get(ctx, llvm::makeArrayRef(hash.slots)),
+            "__nlex_postag_slots", false);
+
+        if (!module.nlex_memcmp) {
+            module.nlex_memchr = llvm::Function::Create(
+                llvm::FunctionType::get(i8p, { i8p, i32, i64 }, false),
+                llvm::Function::ExternalLinkage, "memchr", *M);
+            module.nlex_memcmp = llvm::Function::Create(
+                llvm::FunctionType::get(i32, { i8p, i8p, i64 }, false),
+                llvm::Function::ExternalLinkage, "memcmp", *M);
+        }
+
+        // int __nlex_postag_word_id(char const* word, int length)
+        {
+            auto* fn = llvm::Function::Create(llvm::FunctionType::get(i32, { i8p, i32 }, false),
+                llvm::Function::ExternalLinkage, "__nlex_postag_word_id", M);
+            auto* word = &*fn->arg_begin();
+            auto* length = &*(fn->arg_begin() + 1);
+            auto* entryBB = llvm::BasicBlock::Create(ctx, "entry", fn);
+            auto* hashBB = llvm::BasicBlock::Create(ctx, "hash", fn);
+            auto* byteBB = llvm::BasicBlock::Create(ctx, "hash_byte", fn);
+            auto* slotBB = llvm::BasicBlock::Create(ctx, "slot", fn);
+            auto* lengthBB = llvm::BasicBlock::Create(ctx, "compare_length", fn);
+            auto* compareBB = llvm::BasicBlock::Create(ctx, "compare", fn);
+            auto* foundBB = llvm::BasicBlock::Create(ctx, "found", fn);
+            auto* unknownBB = llvm::BasicBlock::Create(ctx, "unknown", fn);
+            B.SetInsertPoint(entryBB);
+            B.CreateBr(hashBB);
+
+            // hash_word
+            B.SetInsertPoint(hashBB);
+            auto* i = B.CreatePHI(i32, 2);
+            auto* h = B.CreatePHI(i32, 2);
+            i->addIncoming(constant(0), entryBB);
+            h->addIncoming(llvm::ConstantInt::get(i32, 2166136261u), entryBB);
+            B.CreateCondBr(B.CreateICmpSLT(i, length), byteBB, slotBB);
+
+            B.SetInsertPoint(byteBB);
+            auto* byte = B.CreateZExt(B.CreateLoad(B.CreateInBoundsGEP(word, { i })), i32);
+            i->addIncoming(B.CreateAdd(i, constant(1)), byteBB);
+            h->addIncoming(B.CreateMul(B.CreateXor(h, byte), llvm::ConstantInt::get(i32, 16777619u)), byteBB);
+            B.CreateBr(hashBB);
+
+            // perfect_hash_slot
+            B.SetInsertPoint(slotBB);
+            auto* d = B.CreateLoad(element(displacements_table,
+                B.CreateAnd(h, constant(hash.displacements.size() - 1))));
+            auto* x = B.CreateXor(h, d);
+            x = B.CreateXor(x, B.CreateLShr(x, constant(16)));
+            x = B.CreateMul(x, llvm::ConstantInt::get(i32, 0x85ebca6bu));
+            x = B.CreateXor(x, B.CreateLShr(x, constant(13)));
+            auto* id = B.CreateLoad(element(slots_table, B.CreateAnd(x, constant(hash.slots.size() - 1))));
+            B.CreateCondBr(B.CreateICmpEQ(id, constant(V)), unknownBB, lengthBB);
+
+            // the only word it can be, if it is in the vocabulary
+            B.SetInsertPoint(lengthBB);
+            auto* start = B.CreateLoad(element(offsets_table, id));
+            auto* end = B.CreateLoad(element(offsets_table, B.CreateAdd(id, constant(1))));
+            B.CreateCondBr(B.CreateICmpEQ(B.CreateSub(end, start), length), compareBB, unknownBB);
+
+            B.SetInsertPoint(compareBB);
+            auto* diff = B.CreateCall(module.nlex_memcmp,
+                { word, B.CreateInBoundsGEP(word_bytes, { start }), B.CreateZExt(length, i64) });
+            B.CreateCondBr(B.CreateIsNull(diff), foundBB, unknownBB);
+
+            B.SetInsertPoint(foundBB);
+            B.CreateRet(id);
+            B.SetInsertPoint(unknownBB);
+            B.CreateRet(constant(V));
+        }
+
+        // void __nlex_postag_step(float const* prev, float* next, int* back, int word)
+        {
+            auto* fn = llvm::Function::Create(
+                llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), { f32p, f32p, i32p, i32 }, false),
+                llvm::Function::ExternalLinkage, "__nlex_postag_step", M);
+            auto args = fn->arg_begin();
+            llvm::Value* prev = &*args++;
+            llvm::Value* next = &*args++;
+            llvm::Value* back = &*args++;
+            llvm::Value* word = &*args;
+            auto* entryBB = llvm::BasicBlock::Create(ctx, "entry", fn);
+            auto* loopBB = llvm::BasicBlock::Create(ctx, "prev_tag", fn);
+            auto* doneBB = llvm::BasicBlock::Create(ctx, "done", fn);
+            B.SetInsertPoint(entryBB);
+            B.CreateBr(loopBB);
+
+            // max_plus, with every block of 8 tags in registers across the loop
+            B.SetInsertPoint(loopBB);
+            auto* p = B.CreatePHI(i32, 2);
+            p->addIncoming(constant(0), entryBB);
+            std::vector<llvm::Value*> best, arg;
+            for (auto c = 0; c < stride; c += width) {
+                auto* best_in = B.CreatePHI(vfloat, 2);
+                auto* arg_in = B.CreatePHI(vint, 2);
+                best_in->addIncoming(llvm::ConstantFP::get(vfloat, -1000000), entryBB);
+                arg_in->addIncoming(llvm::Constant::getNullValue(vint), entryBB);
+                best.push_back(best_in);
+                arg.push_back(arg_in);
+            }
+            auto* score = B.CreateVectorSplat(width, B.CreateLoad(B.CreateInBoundsGEP(prev, { p })));
+            auto* ps = B.CreateVectorSplat(width, p);
+            auto* row = element(transitions_table, B.CreateMul(p, constant(stride)));
+            for (auto c = 0; c < stride; c += width) {
+                auto* best_in = llvm::cast<llvm::PHINode>(best[c / width]);
+                auto* arg_in = llvm::cast<llvm::PHINode>(arg[c / width]);
+                auto* s = B.CreateFAdd(score, load(B.CreateInBoundsGEP(row, { constant(c) }), vfloat));
+                // strictly greater, so ties go to the first tag
+                auto* gt = B.CreateFCmpOGT(s, best_in);
+                best[c / width] = B.CreateSelect(gt, s, best_in);
+                arg[c / width] = B.CreateSelect(gt, ps, arg_in);
+                best_in->addIncoming(best[c / width], loopBB);
+                arg_in->addIncoming(arg[c / width], loopBB);
+            }
+            auto* p_next = B.CreateAdd(p, constant(1));
+            p->addIncoming(p_next, loopBB);
+            B.CreateCondBr(B.CreateICmpSLT(p_next, constant(N)), loopBB, doneBB);
+
+            B.SetInsertPoint(doneBB);
+            auto* emit = element(emissions_table, B.CreateMul(word, constant(stride)));
+            for (auto c = 0; c < stride; c += width) {
+                auto* e = load(B.CreateInBoundsGEP(emit, { constant(c) }), vfloat);
+                store(B.CreateFAdd(best[c / width], e), B.CreateInBoundsGEP(next, { constant(c) }));
+                store(arg[c / width], B.CreateInBoundsGEP(back, { constant(c) }));
+            }
+            B.CreateRetVoid();
+        }
+        module.postag_specialised = true;
+    }
     std::map<std::string, llvm::Constant*> registered_tags;
     std::map<std::string, llvm::Constant*> registered_non_tags;
+    /// tag -> the `tag_id' of its tokens: 1 for <Skipped>, then the rules (and
+    /// literal tags) by name; anything else (no match) is 0
+    std::map<std::string, int> tag_ids;
+
+    /// Tag strings are preceded by their tag id, so the id of a token is the
+    /// int before its tag
+    llvm::Constant* mk_tag_string(const std::string& tag)
+    {
+        auto& ctx = module.TheContext;
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto* init = llvm::ConstantStruct::getAnon(
+            { llvm::ConstantInt::get(i32, tag_ids.count(tag) ? tag_ids[tag] : 0),
+                llvm::ConstantDataArray::getString(ctx, tag) });
+        auto* GV = new llvm::GlobalVariable(*module.TheModule, init->getType(), true,
+            llvm::GlobalValue::InternalLinkage, init, "tag");
+        llvm::Constant* idxs[] = {
+            llvm::ConstantInt::get(i32, 0),
+            llvm::ConstantInt::get(i32, 1),
+            llvm::ConstantInt::get(i32, 0),
+        };
+        return llvm::ConstantExpr::getInBoundsGetElementPtr(init->getType(), GV, idxs);
+    }
+
+    /// Write a C header for the lexer to `header_file_name': the tag ids as
+    /// an enum, struct sresult, and the functions exported with these options
+    /// (under the symbol prefix, if there is one)
+    void write_header(const GenLexer& lexer_stuff)
+    {
+        auto sym = [&](const std::string& name) { return prefixed_symbol(module.symbol_prefix, name); };
+        auto tag_enum = sym("nlex_tag");
+        auto tag_constant = tag_enum + "_";
+        for (auto& c : tag_constant)
+            c = toupper((unsigned char)c);
+        std::ofstream header { header_file_name };
+        header << "/* generated by nlex, do not edit */\n"
+                  "#pragma once\n"
+                  "\n"
+                  "#include <stddef.h>\n"
+                  "#include <stdint.h>\n"
+                  "\n"
+                  "#ifdef __cplusplus\n"
+                  "extern \"C\" {\n"
+                  "#endif\n"
+                  "\n"
+                  "/* in the order the rules are declared, only valid for the lexer built\n"
+                  "   along with this header */\n"
+               << "enum " << tag_enum << " {\n"
+               << "  " << tag_constant << "NONE = 0,\n";
+        std::vector<std::string> tags(tag_ids.size() + 1);
+        for (auto& [tag, id] : tag_ids)
+            tags[id] = tag;
+        std::set<std::string> names { "NONE" };
+        for (size_t id = 1; id < tags.size(); ++id) {
+            std::string name = id == 1 ? "SKIPPED" : tags[id];
+            for (auto& c : name)
+                if (!isalnum((unsigned char)c) && c != '_')
+                    c = '_';
+            if (!names.insert(name).second)
+                name += "_" + std::to_string(id);
+            names.insert(name);
+            header << "  " << tag_constant << name << " = " << id << ", /* " << tags[id] << " */\n";
+        }
+        // the types are the same for every lexer, so headers of several
+        // (prefixed) lexers can be included together
+        header << "};\n"
+                  "\n"
+                  "#ifndef NLEX_TYPES_DEFINED\n"
+                  "#define NLEX_TYPES_DEFINED\n"
+                  "struct sresult {\n"
+                  "  char const *start;\n"
+                  "  int length;\n"
+                  "  char const *tag;\n"
+                  "  char errc;\n"
+                  "  unsigned char metadata; /* bit 0: stopword, bit 1: sentence delimiter, bit 2: skipped */\n"
+                  "  char const *pos;\n"
+                  "  int tag_id; /* the lexer's enum of tags */\n"
+                  "};\n"
+                  "\n"
+                  "/* sresult.errc */\n"
+                  "enum nlex_errc {\n";
+#define NLEX_ERRC_HEADER_LINE(name, value, what) \
+    header << "  NLEX_ERRC_" #name " = " << value << ", /* " what " */\n";
+        NLEX_ERRCS(NLEX_ERRC_HEADER_LINE)
+#undef NLEX_ERRC_HEADER_LINE
+        header << "};\n"
+                  "\n"
+                  "/* the functions of a lexer, NULL where its options leave one out */\n"
+                  "struct nlex_functions {\n"
+                  "  void (*feed)(char const *input);\n"
+                  "  void (*root)(struct sresult *result);\n"
+                  "  void (*skip)(void);\n"
+                  "  int64_t (*distance)(void);\n"
+                  "  char (*pure_normalise)(void);\n"
+                  "  size_t (*pure_normalise_buf)(const char *in, size_t n, char *out, size_t cap, size_t *consumed);\n"
+                  "  size_t (*tokenise_arrays)(uint32_t *offset, uint32_t *length, uint16_t *tag, uint8_t *flags, size_t cap);\n"
+                  "  char const *(*get_group_start_ptr)(int group);\n"
+                  "  char const *(*get_group_end_ptr)(int group);\n"
+                  "  int (*get_group_length)(int group);\n"
+                  "  struct sresult *(*tag_document)(const char *text, int threads, size_t *count);\n"
+                  "  int (*postag_load_model)(const char *path);\n"
+                  "  int64_t (*token_offset)(void);\n"
+                  "};\n"
+                  "#endif\n"
+                  "\n"
+               << "struct nlex_functions const *" << sym("__nlex_functions") << "(void);\n"
+               << "void " << sym("__nlex_feed") << "(char const *input);\n"
+               << "void " << sym("__nlex_root") << "(struct sresult *result);\n"
+               << "void " << sym("__nlex_skip") << "(void);\n"
+               << "int64_t " << sym("__nlex_distance") << "(void);\n"
+               << "int64_t " << sym("__nlex_token_offset") << "(void);\n"
+               << "int " << sym("__nlex_utf8_length") << "(char c);\n";
+        if (get(lexer_stuff.options, "pure_normaliser"))
+            header << "char " << sym("__nlex_pure_normalise") << "(void);\n"
+                   << "size_t " << sym("__nlex_pure_normalise_buf")
+                   << "(const char *in, size_t n, char *out, size_t cap, size_t *consumed);\n";
+        if (get(lexer_stuff.options, "capturing_groups") || lexer_stuff.has_backreferences)
+            header << "char const *" << sym("nlex_get_group_start_ptr") << "(int group);\n"
+                   << "char const *" << sym("nlex_get_group_end_ptr") << "(int group);\n"
+                   << "int " << sym("nlex_get_group_length") << "(int group);\n";
+        if (get(lexer_stuff.options, "token_arrays") && !lexer_stuff.tagpos.has_value())
+            header << "size_t " << sym("__nlex_tokenise_arrays")
+                   << "(uint32_t *offset, uint32_t *length, uint16_t *tag, uint8_t *flags, size_t cap);\n";
+        if (get(lexer_stuff.options, "count_only"))
+            header << "extern uint64_t " << sym("__nlex_tag_counts") << "[" << tag_ids.size() + 1
+                   << "]; /* by enum " << tag_enum << " */\n";
+        if (lexer_stuff.tagpos.has_value() && !module.postag_specialised)
+            header << "int " << sym("nlex_postag_load_model") << "(const char *path);\n"
+                   << "struct sresult *" << sym("nlex_tag_document")
+                   << "(const char *text, int threads, size_t *count);\n";
+        header << "\n"
+                  "#ifdef __cplusplus\n"
+                  "}\n"
+                  "#endif\n";
+        if (!header)
+            slts.show(Display::Type::ERROR,
+                "failed to write the header to '{<magenta>}%s{<clean>}'",
+                header_file_name.c_str());
+    }
+
+    /// Define __nlex_functions in the linked module `M': it returns the
+    /// lexer's functions, laid out as struct nlex_functions (see write_header)
+    void emit_function_table(llvm::Module& M)
+    {
+        static char const* functions[] = {
+            "__nlex_feed", "__nlex_root", "__nlex_skip", "__nlex_distance",
+            "__nlex_pure_normalise", "__nlex_pure_normalise_buf", "__nlex_tokenise_arrays",
+            "nlex_get_group_start_ptr", "nlex_get_group_end_ptr", "nlex_get_group_length",
+            "nlex_tag_document", "nlex_postag_load_model", "__nlex_token_offset"
+        };
+        auto* i8p = llvm::Type::getInt8PtrTy(module.TheContext);
+        std::vector<llvm::Constant*> entries;
+        for (auto name : functions) {
+            auto* fn = M.getFunction(name);
+            entries.push_back(fn && !fn->isDeclaration()
+                    ? llvm::ConstantExpr::getBitCast(fn, i8p)
+                    : llvm::Constant::getNullValue(i8p));
+        }
+        auto* type = llvm::ArrayType::get(i8p, entries.size());
+        auto* table = new llvm::GlobalVariable(M, type, true, llvm::GlobalValue::InternalLinkage,
+            llvm::ConstantArray::get(type, entries), "__nlex_function_table");
+        auto* getter = llvm::Function::Create(llvm::FunctionType::get(i8p, {}, false),
+            llvm::Function::ExternalLinkage, "__nlex_functions", M);
+        llvm::IRBuilder<> builder { llvm::BasicBlock::Create(module.TheContext, "", getter) };
+        builder.CreateRet(builder.CreateBitCast(table, i8p));
+    }
+
+    /// Match the backreference to capture `group', repeated `min'..`max'
+    /// times (-1 :- unbounded), at the current position: each repetition
+    /// compares the whole captured span with memcmp, appends it to the token
+    /// and skips over it. Branches to `failBB' on fewer than `min' repetitions.
+    void emit_backreference(int group, int min, int max, llvm::BasicBlock* failBB)
+    {
+        auto& B = module.Builder;
+        auto& ctx = module.TheContext;
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto* i64 = llvm::Type::getInt64Ty(ctx);
+        auto* i8p = llvm::Type::getInt8PtrTy(ctx);
+        auto* parent = B.GetInsertBlock()->getParent();
+
+        if (!module.nlex_memcmp) {
+            module.nlex_memchr = llvm::Function::Create(
+                llvm::FunctionType::get(i8p, { i8p, i32, i64 }, false),
+                llvm::Function::ExternalLinkage, "memchr", *module.TheModule);
+            module.nlex_memcmp = llvm::Function::Create(
+                llvm::FunctionType::get(i32, { i8p, i8p, i64 }, false),
+                llvm::Function::ExternalLinkage, "memcmp", *module.TheModule);
+        }
+
+        auto capture = [&](int idx) {
+            return B.CreateLoad(B.CreateInBoundsGEP(module.nlex_capture_indices,
+                { llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i32, idx) }));
+        };
+        auto* start = capture(group * 2);
+        auto* len = B.CreateSub(B.CreatePtrToInt(capture(group * 2 + 1), i64),
+            B.CreatePtrToInt(start, i64));
+        auto* empty = B.CreateICmpSLE(len, llvm::ConstantInt::get(i64, 0));
+
+        auto* entryBB = B.GetInsertBlock();
+        auto* loopBB = llvm::BasicBlock::Create(ctx, "backref", parent);
+        auto* boundedBB = llvm::BasicBlock::Create(ctx, "backref_bounded", parent);
+        auto* compareBB = llvm::BasicBlock::Create(ctx, "backref_compare", parent);
+        auto* stepBB = llvm::BasicBlock::Create(ctx, "backref_step", parent);
+        auto* doneBB = llvm::BasicBlock::Create(ctx, "backref_done", parent);
+        B.CreateBr(loopBB);
+
+        // an empty (or unset) capture matches any number of times in place
+        B.SetInsertPoint(loopBB);
+        auto* count = B.CreatePHI(i32, 2);
+        count->addIncoming(llvm::ConstantInt::get(i32, 0), entryBB);
+        auto* more = B.CreateNot(empty);
+        if (max >= 0)
+            more = B.CreateAnd(more, B.CreateICmpSLT(count, llvm::ConstantInt::get(i32, max)));
+        B.CreateCondBr(more, boundedBB, doneBB);
+
+        // the subject is only known to be NUL-terminated, so make sure it has
+        // `len' more bytes before comparing them
+        B.SetInsertPoint(boundedBB);
+        auto* pos = B.CreateCall(module.nlex_current_p, {});
+        auto* nul = B.CreateCall(module.nlex_memchr, { pos, llvm::ConstantInt::get(i32, 0), len });
+        B.CreateCondBr(B.CreateIsNull(nul), compareBB, doneBB);
+
+        B.SetInsertPoint(compareBB);
+        auto* diff = B.CreateCall(module.nlex_memcmp, { pos, start, len });
+        B.CreateCondBr(B.CreateIsNull(diff), stepBB, doneBB);
+
+        B.SetInsertPoint(stepBB);
+        auto* length = B.CreateLoad(module.token_length);
+        B.CreateMemCpy(
+            B.CreateInBoundsGEP(module.token_value, { llvm::ConstantInt::get(i32, 0), length }),
+#if LLVM_VERSION_MAJOR > 9
+            llvm::MaybeAlign(1),
+#else
+            1,
+#endif
+            pos,
+#if LLVM_VERSION_MAJOR > 9
+            llvm::MaybeAlign(1),
+#else
+            1,
+#endif
+            len);
+        B.CreateStore(B.CreateAdd(length, B.CreateTrunc(len, i32)), module.token_length);
+        B.CreateCall(module.nlex_restore, { B.CreateInBoundsGEP(pos, { len }) });
+        count->addIncoming(B.CreateAdd(count, llvm::ConstantInt::get(i32, 1)), stepBB);
+        B.CreateBr(loopBB);
+
+        B.SetInsertPoint(doneBB);
+        if (min > 0) {
+            auto* okBB = llvm::BasicBlock::Create(ctx, "backref_pass", parent);
+            B.CreateCondBr(
+                B.CreateOr(empty, B.CreateICmpSGE(count, llvm::ConstantInt::get(i32, min))),
+                okBB, failBB);
+            B.SetInsertPoint(okBB);
+        }
+    }
+
+    /// Call the subexpression function `fn' for subexpression `idx', within
+    /// the depth limit and through the memo table if those are enabled
+    void emit_subexpr_call(llvm::Function* fn, llvm::Value* val, int idx)
+    {
+        if (subexpr_depth_limit <= 0) {
+            if (memoise_subexpressions)
+                emit_memoised_call(fn, val, idx);
+            else
+                module.Builder.CreateCall(fn, { val });
+            return;
+        }
+        auto& B = module.Builder;
+        auto& ctx = module.TheContext;
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto* parent = B.GetInsertBlock()->getParent();
+
+        auto* depth = B.CreateLoad(module.nlex_subexpr_depth);
+        auto* deepBB = llvm::BasicBlock::Create(ctx, "subexpr_too_deep", parent);
+        auto* callBB = llvm::BasicBlock::Create(ctx, "subexpr_call", parent);
+        auto* doneBB = llvm::BasicBlock::Create(ctx, "subexpr_done", parent);
+        B.CreateCondBr(B.CreateICmpSGE(depth, llvm::ConstantInt::get(i32, subexpr_depth_limit)),
+            deepBB, callBB);
+
+        B.SetInsertPoint(deepBB);
+        B.CreateStore(llvm::ConstantInt::get(llvm::Type::getInt8Ty(ctx), NLEX_ERRC_DEPTH_LIMIT),
+            B.CreateInBoundsGEP(val, { llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i32, 3) }));
+        B.CreateBr(doneBB);
+
+        B.SetInsertPoint(callBB);
+        B.CreateStore(B.CreateAdd(depth, llvm::ConstantInt::get(i32, 1)), module.nlex_subexpr_depth);
+        if (memoise_subexpressions)
+            emit_memoised_call(fn, val, idx);
+        else
+            B.CreateCall(fn, { val });
+        B.CreateStore(depth, module.nlex_subexpr_depth);
+        B.CreateBr(doneBB);
+
+        B.SetInsertPoint(doneBB);
+    }
+
+    /// Move the locals of the subexpression function `fn' into a global
+    /// arena of frames indexed by the call depth, leaving only the return
+    /// address on the native stack
+    void move_locals_to_frames(llvm::Function* fn)
+    {
+        auto& ctx = module.TheContext;
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto& entry = fn->getEntryBlock();
+        std::vector<llvm::AllocaInst*> locals;
+        std::vector<llvm::Type*> types;
+        for (auto& inst : entry)
+            if (auto* local = llvm::dyn_cast<llvm::AllocaInst>(&inst)) {
+                locals.push_back(local);
+                types.push_back(local->getAllocatedType());
+            }
+        if (locals.empty())
+            return;
+
+        // callers are at most `subexpr_depth_limit' deep, and bump the depth
+        // before calling, so every active call has its own frame
+        auto* frame_type = llvm::StructType::get(ctx, types);
+        auto* arena_type = llvm::ArrayType::get(frame_type, subexpr_depth_limit + 1);
+        auto* arena = module.createGlobal(arena_type, llvm::Constant::getNullValue(arena_type),
+            fn->getName().str() + "_frames");
+        llvm::IRBuilder<> builder(&entry, entry.begin());
+        auto* frame = builder.CreateInBoundsGEP(arena,
+            { llvm::ConstantInt::get(i32, 0), builder.CreateLoad(module.nlex_subexpr_depth) });
+        for (size_t i = 0; i < locals.size(); i++) {
+            auto* slot = builder.CreateInBoundsGEP(frame,
+                { llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i32, i) });
+            slot->takeName(locals[i]);
+            locals[i]->replaceAllUsesWith(slot);
+            locals[i]->eraseFromParent();
+        }
+    }
+
+    /// Call the subexpression function `fn' through the memo table: if the
+    /// same subexpression was already called at this position (since the last
+    /// nlex_feed), move to where that call ended and re-append the bytes it
+    /// consumed to the token instead. Calls that shortened the token are not
+    /// recorded.
+    void emit_memoised_call(llvm::Function* fn, llvm::Value* val, int idx)
+    {
+        auto& B = module.Builder;
+        auto& ctx = module.TheContext;
+        auto* i32 = llvm::Type::getInt32Ty(ctx);
+        auto* i64 = llvm::Type::getInt64Ty(ctx);
+        auto* parent = B.GetInsertBlock()->getParent();
+        auto* zero = llvm::ConstantInt::get(i64, 0);
+
+        auto* pos = B.CreateCall(module.nlex_current_p, {});
+        // fibonacci hashing of (subexpression, position)
+        auto* hash = B.CreateMul(
+            B.CreateAdd(B.CreatePtrToInt(pos, i64), llvm::ConstantInt::get(i64, (uint64_t)idx << 32)),
+            llvm::ConstantInt::get(i64, 0x9E3779B97F4A7C15ull));
+        auto* slot = B.CreateLShr(hash, 64 - memo_table_bits);
+        auto entry = [&](llvm::GlobalVariable* table) {
+            return B.CreateInBoundsGEP(table, { zero, slot });
+        };
+        auto* key = B.CreateOr(
+            B.CreateShl(B.CreateZExt(B.CreateLoad(module.nlex_memo_generation), i64), 32),
+            llvm::ConstantInt::get(i64, idx));
+        auto* errcp = B.CreateInBoundsGEP(val,
+            { llvm::ConstantInt::get(i32, 0), llvm::ConstantInt::get(i32, 3) });
+        auto* hit = B.CreateAnd(
+            B.CreateICmpEQ(B.CreateLoad(entry(module.nlex_memo_key)), key),
+            B.CreateICmpEQ(B.CreateLoad(entry(module.nlex_memo_pos)), pos));
+
+        auto* hitBB = llvm::BasicBlock::Create(ctx, "memo_hit", parent);
+        auto* missBB = llvm::BasicBlock::Create(ctx, "memo_miss", parent);
+        auto* recordBB = llvm::BasicBlock::Create(ctx, "memo_record", parent);
+        auto* doneBB = llvm::BasicBlock::Create(ctx, "memo_done", parent);
+        B.CreateCondBr(hit, hitBB, missBB);
+
+        B.SetInsertPoint(hitBB);
+        auto* end = B.CreateLoad(entry(module.nlex_memo_end));
+        auto* added = B.CreateLoad(entry(module.nlex_memo_length));
+        auto* length = B.CreateLoad(module.token_length);
+        B.CreateMemCpy(
+            B.CreateInBoundsGEP(module.token_value, { llvm::ConstantInt::get(i32, 0), length }),
+#if LLVM_VERSION_MAJOR > 9
+            llvm::MaybeAlign(1),
+#else
+            1,
+#endif
+            B.CreateInBoundsGEP(end, { B.CreateNeg(B.CreateSExt(added, i64)) }),
+#if LLVM_VERSION_MAJOR > 9
+            llvm::MaybeAlign(1),
+#else
+            1,
+#endif
+            added);
+        B.CreateStore(B.CreateAdd(length, added), module.token_length);
+        B.CreateCall(module.nlex_restore, { end });
+        B.CreateStore(B.CreateLoad(entry(module.nlex_memo_errc)), errcp);
+        B.CreateBr(doneBB);
+
+        B.SetInsertPoint(missBB);
+        auto* before = B.CreateLoad(module.token_length);
+        B.CreateCall(fn, { val });
+        auto* grown = B.CreateSub(B.CreateLoad(module.token_length), before);
+        B.CreateCondBr(B.CreateICmpSGE(grown, llvm::ConstantInt::get(i32, 0)), recordBB, doneBB);
+
+        B.SetInsertPoint(recordBB);
+        B.CreateStore(key, entry(module.nlex_memo_key));
+        B.CreateStore(pos, entry(module.nlex_memo_pos));
+        B.CreateStore(B.CreateCall(module.nlex_current_p, {}), entry(module.nlex_memo_end));
+        B.CreateStore(grown, entry(module.nlex_memo_length));
+        B.CreateStore(B.CreateLoad(errcp), entry(module.nlex_memo_errc));
+        B.CreateBr(doneBB);
+
+        B.SetInsertPoint(doneBB);
+    }
+    /// rule actions, each compiled once into its own function
+    std::map<std::string, llvm::Function*> registered_actions;
+
+    llvm::Function* get_or_create_action(const std::string& code)
+    {
+        if (registered_actions.count(code))
+            return registered_actions[code];
+        auto fn = llvm::Function::Create(
+            llvm::FunctionType::get(llvm::Type::getVoidTy(module.TheContext), {}, false),
+            llvm::Function::InternalLinkage,
+            "__nlex_action_" + std::to_string(registered_actions.size()),
+            *module.TheModule);
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(module.TheContext, "entry", fn));
+        kaleid.compile(code, builder, true);
+        builder.CreateRetVoid();
+        return registered_actions[code] = fn;
+    }
     llvm::Value* get_or_create_tag(std::string tag, bool istag = true,
         std::string name = "str")
     {
@@ -1815,7 +3798,7 @@ public:
         }
         if (registered_tags.count(tag))
             return registered_tags[tag];
-        return registered_tags[tag] = mk_string(module.TheModule.get(), module.TheContext, tag);
+        return registered_tags[tag] = mk_tag_string(tag);
     }
     llvm::ConstantInt* get_or_create_tag_constint(std::string tag)
     {
@@ -1823,7 +3806,7 @@ public:
         if (registered_tags.count(tag))
             s = registered_tags[tag];
         else
-            s = registered_tags[tag] = mk_string(module.TheModule.get(), module.TheContext, tag);
+            s = registered_tags[tag] = mk_tag_string(tag);
         return to_int(s);
     }
     llvm::ConstantInt* to_int(llvm::Constant* s)
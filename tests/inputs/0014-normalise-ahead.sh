@@ -0,0 +1,3 @@
+# over 1MB of `cab ', and a last word that has to make it through
+for i in $(seq 1000); do printf 'cab %.0s' $(seq 300); done
+printf 'ccc'
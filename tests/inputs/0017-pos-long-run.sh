@@ -0,0 +1,2 @@
+# 60000 words and no sentence delimiter, every `c a' costs the path -100
+for i in $(seq 100); do printf 'a b c %.0s' $(seq 200); done
@@ -0,0 +1,2 @@
+# the input of 0017-pos-long-run
+exec bash "$(dirname "$0")/0017-pos-long-run.sh"
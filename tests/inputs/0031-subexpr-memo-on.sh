@@ -0,0 +1,2 @@
+# the input of 0030-subexpr-memo-off
+exec cat "$(dirname "$0")/0030-subexpr-memo-off.input"
@@ -1,8 +1,15 @@
 #!/bin/bash
 compile() {
     tname=$1
-    ../src/build/nlex --relocation-model pic -o build/$tname.o sources/$tname.nlex && \
-        cc -o build/$tname build/$tname.o -lstdc++
+    if [ -e sources/$tname.c ]
+    then
+        ../src/build/nlex --library --relocation-model pic --header build/$tname.h -o build/$tname.o sources/$tname.nlex && \
+            cc -c -DNLEX_RTS_HELPERS_ONLY -o build/rts.o ../src/rts.c && \
+            cc -include build/$tname.h -o build/$tname sources/$tname.c build/$tname.o build/rts.o -lstdc++
+    else
+        ../src/build/nlex --relocation-model pic -o build/$tname.o sources/$tname.nlex && \
+            cc -o build/$tname build/$tname.o -lstdc++
+    fi
 }
 
 record() {
@@ -10,7 +17,14 @@ record() {
         tname=$(basename $tpath)
         tname=${tname%.nlex}
         tinput=inputs/$tname.input
-        $EDITOR $tinput
+        # an existing input is kept, so that tests can be recorded again
+        if [ -e inputs/$tname.sh ]
+        then
+            tinput=<(bash inputs/$tname.sh)
+        elif [ ! -e $tinput ]
+        then
+            $EDITOR $tinput
+        fi
         compile $tname
         build/$tname < $tinput > outputs/$tname.stdout 2> outputs/$tname.stderr
         echo "$tname" >> list-tests
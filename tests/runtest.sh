@@ -1,9 +1,20 @@
 #!/bin/bash
 
+# list-tests: one test per line, `<name> [nlex options...]'; a test that has a
+# sources/<name>.c is built as a --library with --header, and linked with that
+# main() instead of the RTS
 compile() {
     tname=$1
-    ../src/build/nlex --relocation-model pic -o build/$tname.o sources/$tname.nlex >/dev/null 2>&1 && \
-        cc -o build/$tname build/$tname.o -lstdc++
+    shift
+    if [ -e sources/$tname.c ]
+    then
+        ../src/build/nlex --library --relocation-model pic --header build/$tname.h "$@" -o build/$tname.o sources/$tname.nlex >/dev/null 2>&1 && \
+            cc -c -DNLEX_RTS_HELPERS_ONLY -o build/rts.o ../src/rts.c && \
+            cc -include build/$tname.h -o build/$tname sources/$tname.c build/$tname.o build/rts.o -lstdc++
+    else
+        ../src/build/nlex --relocation-model pic "$@" -o build/$tname.o sources/$tname.nlex >/dev/null 2>&1 && \
+            cc -o build/$tname build/$tname.o -lstdc++
+    fi
 }
 
 assertEqual() {
@@ -14,23 +25,28 @@ assertEqual() {
 
 runtest() {
     tname=$1
-    printf "Testing $tname: "
+    printf "Testing $tname${flags:+ $flags}: "
     build/$tname < $tinput > output.stdout 2> output.stderr || echo "exec FAIL" && \
     assertEqual stdout output.stdout outputs/$tname.stdout || echo "stdout FAIL" && \
     assertEqual stderr output.stderr outputs/$tname.stderr || echo "stderr FAIL" && \
     echo "ok"
 }
 
-for test in `cat list-tests`; do
+mkdir -p build
+while read -r test flags <&3; do
     tname=$test
 
+    # inputs/<name>.sh generates the input, for the ones too big to keep
     if [ -e inputs/$tname.input ]
     then
         tinput=inputs/$tname.input
+    elif [ -e inputs/$tname.sh ]
+    then
+        tinput=<(bash inputs/$tname.sh)
     else
         tinput=<(echo -e "\n")
     fi
 
-    compile $test &&\
+    compile $test $flags &&\
     runtest $test
-done
+done 3< list-tests
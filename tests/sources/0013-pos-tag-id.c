@@ -0,0 +1,25 @@
+/* tag_id has to come through the POS tagger's read-ahead, and match the
+ * enum of the header */
+#include "driver.h"
+
+static int expected_id(const char *tag) {
+  if (!strcmp(tag, "test"))
+    return NLEX_TAG_TEST;
+  if (!strcmp(tag, "sentence_delm"))
+    return NLEX_TAG_SENTENCE_DELM;
+  return NLEX_TAG_NONE;
+}
+
+int main() {
+  struct sresult res;
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if (res.errc || res.length == 0)
+      break;
+    if (res.tag_id != expected_id(res.tag))
+      printf("tag_id %d, expected %d\n", res.tag_id, expected_id(res.tag));
+  }
+  return 0;
+}
@@ -0,0 +1,25 @@
+/* normalise_ahead over an input larger than the first buffers, the last
+ * token has to be there and map back to the end of the input */
+#include "driver.h"
+
+int main() {
+  size_t length;
+  char *input = read_input(&length);
+  struct sresult res, last = {0};
+  long tokens = 0, last_distance = 0;
+  __nlex_feed(input);
+  while (1) {
+    __nlex_root(&res);
+    if (res.errc || res.length == 0)
+      break;
+    if (res.length != 3 || memcmp(res.start, "aab", 3))
+      print_token(&res);
+    ++tokens;
+    last = res;
+    last_distance = __nlex_distance();
+  }
+  printf("%ld tokens in %zu bytes\n", tokens, length);
+  print_token(&last);
+  printf("ends at %ld\n", last_distance);
+  return 0;
+}
@@ -0,0 +1,18 @@
+/* runs of skip_on_error come back with their length and NLEX_ERRC_SKIPPED, and
+ * the lexer carries on after them */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if ((res.errc && res.errc != NLEX_ERRC_SKIPPED) || res.length == 0)
+      break;
+    if (res.errc)
+      printf("errc %d, %s %d, pos %s, metadata %d\n", res.errc, res.tag,
+             res.tag_id, res.pos, res.metadata);
+  }
+  return 0;
+}
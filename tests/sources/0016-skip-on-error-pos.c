@@ -0,0 +1,18 @@
+/* under tag pos, runs of skip_on_error end the sentence, and come back in
+ * order and untagged */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if ((res.errc && res.errc != NLEX_ERRC_SKIPPED) || res.length == 0)
+      break;
+    if (res.errc)
+      printf("errc %d, %s %d, pos %s\n", res.errc, res.tag, res.tag_id,
+             res.pos);
+  }
+  return 0;
+}
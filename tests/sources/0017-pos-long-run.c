@@ -0,0 +1,25 @@
+/* one sentence long enough for its path scores to run past NO_SCORE, unless
+ * the columns are renormalised: then every back-pointer would be tag 0 */
+#include "driver.h"
+
+int main() {
+  static const char *expected[] = {"A", "B", "C"};
+  struct sresult res = {0};
+  long words = 0, wrong = 0;
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    if (res.errc || res.length == 0)
+      break;
+    if (!res.pos || strcmp(res.pos, expected[words % 3])) {
+      if (!wrong) {
+        printf("word %ld: ", words);
+        print_token(&res);
+      }
+      ++wrong;
+    }
+    ++words;
+  }
+  printf("%ld words, %ld tagged wrong\n", words, wrong);
+  return 0;
+}
@@ -0,0 +1,2 @@
+/* 0017-pos-long-run, with the tagger over the model compiled into code */
+#include "0017-pos-long-run.c"
@@ -0,0 +1,32 @@
+/* groups are resolved when asked for, and groups that don't exist (past the
+ * last one, or negative) have no bounds */
+#include "driver.h"
+
+static void print_group(int group) {
+  char const *start = nlex_get_group_start_ptr(group);
+  char const *end = nlex_get_group_end_ptr(group);
+  int length = nlex_get_group_length(group);
+  if (start && end)
+    printf("  group %d: '%.*s', length %d\n", group, (int)(end - start), start,
+           length);
+  else
+    printf("  group %d: none, length %d\n", group, length);
+}
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if (res.errc || res.length == 0)
+      break;
+    if (res.tag_id == NLEX_TAG_PAIR) {
+      print_group(1);
+      print_group(2);
+      print_group(3);
+      print_group(-1);
+    }
+  }
+  return 0;
+}
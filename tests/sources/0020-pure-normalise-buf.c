@@ -0,0 +1,45 @@
+/* __nlex_pure_normalise_buf: bounded at `n', never splits an expansion at
+ * `cap', says how much of the input it covered, and leaves the lexer be */
+#include "driver.h"
+
+static void normalise(char const *name, char const *in, size_t n,
+                      size_t cap) {
+  char out[256];
+  size_t consumed = 0;
+  size_t written = __nlex_pure_normalise_buf(in, n, out, cap, &consumed);
+  printf("%s: written %zu, consumed %zu, '", name, written, consumed);
+  for (size_t i = 0; i < written; ++i)
+    if (out[i] >= ' ' && out[i] <= '~')
+      putchar(out[i]);
+    else
+      printf("\\x%02x", (unsigned char)out[i]);
+  printf("'\n");
+}
+
+int main() {
+  char const *line =
+      "the quick brown fox jumps over the lazy dog, then the next one";
+  normalise("whole", "axb\xd8\xb4", 5, 256);
+  normalise("expansion past cap", "ax", 2, 2);
+  /* the rest of the character is past `n', it must not be looked at */
+  normalise("cut at n", "ab\xd8\xb4", 3, 256);
+  normalise("long", line, strlen(line), 256);
+  normalise("zero byte", "ab\0x", 4, 256);
+  char out[16];
+  printf("no consumed: written %zu\n",
+         __nlex_pure_normalise_buf("ab", 2, out, sizeof out, NULL));
+  /* called in the middle of the lexer's own expansion of 'x', the stream
+   * of __nlex_pure_normalise carries on as if it had not been */
+  char plain[3], interrupted[3];
+  __nlex_feed("xy");
+  for (int i = 0; i < 3; ++i)
+    plain[i] = __nlex_pure_normalise();
+  __nlex_feed("xy");
+  interrupted[0] = __nlex_pure_normalise();
+  normalise("mid-expansion", "ax", 2, 256);
+  for (int i = 1; i < 3; ++i)
+    interrupted[i] = __nlex_pure_normalise();
+  printf("mid-expansion stream: %s\n",
+         memcmp(plain, interrupted, sizeof plain) ? "changed" : "unchanged");
+  return 0;
+}
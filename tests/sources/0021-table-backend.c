@@ -0,0 +1,14 @@
+/* the same tokens whatever the backend (list-tests runs this with each) */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if (res.errc || res.length == 0)
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+/* the tags decided while the tokens are read (0009-pos) against the ones of
+ * whole sentences, from nlex_tag_document */
+#include "driver.h"
+
+int main() {
+  char *input = read_input(NULL);
+  size_t count;
+  struct sresult *document = nlex_tag_document(input, 1, &count);
+  struct sresult res = {0};
+  __nlex_feed(input);
+  for (size_t i = 0;; ++i) {
+    __nlex_root(&res);
+    if (res.errc || res.length == 0)
+      break;
+    printf("'%.*s' %s, whole sentence %s\n", res.length, res.start, res.pos,
+           i < count ? document[i].pos : "-");
+  }
+  printf("%zu tokens in the document\n", count);
+  free(document);
+  return 0;
+}
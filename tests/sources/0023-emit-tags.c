@@ -0,0 +1,16 @@
+/* only the tokens of emit_tags come back, the end of the input after a
+ * dropped token is an empty token */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    if (res.errc || res.length == 0)
+      break;
+    print_token(&res);
+  }
+  printf("end at %ld\n", (long)__nlex_distance());
+  return 0;
+}
@@ -0,0 +1,19 @@
+/* count_only returns once, at the end of the input, and has counted the
+ * tokens of emit_tags by tag id */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  int calls = 0;
+  __nlex_feed(read_input(NULL));
+  do {
+    __nlex_root(&res);
+    ++calls;
+  } while (res.errc == 0 && res.length > 0);
+  printf("%d call, length %d\n", calls, res.length);
+  printf("word %lu, number %lu, space %lu\n",
+         (unsigned long)__nlex_tag_counts[NLEX_TAG_WORD],
+         (unsigned long)__nlex_tag_counts[NLEX_TAG_NUMBER],
+         (unsigned long)__nlex_tag_counts[NLEX_TAG_SPACE]);
+  return 0;
+}
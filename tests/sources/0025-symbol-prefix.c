@@ -0,0 +1,30 @@
+/* under --symbol-prefix pfx the lexer exports __pfx_* and the header has
+ * enum pfx_tag, which leaves the __nlex_* names free for another lexer */
+#include "driver.h"
+
+void __nlex_feed(char const *input) { (void)input; }
+void __nlex_root(struct sresult *result) { result->length = -1; }
+
+int main() {
+  struct sresult res;
+  size_t length;
+  char *input = read_input(&length);
+  __pfx_feed(input);
+  while (__pfx_distance() < (int64_t)length) {
+    __pfx_root(&res);
+    print_token(&res);
+    if (res.errc)
+      break;
+    if (res.tag_id != (!strcmp(res.tag, "word")     ? PFX_TAG_WORD
+                       : !strcmp(res.tag, "number") ? PFX_TAG_NUMBER
+                                                    : PFX_TAG_SPACE))
+      printf("tag_id %d does not match the enum\n", res.tag_id);
+  }
+
+  /* and through the table of functions */
+  struct nlex_functions const *fns = __pfx_functions();
+  fns->feed(input);
+  fns->root(&res);
+  print_token(&res);
+  return 0;
+}
@@ -0,0 +1,16 @@
+/* metadata bit 2 marks the skipped runs only, not the tokens that come back
+ * in the same sresult after one */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    if ((res.errc && res.errc != NLEX_ERRC_SKIPPED) || res.length == 0)
+      break;
+    printf("'%.*s' errc %d, metadata %d\n", res.length, res.start, res.errc,
+           res.metadata);
+  }
+  return 0;
+}
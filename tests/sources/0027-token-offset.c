@@ -0,0 +1,16 @@
+/* __nlex_token_offset maps the start of a token back into the original
+ * input, where __nlex_distance minus the (normalised) length does not */
+#include "driver.h"
+
+int main() {
+  struct sresult res;
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    if (res.errc || res.length == 0)
+      break;
+    printf("'%.*s' at %ld, ends at %ld\n", res.length, res.start,
+           (long)__nlex_token_offset(), (long)__nlex_distance());
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+/* nlex_tag_document tags the same on several threads as on one, and won't
+ * take over the lexer while a streaming feed still holds tokens */
+#include "driver.h"
+
+int main() {
+  char *input = read_input(NULL);
+  size_t one, many, differ = 0;
+  struct sresult *single = nlex_tag_document(input, 1, &one);
+  struct sresult *threaded = nlex_tag_document(input, 4, &many);
+  printf("%zu tokens on one thread, %zu on four\n", one, many);
+  for (size_t i = 0; i < one && i < many; ++i)
+    if (single[i].length != threaded[i].length ||
+        memcmp(single[i].start, threaded[i].start, single[i].length) ||
+        strcmp(single[i].pos, threaded[i].pos)) {
+      printf("token %zu: '%.*s' %s on one thread, '%.*s' %s on four\n", i,
+             single[i].length, single[i].start, single[i].pos,
+             threaded[i].length, threaded[i].start, threaded[i].pos);
+      ++differ;
+    }
+  printf("%zu differ\n", differ);
+
+  struct sresult res = {0};
+  size_t streamed = 0, refused_count = 1;
+  __nlex_feed(input);
+  __nlex_root(&res);
+  struct sresult *refused = nlex_tag_document(input, 4, &refused_count);
+  printf("while streaming: %s, count %zu\n", refused ? "tokens" : "null",
+         refused_count);
+  while (res.errc == 0 && res.length > 0) {
+    ++streamed;
+    __nlex_root(&res);
+  }
+  printf("%zu tokens streamed\n", streamed);
+  free(single);
+  free(threaded);
+  free(refused);
+  return 0;
+}
@@ -0,0 +1,19 @@
+/* a backreference repeats within its bounds, an empty capture matches in
+ * place, and a capture never compares past the end of the input */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    if (res.errc) {
+      printf("no match, errc %d\n", res.errc);
+      break;
+    }
+    if (res.length == 0)
+      break;
+    print_token(&res);
+  }
+  return 0;
+}
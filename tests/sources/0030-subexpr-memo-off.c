@@ -0,0 +1,17 @@
+/* `shout' calls \g1 at 'b' and 'c' before it fails on 'abcd!', so the
+ * token after the 'a' it falls back to calls \g1 at 'c' again: with
+ * memoise_subexpressions (0031-subexpr-memo-on) that is a memo hit, and the
+ * tokens must not change */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if (res.errc || res.length == 0)
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,2 @@
+/* 0030-subexpr-memo-off, through the memo table */
+#include "0030-subexpr-memo-off.c"
@@ -0,0 +1,20 @@
+/* three nested \g1 calls are within subexpr_depth_limit, the fourth fails
+ * the match with NLEX_ERRC_DEPTH_LIMIT rather than recursing */
+#include "driver.h"
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    if (res.errc) {
+      printf("errc %d%s\n", res.errc,
+             res.errc == NLEX_ERRC_DEPTH_LIMIT ? " (depth limit)" : "");
+      break;
+    }
+    if (res.length == 0)
+      break;
+    print_token(&res);
+  }
+  return 0;
+}
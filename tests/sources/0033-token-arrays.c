@@ -0,0 +1,27 @@
+/* __nlex_tokenise_arrays stops at `cap' tokens and carries on from there on
+ * the next call; skipped runs are kept, with their tag id and metadata */
+#include "driver.h"
+#include <stdint.h>
+
+#define CAP 16
+
+static char *input;
+
+static void print_arrays(size_t cap) {
+  uint32_t offset[CAP], length[CAP];
+  uint16_t tag[CAP];
+  uint8_t flags[CAP];
+  size_t n = __nlex_tokenise_arrays(offset, length, tag, flags, cap);
+  printf("cap %zu: %zu tokens\n", cap, n);
+  for (size_t i = 0; i < n; ++i)
+    printf("  '%.*s' offset %u, length %u, tag %u, flags %u\n", (int)length[i],
+           input + offset[i], offset[i], length[i], tag[i], flags[i]);
+}
+
+int main() {
+  __nlex_feed(input = read_input(NULL));
+  print_arrays(4);
+  print_arrays(CAP);
+  print_arrays(CAP);
+  return 0;
+}
@@ -0,0 +1,27 @@
+/* integer `/' truncates and comparisons of integers are integers, while
+ * anything with a double in it is computed in doubles; annotated ptr
+ * values are byte addresses */
+#include "driver.h"
+#include <stdint.h>
+
+double show_i(char const *what, int64_t n) {
+  printf("  %s = %lld\n", what, (long long)n);
+  return 0;
+}
+
+double show_d(char const *what, double x) {
+  printf("  %s = %g\n", what, x);
+  return 0;
+}
+
+int main() {
+  struct sresult res = {0};
+  __nlex_feed(read_input(NULL));
+  while (1) {
+    __nlex_root(&res);
+    print_token(&res);
+    if (res.errc || res.length == 0)
+      break;
+  }
+  return 0;
+}
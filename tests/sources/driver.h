@@ -0,0 +1,33 @@
+/* Shared by the tests that bring their own main() (sources/<test>.c): they
+ * link the --library lexer with the helpers of ../src/rts.c, and are
+ * compiled with the lexer's --header included first */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* all of stdin, less the one trailing newline, like the RTS */
+static char *read_input(size_t *length) {
+  size_t size = 1 << 16, els = 0, got;
+  char *s = malloc(size + 1);
+  while ((got = fread(s + els, 1, size - els, stdin)) > 0) {
+    els += got;
+    if (els == size) {
+      size *= 2;
+      s = realloc(s, size + 1);
+    }
+  }
+  if (els && s[els - 1] == '\n')
+    --els;
+  s[els] = 0;
+  if (length)
+    *length = els;
+  return s;
+}
+
+static void print_token(const struct sresult *res) {
+  if (res->errc)
+    printf("no match {'%.*s' - %d}\n", res->length, res->start, res->length);
+  else
+    printf("match {'%.*s' - %s - %d %s %d}\n", res->length, res->start,
+           res->pos, res->length, res->tag, res->tag_id);
+}
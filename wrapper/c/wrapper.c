@@ -6,6 +6,8 @@ struct sresult {
   char const *tag;
   char errc;
   unsigned char metadata; // bit 0: stopword
+  char const *pos;
+  int tag_id;
 };
 extern void __nlex_root(struct sresult *);
 extern void __nlex_feed(char const *p);
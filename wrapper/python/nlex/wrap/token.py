@@ -1,8 +1,9 @@
 class Token(object):
-    def __init__(self, value, length, tag, metadata, offset):
+    def __init__(self, value, length, tag, metadata, offset, tag_id=0):
         self.raw = value[:length]
         self.length = length
         self.tag = tag[:]
+        self.tag_id = tag_id
         self.metadata = metadata
         self.offset = offset
         self.pos = None
@@ -16,6 +17,7 @@ class Token(object):
             'delete_ref': [], # we don't support this
             'log': 'correct', # not quite sure if it can handle nulls
             'is_stopword': bool(self.metadata&1),
+            'is_skipped': bool(self.metadata&4), # by option skip_on_error
             'POS': self.pos if self.pos else '',
             'stem': ''
         }
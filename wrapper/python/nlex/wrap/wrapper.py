@@ -7,6 +7,10 @@ from datetime import datetime
 from .nextfloat import next_up
 import sys
 
+# sresult.errc of a run skipped by `option skip_on_error' (NLEX_ERRC_SKIPPED
+# in src/errc.h): it comes back as a token, and there is more after it
+ERRC_SKIPPED = 44
+
 class NLexWrappedObject(object):
     class ValueStruct(ctypes.Structure):
         _fields_ = [
@@ -16,28 +20,36 @@ class NLexWrappedObject(object):
             ("errc", ctypes.c_char),
             ("metadata", ctypes.c_ubyte),
             ("pos", ctypes.POINTER(ctypes.c_char)),
-            ("allocd", ctypes.c_int),
+            ("tag_id", ctypes.c_int),
         ]
         def __repr__(self):
             return f"NLexWrappedObject.ValueStruct(start={self.start}, length={self.length}, tag={self.tag}, errc={self.errc}, metadata={self.metadata})"
 
-    def __init__(self, path=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libtokenise.so'), log=False):
+    def __init__(self, path=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libtokenise.so'), log=False, prefix=None):
         self.log = log
+        self.prefix = prefix
         self.__lib = cdll.LoadLibrary(path)
         self._fed = None
         self._m_value = NLexWrappedObject.ValueStruct()
-        self._nlex_feed = getattr(self.__lib, '__nlex_feed')
+        self._nlex_feed = getattr(self.__lib, self._symbol('__nlex_feed'))
         self._nlex_feed.argtypes = (ctypes.c_char_p,)
-        self._nlex_root = getattr(self.__lib, '__nlex_root')
+        self._nlex_root = getattr(self.__lib, self._symbol('__nlex_root'))
         self._nlex_root.argtypes = (ctypes.POINTER(NLexWrappedObject.ValueStruct),)
-        self._nlex_distance = getattr(self.__lib, '__nlex_distance')
-        self.__nlex_skip = getattr(self.__lib, '__nlex_skip')
-        self.__has_postag = ctypes.c_int.in_dll(self.__lib, '__nlex_has_tagpos')
+        self._nlex_distance = getattr(self.__lib, self._symbol('__nlex_distance'))
+        self._nlex_distance.restype = ctypes.c_int64
+        try:
+            # the start of a token in the input, also under `option normalise_ahead'
+            self._nlex_token_offset = getattr(self.__lib, self._symbol('__nlex_token_offset'))
+            self._nlex_token_offset.restype = ctypes.c_int64
+        except AttributeError:
+            self._nlex_token_offset = None
+        self.__nlex_skip = getattr(self.__lib, self._symbol('__nlex_skip'))
+        self.__has_postag = ctypes.c_int.in_dll(self.__lib, self._symbol('__nlex_has_tagpos'))
         self.can_split_sentences = self.__has_postag
         self.__postag_gram = None
         if self.__has_postag:
-            self.__postag_gram = ctypes.c_int.in_dll(self.__lib, '__nlex_tagpos_gram')
-            self.__sentence_delimiter = ctypes.string_at(ctypes.addressof(ctypes.c_char.in_dll(self.__lib, '__nlex_ptag')))
+            self.__postag_gram = ctypes.c_int.in_dll(self.__lib, self._symbol('__nlex_tagpos_gram'))
+            self.__sentence_delimiter = ctypes.string_at(ctypes.addressof(ctypes.c_char.in_dll(self.__lib, self._symbol('__nlex_ptag'))))
             # self.token_array_space = (NLexWrappedObject.ValueStruct * 4096)() # 4096 tokens in a sentence...?
             self._create_postagger()
 
@@ -45,10 +57,35 @@ class NLexWrappedObject(object):
         self.__last_offset = -1
         self.total = 0
         try:
-            self._nlex_pure_normalise = getattr(self.__lib, '__nlex_pure_normalise')
+            self._nlex_pure_normalise = getattr(self.__lib, self._symbol('__nlex_pure_normalise'))
             self._nlex_pure_normalise.restype = ctypes.c_char
         except AttributeError:
             self.__has_normaliser = False
+        try:
+            self._nlex_pure_normalise_buf = getattr(self.__lib, self._symbol('__nlex_pure_normalise_buf'))
+            self._nlex_pure_normalise_buf.argtypes = (ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t,
+                                                      ctypes.POINTER(ctypes.c_size_t))
+            self._nlex_pure_normalise_buf.restype = ctypes.c_size_t
+        except AttributeError:
+            self._nlex_pure_normalise_buf = None
+        try:
+            self._nlex_tokenise_arrays = getattr(self.__lib, self._symbol('__nlex_tokenise_arrays'))
+            self._nlex_tokenise_arrays.argtypes = (
+                ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(ctypes.c_uint32),
+                ctypes.POINTER(ctypes.c_uint16), ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t)
+            self._nlex_tokenise_arrays.restype = ctypes.c_size_t
+        except AttributeError:
+            self._nlex_tokenise_arrays = None
+
+    def _symbol(self, name):
+        # the name `name' is exported as by a lexer built with --symbol-prefix
+        if not self.prefix:
+            return name
+        if name.startswith('__nlex_'):
+            return f'__{self.prefix}_{name[7:]}'
+        if name.startswith('nlex_'):
+            return f'{self.prefix}_{name[5:]}'
+        return f'{self.prefix}_{name}'
 
     def _create_postagger(self):
         def next_sentence(cleanup):
@@ -106,9 +143,13 @@ class NLexWrappedObject(object):
             raise Exception("NLexWrappedObject.__next_token called before __feed")
 
         self._nlex_root(ctypes.pointer(self._m_value))
-        offset = self._nlex_distance()-self._m_value.length
+        if self._nlex_token_offset:
+            offset = self._nlex_token_offset()
+        else:
+            # only right if the lexer doesn't normalise ahead
+            offset = self._nlex_distance()-self._m_value.length
         if cleanup:
-            if self._m_value.errc != b'\0': # TODO: can_produce_token()
+            if ord(self._m_value.errc) not in (0, ERRC_SKIPPED): # TODO: can_produce_token()
                 self._fed = None
                 return None
 
@@ -130,7 +171,8 @@ class NLexWrappedObject(object):
             length=self._m_value.length,
             tag=self._m_value.tag,
             metadata=self._m_value.metadata,
-            offset=offset
+            offset=offset,
+            tag_id=self._m_value.tag_id
         )
 
     def __next_normalised_char(self):
@@ -158,7 +200,45 @@ class NLexWrappedObject(object):
             yield x
             i += 1
 
+    def token_arrays(self, capacity=65536):
+        """
+        Tokenise (up to `capacity' tokens of) the fed input into ctypes arrays
+        (offset, length, tag id, metadata), numpy.ctypeslib.as_array() takes
+        them as they are. Needs `option token_arrays on'
+        """
+        if not self._nlex_tokenise_arrays:
+            raise Exception("NLex object not built with `option token_arrays on`")
+        if not self._fed:
+            raise Exception("NLexWrappedObject.token_arrays called before __feed")
+        offset = (ctypes.c_uint32 * capacity)()
+        length = (ctypes.c_uint32 * capacity)()
+        tag = (ctypes.c_uint16 * capacity)()
+        flags = (ctypes.c_uint8 * capacity)()
+        n = self._nlex_tokenise_arrays(offset, length, tag, flags, capacity)
+        return tuple((t * n).from_buffer(a) for t, a in
+                     ((ctypes.c_uint32, offset), (ctypes.c_uint32, length), (ctypes.c_uint16, tag), (ctypes.c_uint8, flags)))
+
     def normalise_all(self):
+        if self._nlex_pure_normalise_buf:
+            if not self._fed:
+                raise Exception("NLexWrappedObject.normalise_all called before __feed")
+            # normalise everything after the current position, going on from
+            # where the last call stopped if the output filled up
+            start = self._nlex_distance()
+            n = self.fedlen - start
+            out = ctypes.create_string_buffer(2 * n + 16)
+            consumed = ctypes.c_size_t()
+            parts = []
+            while n > 0:
+                src = ctypes.cast(ctypes.byref(self._fed, start), ctypes.c_char_p)
+                written = self._nlex_pure_normalise_buf(src, n, out, len(out), ctypes.byref(consumed))
+                parts.append(out.raw[:written])
+                if consumed.value == 0:
+                    break  # at a zero byte
+                start += consumed.value
+                n -= consumed.value
+            self._fed = None
+            return b''.join(parts)
         x = b''
         buf = b''
         while x != b'\0':